@@ -0,0 +1,212 @@
+#define _GNU_SOURCE
+#include "batch.h"
+#include "libfar.h"
+#include "encrypt.h"
+#include "channel.h"
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <stdatomic.h>
+
+typedef struct {
+    int line;          // in the manifest, for reports
+    bool decrypt;
+    char* archiveName;
+    int nodeC;         // files for encrypt, 0 or 1 directory for decrypt
+    char** nodes;
+} Job;
+
+typedef struct {
+    Job* jobs;
+    int jobC;
+    atomic_int nextJob;
+    atomic_int failures;
+    char* password;
+    bool compressionOnly;
+    int flags;
+} Batch;
+
+// splits the manifest into jobs. the fields point into text
+static void parseManifest(Batch* batch, char* text)
+{
+    int capacity = 16;
+    batch->jobs = calloc(capacity, sizeof(Job));
+    batch->jobC = 0;
+    int lineNumber = 0;
+    char* line = text;
+    while (line && *line)
+    {
+        lineNumber++;
+        char* next = strchr(line, '\n');
+        if (next) *next++ = '\0';
+        if (*line == '\0' || *line == '#')
+        {
+            line = next;
+            continue;
+        }
+
+        int fieldC = 1;
+        for (char* c = line; *c; c++) if (*c == '\t') fieldC++;
+        char* fields[fieldC];
+        fields[0] = line;
+        for (int i = 1; i < fieldC; i++)
+        {
+            fields[i] = strchr(fields[i-1], '\t');
+            *fields[i]++ = '\0';
+        }
+
+        Job job;
+        job.line = lineNumber;
+        if (!strcmp(fields[0], "encrypt") && fieldC >= 3) job.decrypt = false;
+        else if (!strcmp(fields[0], "decrypt") && fieldC >= 2 && fieldC <= 3)
+            job.decrypt = true;
+        else DIE("Invalid job on line %d of manifest: %s", lineNumber, line);
+        job.archiveName = fields[1];
+        job.nodeC = fieldC - 2;
+        job.nodes = calloc(job.nodeC + 1, sizeof(char*));
+        memcpy(job.nodes, fields + 2, job.nodeC * sizeof(char*));
+
+        if (batch->jobC == capacity)
+        {
+            capacity *= 2;
+            batch->jobs = realloc(batch->jobs, capacity * sizeof(Job));
+        }
+        batch->jobs[batch->jobC++] = job;
+        line = next;
+    }
+}
+
+static double secondsSince(struct timespec* start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec - start->tv_sec + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static void runJob(Batch* batch, Job* job, FarContext* context)
+{
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    // each job zeroes the password it is given
+    char* password = batch->password ? strdup(batch->password) : NULL;
+
+    int status = FAR_ERROR;
+    const char* error = NULL;
+    // strerror is not thread-safe, and other calls come before the report
+    char errorBuffer[256];
+    if (job->decrypt)
+    {
+        char* root = job->nodeC ? job->nodes[0] : NULL;
+        int archive = open(job->archiveName, O_RDONLY);
+        if (archive < 0)
+            error = strerror_r(errno, errorBuffer, sizeof(errorBuffer));
+        else
+        {
+            if (batch->compressionOnly)
+                status = farExtract(context, archive, root);
+            else status = farUnprotect(context, password, archive, root);
+            if (close(archive)) SYS_ERROR("close");
+            if (status == FAR_OK && removeOriginal && remove(job->archiveName))
+                SYS_ERROR("remove");
+        }
+    }
+    else
+    {
+        int archive = open(job->archiveName, O_WRONLY|O_CREAT|O_TRUNC,
+            ARCHIVE_PERMISSION);
+        if (archive < 0)
+            error = strerror_r(errno, errorBuffer, sizeof(errorBuffer));
+        else
+        {
+            if (batch->compressionOnly)
+                status = farArchive(context, archive, NULL, job->nodeC,
+                    job->nodes);
+            else status = farProtect(context, password, archive, NULL,
+                job->nodeC, job->nodes);
+            if (close(archive)) SYS_ERROR("close");
+        }
+    }
+    if (status != FAR_OK && !error) error = farError(context);
+    free(password);
+
+    char* operation = job->decrypt ? "decrypt" : "encrypt";
+    double seconds = secondsSince(&start);
+    if (status == FAR_OK)
+    {
+        STATUS("Job %d (%s %s) finished in %gs", job->line, operation,
+            job->archiveName, seconds);
+    }
+    else
+    {
+        atomic_fetch_add(&batch->failures, 1);
+        WARN("Job %d (%s %s) failed after %gs: %s", job->line, operation,
+            job->archiveName, seconds, error);
+    }
+}
+
+static void* runWorker(void* arg)
+{
+    Batch* batch = arg;
+    FarContext* context = farNewContext();
+    if (!context) DIE("%s", "Out of memory");
+    farSetFlags(context, batch->flags);
+
+    int next;
+    while ((next = atomic_fetch_add(&batch->nextJob, 1)) < batch->jobC)
+        runJob(batch, batch->jobs + next, context);
+
+    farFreeContext(context);
+    return NULL;
+}
+
+int runBatch(char* manifest, char* password, int workers,
+    bool compressionOnly)
+{
+    // read the whole manifest
+    int manifestFile = open(manifest, O_RDONLY);
+    if (manifestFile < 0) SYS_DIE("open manifest");
+    char* text = NULL;
+    long textLen = 0;
+    int textWriter = openMemoryWriter(&text, &textLen);
+    char buffer[BUFSIZ];
+    int bufferLen;
+    while ((bufferLen = rdhangPartial(manifestFile, buffer, BUFSIZ)) > 0)
+        if (fdwrite(textWriter, buffer, bufferLen) < bufferLen)
+            SYS_DIE("write");
+    fdputc('\0', textWriter);
+    if (fdclose(textWriter)) SYS_ERROR("close");
+    if (close(manifestFile)) SYS_ERROR("close");
+
+    Batch batch;
+    parseManifest(&batch, text);
+    atomic_init(&batch.nextJob, 0);
+    atomic_init(&batch.failures, 0);
+    batch.password = password;
+    batch.compressionOnly = compressionOnly;
+    // jobs run with the options given on the command line
+    batch.flags = optionFlags();
+
+    if (workers <= 0) workers = sysconf(_SC_NPROCESSORS_ONLN);
+    if (workers > batch.jobC) workers = batch.jobC;
+    STATUS("Running %d jobs on %d workers", batch.jobC, workers);
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    Stage* pool = calloc(workers, sizeof(Stage));
+    for (int i = 0; i < workers; i++)
+        startStage(pool + i, "Worker", runWorker, &batch);
+    for (int i = 0; i < workers; i++)
+        joinStage(pool + i);
+    free(pool);
+
+    int failures = atomic_load(&batch.failures);
+    STATUS("Ran %d jobs in %gs, %d failed", batch.jobC, secondsSince(&start),
+        failures);
+
+    for (int i = 0; i < batch.jobC; i++) free(batch.jobs[i].nodes);
+    free(batch.jobs);
+    free(text);
+    return failures;
+}
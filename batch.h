@@ -0,0 +1,26 @@
+/**
+ * Batch mode: runs every job in a manifest on one pool of worker threads
+ *
+ * Each line of the manifest is a job, with fields separated by tabs so that
+ * paths may contain spaces. Empty lines and lines starting with # are skipped.
+ *     encrypt <TAB> ArchiveName <TAB> File1 <TAB> File2 ...
+ *     decrypt <TAB> ArchiveName [<TAB> Directory]
+ * decrypt extracts into Directory, or the working directory without one.
+ *
+ * Workers take the next job as they finish one, and keep their dictionaries
+ * and buffers from job to job. A failed job is reported and doesn't stop the
+ * others. The time of each job is reported when it finishes.
+ */
+
+#ifndef BATCH_H
+#define BATCH_H
+
+#include "bitcode.h"
+
+// runs the jobs in manifest with the given number of worker threads
+// (0 for one per CPU). password (NULL for the default) is used for all jobs
+// returns the number of jobs which failed
+int runBatch(char* manifest, char* password, int workers,
+    bool compressionOnly);
+
+#endif
@@ -0,0 +1,431 @@
+/**
+ * Microbenchmarks of the hot loops: bit packing, the LZW dictionaries,
+ * encode/decode, the CRC and the cipher.
+ * Usage: bench [--json] [--size=Bytes] [--time=Seconds] [Name ...]
+ *
+ * Each benchmark runs over a generated input of --size bytes (1MB by default)
+ * until --time seconds (0.5 by default) have passed, and reports its
+ * throughput per input byte and the allocations (calls to malloc, calloc and
+ * realloc) per run. Allocations are only counted with glibc.
+ * Names select the benchmarks whose name or name/input contains one of them.
+ * --json prints one JSON object instead of a table, for comparing runs.
+ */
+
+#define _GNU_SOURCE
+#include "encrypt.h"
+#include "bitcode.h"
+#include "channel.h"
+#include "stringtable.h"
+#include "stringarray.h"
+#include "lzw.h"
+#include "crc.h"
+#ifdef ENCRYPT
+#include "rsa.h"
+#include <gmp.h>
+#endif
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <stdatomic.h>
+
+// == ALLOCATION MODULE ====================================================
+
+#ifdef __GLIBC__
+#define COUNTS_ALLOCATIONS (1)
+
+static atomic_long allocations;
+
+extern void* __libc_malloc(size_t size);
+extern void* __libc_calloc(size_t count, size_t size);
+extern void* __libc_realloc(void* pointer, size_t size);
+
+void* malloc(size_t size)
+{
+    atomic_fetch_add_explicit(&allocations, 1, memory_order_relaxed);
+    return __libc_malloc(size);
+}
+
+void* calloc(size_t count, size_t size)
+{
+    atomic_fetch_add_explicit(&allocations, 1, memory_order_relaxed);
+    return __libc_calloc(count, size);
+}
+
+void* realloc(void* pointer, size_t size)
+{
+    atomic_fetch_add_explicit(&allocations, 1, memory_order_relaxed);
+    return __libc_realloc(pointer, size);
+}
+
+static long countAllocations(void)
+{
+    return atomic_load(&allocations);
+}
+#else
+#define COUNTS_ALLOCATIONS (0)
+
+static long countAllocations(void)
+{
+    return 0;
+}
+#endif
+
+// == INPUT MODULE =========================================================
+
+// same numbers on every run and platform
+static unsigned long long lcgState;
+
+static unsigned int nextRandom(void)
+{
+    lcgState = lcgState * 6364136223846793005ULL + 1442695040888963407ULL;
+    return lcgState >> 33;
+}
+
+static char* words[] = {
+    "the", "of", "and", "to", "in", "is", "archive", "file", "directory",
+    "password", "compress", "encrypt", "stream", "block", "table", "code",
+    "that", "for", "it", "with", "as", "was", "on", "be", "at", "by", "this",
+    "from", "or", "which", "one", "all", "were", "when", "there", "can",
+    "an", "their", "what", "if", "will", "each", "about", "how", "up", "out",
+    "them", "then", "she", "many", "some", "so", "these", "would", "other"
+};
+
+// text (words and lines), random or zeros
+static void makeInput(char* kind, char* bytes, long len)
+{
+    lcgState = 1;
+    if (!strcmp(kind, "zeros")) memset(bytes, 0, len);
+    else if (!strcmp(kind, "random"))
+    {
+        for (long i = 0; i < len; i++) bytes[i] = nextRandom();
+    }
+    else
+    {
+        int wordC = sizeof(words) / sizeof(words[0]);
+        long i = 0;
+        int wordsOnLine = 0;
+        while (i < len)
+        {
+            char* word = words[nextRandom() % wordC];
+            while (*word && i < len) bytes[i++] = *word++;
+            if (i < len) bytes[i++] = ++wordsOnLine % 12 ? ' ' : '\n';
+        }
+    }
+}
+
+// == BENCHMARKS MODULE ====================================================
+
+typedef struct {
+    char* bytes;      // the input
+    long len;
+    char* prepared;   // made from the input by the setup
+    long preparedLen;
+} Data;
+
+typedef struct {
+    char* name;
+    char* input;
+    void (*setup)(Data*); // NULL if there's nothing to prepare
+    void (*run)(Data*);
+} Benchmark;
+
+// widths cycle through everything encode uses
+#define BITS_FOR(i) (9 + (i) % 12)
+
+static void runPutBits(Data* data)
+{
+    char* bytes = NULL;
+    long len = 0;
+    int out = openMemoryWriter(&bytes, &len);
+    BitCache cache = {0, 0};
+    unsigned char* in = (unsigned char*)data->bytes;
+    for (long i = 0; i + 1 < data->len; i += 2)
+        putBits(BITS_FOR(i / 2), in[i] << CHAR_BIT | in[i+1], out, &cache);
+    flushBits(out, &cache);
+    if (fdclose(out)) SYS_DIE("close");
+    free(data->prepared);
+    data->prepared = bytes;
+    data->preparedLen = len;
+}
+
+static void runGetBits(Data* data)
+{
+    int in = openMemoryReader(data->prepared, data->preparedLen);
+    BitCache cache = {0, 0};
+    for (long i = 0; getBits(BITS_FOR(i), in, &cache) != EOF; i++);
+    if (fdclose(in)) SYS_DIE("close");
+}
+
+// the code with no prefix, as in lzw.c
+#define EMPTY (0)
+
+// the dictionary work of encode(): look up every byte after the current
+// code, adding a code whenever the lookup misses
+static void runStringTable(Data* data)
+{
+    HashTable table = makeTable();
+    int nextCode = 1;
+    for (int i = 0; i < 256; i++)
+        insertIntoTable(table, (Element){EMPTY, i, nextCode++, 0});
+    int C = EMPTY;
+    for (long i = 0; i < data->len; i++)
+    {
+        char K = data->bytes[i];
+        Node lookup = searchTable(table, C, K);
+        if (!lookup)
+        {
+            if (nextCode == 1<<20)
+            {
+                freeTable(table);
+                table = makeTable();
+                nextCode = 1;
+                for (int j = 0; j < 256; j++)
+                    insertIntoTable(table, (Element){EMPTY, j,
+                        nextCode++, 0});
+            }
+            else insertIntoTable(table, (Element){C, K, nextCode++, 0});
+            lookup = searchTable(table, EMPTY, K);
+        }
+        C = lookup->elt.CODE;
+        lookup->elt.frequency++;
+    }
+    freeTable(table);
+}
+
+// the dictionary work of decode(): add a code for every byte, then follow
+// each code's prefixes
+static void runStringArray(Data* data)
+{
+    Array array = makeArray();
+    for (long i = 0; i < data->len; i++)
+    {
+        // earlier codes, so every chain ends
+        int PREF = array->count ? nextRandom() % array->count : 0;
+        insertIntoArray(array, (ArrayElement){PREF, data->bytes[i], 0});
+    }
+    long steps = 0;
+    for (int code = array->count; code > 0 && steps < data->len; code--)
+    {
+        for (ArrayElement* elt = searchArray(array, code); elt && elt->PREF &&
+            steps < data->len; elt = searchArray(array, elt->PREF)) steps++;
+    }
+    freeArray(array);
+}
+
+static void runEncode(Data* data)
+{
+    char* bytes = NULL;
+    long len = 0;
+    int in = openMemoryReader(data->bytes, data->len);
+    int out = openMemoryWriter(&bytes, &len);
+    encode(in, out);
+    if (fdclose(in) || fdclose(out)) SYS_DIE("close");
+    free(data->prepared);
+    data->prepared = bytes;
+    data->preparedLen = len;
+}
+
+static void runDecode(Data* data)
+{
+    char* bytes = NULL;
+    long len = 0;
+    int in = openMemoryReader(data->prepared, data->preparedLen);
+    int out = openMemoryWriter(&bytes, &len);
+    decode(in, out, data->len);
+    if (fdclose(in) || fdclose(out)) SYS_DIE("close");
+    if (len != data->len || memcmp(bytes, data->bytes, len))
+        DIE("%s", "decode did not reproduce its input");
+    free(bytes);
+}
+
+static checktype lastChecksum;
+
+static void runComputeCRC(Data* data)
+{
+    FILE* in = fmemopen(data->bytes, data->len, "r");
+    if (!in) SYS_DIE("fmemopen");
+    lastChecksum = computeCRC(in, -1);
+    if (fclose(in)) SYS_DIE("fclose");
+}
+
+static void runCheckCRC(Data* data)
+{
+    int in = openMemoryReader(data->bytes, data->len);
+    if (!checkCRC(in, -1, lastChecksum))
+        DIE("%s", "checkCRC disagrees with computeCRC");
+    if (fdclose(in)) SYS_DIE("close");
+}
+
+#ifdef ENCRYPT
+
+// the per-chunk work of encryptRSA(), without the password hashing and the
+// writing of the ciphertext
+static void runCipher(Data* data)
+{
+    // any seed but zero, which seedPRNG() can't shuffle with
+    unsigned char seed[64];
+    memset(seed, 0x5a, sizeof(seed));
+    gmp_randstate_t prng;
+    seedPRNG(seed, prng);
+    int in = openMemoryReader(data->bytes, data->len);
+    bool reachedEOF = false;
+    while (!reachedEOF)
+    {
+        int readLen;
+        mpz_t c;
+        encipherChunk(prng, in, c, &readLen, &reachedEOF);
+        mpz_clear(c);
+    }
+    if (fdclose(in)) SYS_DIE("close");
+    gmp_randclear(prng);
+}
+
+static void runEncryptRSA(Data* data)
+{
+    char* bytes = NULL;
+    long len = 0;
+    int in = openMemoryReader(data->bytes, data->len);
+    int out = openMemoryWriter(&bytes, &len);
+    encryptRSA(NULL, in, out);
+    if (fdclose(in) || fdclose(out)) SYS_DIE("close");
+    free(bytes);
+}
+
+#endif
+
+static Benchmark benchmarks[] = {
+    {"putBits", "random", NULL, runPutBits},
+    {"getBits", "random", runPutBits, runGetBits},
+    {"stringtable", "text", NULL, runStringTable},
+    {"stringarray", "text", NULL, runStringArray},
+    {"encode", "text", NULL, runEncode},
+    {"encode", "random", NULL, runEncode},
+    {"encode", "zeros", NULL, runEncode},
+    {"decode", "text", runEncode, runDecode},
+    {"decode", "random", runEncode, runDecode},
+    {"decode", "zeros", runEncode, runDecode},
+    {"computeCRC", "random", NULL, runComputeCRC},
+    {"checkCRC", "random", runComputeCRC, runCheckCRC},
+#ifdef ENCRYPT
+    {"cipher", "random", NULL, runCipher},
+    {"encryptRSA", "random", NULL, runEncryptRSA},
+#endif
+};
+
+// == HARNESS MODULE =======================================================
+
+typedef struct {
+    Benchmark* benchmark;
+    long runs;
+    double seconds;   // per run
+    double allocations; // per run
+} Result;
+
+static double now(void)
+{
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+static void measure(Benchmark* benchmark, long size, double minSeconds,
+    Result* result)
+{
+    Data data = {malloc(size), size, NULL, 0};
+    if (!data.bytes) DIE("%s", "Out of memory");
+    makeInput(benchmark->input, data.bytes, size);
+    if (benchmark->setup) benchmark->setup(&data);
+    // warm up caches and the allocator
+    benchmark->run(&data);
+
+    long allocationsBefore = countAllocations();
+    double start = now();
+    double elapsed = 0;
+    long runs = 0;
+    while (elapsed < minSeconds || runs < 1)
+    {
+        benchmark->run(&data);
+        runs++;
+        elapsed = now() - start;
+    }
+    result->benchmark = benchmark;
+    result->runs = runs;
+    result->seconds = elapsed / runs;
+    result->allocations = (double)(countAllocations() - allocationsBefore)
+        / runs;
+    free(data.prepared);
+    free(data.bytes);
+}
+
+static bool selected(Benchmark* benchmark, int nameC, char** names)
+{
+    if (nameC == 0) return true;
+    char fullName[64];
+    snprintf(fullName, sizeof(fullName), "%s/%s", benchmark->name,
+        benchmark->input);
+    for (int i = 0; i < nameC; i++)
+        if (strstr(fullName, names[i])) return true;
+    return false;
+}
+
+int main(int argc, char** argv)
+{
+    bool json = false;
+    long size = 1<<20;
+    double minSeconds = 0.5;
+    char* names[argc];
+    int nameC = 0;
+    for (int i = 1; i < argc; i++)
+    {
+        if (!strcmp(argv[i], "--json")) json = true;
+        else if (!strncmp(argv[i], "--size=", 7)) size = atol(argv[i] + 7);
+        else if (!strncmp(argv[i], "--time=", 7))
+            minSeconds = atof(argv[i] + 7);
+        else if (argv[i][0] == '-')
+        {
+            fprintf(stderr, "Usage:\n%s [--json] [--size=Bytes] "
+                "[--time=Seconds] [Name ...]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+        else names[nameC++] = argv[i];
+    }
+    if (size < 2) DIE("Invalid size %ld", size);
+    quiet = true;
+
+    int benchmarkC = sizeof(benchmarks) / sizeof(benchmarks[0]);
+    if (json) printf("{\"size\": %ld, \"benchmarks\": [", size);
+    else printf("%-12s %-7s %10s %10s %12s\n", "benchmark", "input", "MB/s",
+        "ns/byte", "allocs/run");
+    bool first = true;
+    for (int i = 0; i < benchmarkC; i++)
+    {
+        Benchmark* benchmark = benchmarks + i;
+        if (!selected(benchmark, nameC, names)) continue;
+        Result result;
+        measure(benchmark, size, minSeconds, &result);
+        double mbPerSecond = size / result.seconds / 1e6;
+        double nsPerByte = result.seconds * 1e9 / size;
+        if (json)
+        {
+            printf("%s\n  {\"name\": \"%s\", \"input\": \"%s\", "
+                "\"runs\": %ld, \"seconds_per_run\": %.9f, "
+                "\"mb_per_s\": %.3f, \"ns_per_byte\": %.3f, ",
+                first ? "" : ",", benchmark->name, benchmark->input,
+                result.runs, result.seconds, mbPerSecond, nsPerByte);
+            if (COUNTS_ALLOCATIONS)
+                printf("\"allocs_per_run\": %.1f}", result.allocations);
+            else printf("\"allocs_per_run\": null}");
+        }
+        else
+        {
+            printf("%-12s %-7s %10.2f %10.2f ", benchmark->name,
+                benchmark->input, mbPerSecond, nsPerByte);
+            if (COUNTS_ALLOCATIONS) printf("%12.1f\n", result.allocations);
+            else printf("%12s\n", "-");
+        }
+        fflush(stdout);
+        first = false;
+    }
+    if (json) printf("\n]}\n");
+    return 0;
+}
@@ -0,0 +1,302 @@
+#!/usr/bin/env python3
+# end-to-end workloads: builds representative trees, runs encrypt/decrypt over
+# them in every mode, and compares the throughput with a baseline recorded
+# on the same machine
+#
+# usage: workload.py [--scale=N] [--dir=Path] [--bin=Dir] [--trees=a,b]
+#                    [--modes=a,b] [--baseline=File] [--threshold=F]
+#                    [--repeat=N] [--min-seconds=F]
+#                    [--write-baseline] [--json=File]
+#
+# trees (sizes at --scale=1, everything grows linearly with the scale):
+#   tiny   2000 files of up to 200 bytes (--scale=500 for a million)
+#   huge   2 files of 4MB of mixed text and binary
+#   media  incompressible random bytes in a few files
+#   logs   highly compressible log files
+#   deep   a directory nest 64 levels deep with a file at every level
+#
+# for each tree and mode (-qi plus "", -s, -c or -cs), records wall time, CPU
+# time and peak RSS of encrypt and of decrypt, the archive's ratio to the
+# tree, and checks the extracted tree is the same. each run is repeated
+# --repeat times (default 3) and the fastest kept. exits 1 if a run fails or
+# throughput fell more than --threshold (default 0.25) below the baseline.
+# runs faster than --min-seconds (default 1) in either the baseline or now
+# are too noisy to compare, and are only reported
+#
+# the baseline is bench/baseline.json, which is not checked in, as it only
+# means something on the machine which wrote it. record one there with
+# --write-baseline before changing anything, then compare against it
+
+import hashlib
+import json
+import os
+import random
+import shutil
+import subprocess
+import sys
+import tempfile
+import time
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+DEFAULT_BASELINE = os.path.join(HERE, "baseline.json")
+ALL_TREES = ["tiny", "huge", "media", "logs", "deep"]
+ALL_MODES = ["", "s", "c", "cs"]
+
+# == TREES ==================================================================
+
+WORDS = ("the of and to in is archive file directory password compress "
+         "encrypt stream block table code that for it with as was on be at "
+         "by this from or which one all were when there can an").split()
+
+
+def text(rng, size):
+    out = []
+    length = 0
+    while length < size:
+        word = rng.choice(WORDS)
+        out.append(word)
+        length += len(word) + 1
+    return " ".join(out).encode()[:size]
+
+
+def randomBytes(rng, size):
+    return rng.getrandbits(size * 8).to_bytes(size, "little") if size else b""
+
+
+def write(path, data):
+    with open(path, "wb") as f:
+        f.write(data)
+
+
+def makeTiny(root, scale, rng):
+    count = 2000 * scale
+    perDirectory = 1000
+    for i in range(count):
+        directory = os.path.join(root, "d%d" % (i // perDirectory))
+        if i % perDirectory == 0:
+            os.makedirs(directory)
+        write(os.path.join(directory, "f%d" % i),
+              text(rng, rng.randrange(1, 200)))
+
+
+def makeHuge(root, scale, rng):
+    for i in range(2):
+        with open(os.path.join(root, "huge%d" % i), "wb") as f:
+            # alternate text and binary so both paths of the encoder run
+            for block in range(4 * scale * 4):
+                if block % 2:
+                    f.write(randomBytes(rng, 1 << 18))
+                else:
+                    f.write(text(rng, 1 << 18))
+
+
+def makeMedia(root, scale, rng):
+    for i in range(4):
+        write(os.path.join(root, "media%d.jpg" % i),
+              randomBytes(rng, (1 << 20) * scale))
+
+
+def makeLogs(root, scale, rng):
+    levels = ["INFO", "INFO", "INFO", "DEBUG", "WARN", "ERROR"]
+    for i in range(4):
+        lines = []
+        for n in range(20000 * scale):
+            lines.append("2016-02-03 12:%02d:%02d [%s] worker %d: %s %d\n" % (
+                n // 60 % 60, n % 60, rng.choice(levels), rng.randrange(8),
+                rng.choice(["request served", "cache miss", "archive written",
+                            "retrying connection"]), rng.randrange(1000)))
+        write(os.path.join(root, "service%d.log" % i), "".join(lines).encode())
+
+
+def makeDeep(root, scale, rng):
+    path = root
+    for level in range(64):
+        path = os.path.join(path, "level%d" % level)
+        os.makedirs(path)
+        write(os.path.join(path, "file"), text(rng, 512 * scale))
+
+
+MAKERS = {"tiny": makeTiny, "huge": makeHuge, "media": makeMedia,
+          "logs": makeLogs, "deep": makeDeep}
+
+
+def treeDigest(root):
+    # (path, size, content) of every file, so an extraction can be compared
+    digest = hashlib.sha1()
+    total = 0
+    for directory, subdirectories, files in sorted(os.walk(root)):
+        subdirectories.sort()
+        for name in sorted(files):
+            path = os.path.join(directory, name)
+            with open(path, "rb") as f:
+                data = f.read()
+            total += len(data)
+            digest.update(os.path.relpath(path, root).encode())
+            digest.update(hashlib.sha1(data).digest())
+    return digest.hexdigest(), total
+
+
+# == RUNS ===================================================================
+
+def run(command, cwd):
+    # returns wall seconds, CPU seconds and peak RSS in bytes of the child
+    # stderr goes to a file, since a full pipe would block the child
+    with tempfile.TemporaryFile() as errors:
+        start = time.monotonic()
+        child = subprocess.Popen(command, cwd=cwd, stdin=subprocess.DEVNULL,
+                                 stderr=errors)
+        _, status, usage = os.wait4(child.pid, 0)
+        wall = time.monotonic() - start
+        child.returncode = 0  # reaped above
+        errors.seek(0)
+        error = errors.read().decode(errors="replace")
+    if os.WIFSIGNALED(status) or os.WEXITSTATUS(status):
+        raise RuntimeError("%s failed: %s" % (" ".join(command), error))
+    rss = usage.ru_maxrss * (1 if sys.platform == "darwin" else 1024)
+    return wall, usage.ru_utime + usage.ru_stime, rss
+
+
+def runTree(binDir, work, tree, mode, repeat):
+    source = os.path.join(work, "trees")
+    archive = os.path.join(work, "archive")
+    out = os.path.join(work, "out")
+    flags = "-qi" + mode
+    result = {"tree": tree, "mode": "-" + mode if mode else ""}
+    for attempt in range(repeat):
+        # the fastest of the repeats is the least disturbed by the machine
+        shutil.rmtree(out, ignore_errors=True)
+        os.makedirs(out)
+        if os.path.exists(archive):
+            os.remove(archive)
+        for operation, command, cwd in (
+                ("encrypt", ["encrypt", flags, archive, tree], source),
+                ("decrypt", ["decrypt", flags, archive], out)):
+            command[0] = os.path.join(binDir, command[0])
+            wall, cpu, rss = run(command, cwd)
+            best = result.get(operation)
+            if not best or wall < best["wall"]:
+                result[operation] = {"wall": wall, "cpu": cpu, "rss": rss}
+
+    digest, size = treeDigest(os.path.join(source, tree))
+    if treeDigest(os.path.join(out, tree))[0] != digest:
+        raise RuntimeError("%s %s: extracted tree differs" % (tree, flags))
+    result["bytes"] = size
+    result["ratio"] = os.path.getsize(archive) / size if size else 0
+    for operation in ("encrypt", "decrypt"):
+        stats = result[operation]
+        stats["mbPerSecond"] = size / stats["wall"] / 1e6
+    return result
+
+
+def key(result, operation):
+    return "%s %s %s" % (result["tree"], result["mode"] or "-", operation)
+
+
+# == MAIN ===================================================================
+
+def main(argv):
+    options = {"scale": "1", "dir": "/tmp/far-workload",
+               "bin": os.path.dirname(HERE), "trees": ",".join(ALL_TREES),
+               "modes": ",".join(m or "-" for m in ALL_MODES),
+               "baseline": DEFAULT_BASELINE, "threshold": "0.25",
+               "repeat": "3", "min-seconds": "1", "json": None}
+    writeBaseline = False
+    for arg in argv[1:]:
+        if arg == "--write-baseline":
+            writeBaseline = True
+        elif arg.startswith("--") and "=" in arg:
+            name, value = arg[2:].split("=", 1)
+            if name not in options:
+                sys.exit("unknown option " + arg)
+            options[name] = value
+        else:
+            sys.exit("usage: workload.py [--name=value ...] "
+                     "[--write-baseline], see the top of workload.py")
+
+    scale = int(options["scale"])
+    work = os.path.abspath(options["dir"])
+    trees = options["trees"].split(",")
+    modes = [m.strip("-") for m in options["modes"].split(",")]
+    threshold = float(options["threshold"])
+    repeat = max(1, int(options["repeat"]))
+    minSeconds = float(options["min-seconds"])
+
+    shutil.rmtree(work, ignore_errors=True)
+    os.makedirs(os.path.join(work, "trees"))
+    for tree in trees:
+        if tree not in MAKERS:
+            sys.exit("unknown tree " + tree)
+        root = os.path.join(work, "trees", tree)
+        os.makedirs(root)
+        MAKERS[tree](root, scale, random.Random(tree))
+
+    print("%-6s %-4s %9s %9s %9s %9s %9s %9s %7s" % (
+        "tree", "mode", "MB", "enc MB/s", "enc CPU", "enc RSS", "dec MB/s",
+        "dec CPU", "ratio"))
+    results = []
+    for tree in trees:
+        for mode in modes:
+            result = runTree(options["bin"], work, tree, mode, repeat)
+            results.append(result)
+            e, d = result["encrypt"], result["decrypt"]
+            print("%-6s %-4s %9.2f %9.2f %8.2fs %8.1fM %9.2f %8.2fs %7.3f" % (
+                tree, result["mode"] or "-", result["bytes"] / 1e6,
+                e["mbPerSecond"], e["cpu"], e["rss"] / 1e6,
+                d["mbPerSecond"], d["cpu"], result["ratio"]))
+            sys.stdout.flush()
+    shutil.rmtree(work, ignore_errors=True)
+
+    if options["json"]:
+        with open(options["json"], "w") as f:
+            json.dump({"scale": scale, "results": results}, f, indent=1)
+
+    throughput = {}
+    walls = {}
+    for result in results:
+        for operation in ("encrypt", "decrypt"):
+            throughput[key(result, operation)] = round(
+                result[operation]["mbPerSecond"], 3)
+            walls[key(result, operation)] = round(
+                result[operation]["wall"], 3)
+
+    if writeBaseline:
+        with open(options["baseline"], "w") as f:
+            json.dump({"scale": scale, "mbPerSecond": throughput,
+                       "wall": walls}, f, indent=1, sort_keys=True)
+            f.write("\n")
+        print("wrote " + options["baseline"])
+        return 0
+
+    if not os.path.exists(options["baseline"]):
+        print("no baseline at %s, record one with --write-baseline" %
+              options["baseline"])
+        return 0
+    with open(options["baseline"]) as f:
+        baseline = json.load(f)
+    if baseline["scale"] != scale:
+        print("baseline is for --scale=%d, not compared" % baseline["scale"])
+        return 0
+    regressions = 0
+    compared = 0
+    for name, mbPerSecond in sorted(throughput.items()):
+        expected = baseline["mbPerSecond"].get(name)
+        # a baseline from before walls were recorded can't tell, so it is
+        # taken as long enough
+        baselineWall = baseline.get("wall", {}).get(name, minSeconds)
+        if not expected:
+            continue
+        if min(walls[name], baselineWall) < minSeconds:
+            print("too short to compare %s: %.3fs" % (name, walls[name]))
+            continue
+        compared += 1
+        if mbPerSecond < expected * (1 - threshold):
+            print("REGRESSION %s: %.3f MB/s, baseline %.3f MB/s" % (
+                name, mbPerSecond, expected))
+            regressions += 1
+    print("%d of %d runs compared regressed more than %g%%" % (
+        regressions, compared, threshold * 100))
+    return 1 if regressions else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main(sys.argv))
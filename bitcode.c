@@ -2,26 +2,141 @@
 //
 // Implementation of putBits/getBits described in code.h
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include "bitcode.h"
 #include "encrypt.h"
+#include "channel.h"
+#include "stats.h"
 #include <sys/types.h>
 #include <sys/uio.h>
+#include <sys/stat.h>
 #include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#if !MAC
+#include <fcntl.h>
+#include <sys/sendfile.h>
+#endif
+
+// bytes moved by one call of fdcopy()'s copying
+#define COPY_BUFFER_SIZE (1 << 16)
+#define KERNEL_COPY_SIZE (1 << 30)
 
 // Information shared by putBits() and flushBits()
 
+long fdread(int fd, void* bytes, long len)
+{
+    long readLen;
+    if (isChannel(fd)) readLen = channelRead(fd, bytes, len);
+    else
+    {
+        readLen = read(fd, bytes, len);
+        ioCounts.readSyscalls++;
+    }
+    if (readLen > 0) ioCounts.bytesRead += readLen;
+    return readLen;
+}
+
+long fdwrite(int fd, const void* bytes, long len)
+{
+    long writeLen;
+    if (isChannel(fd)) writeLen = channelWrite(fd, bytes, len);
+    else
+    {
+        writeLen = write(fd, bytes, len);
+        ioCounts.writeSyscalls++;
+    }
+    if (writeLen > 0) ioCounts.bytesWritten += writeLen;
+    return writeLen;
+}
+
+int fdclose(int fd)
+{
+    if (isChannel(fd)) return channelClose(fd);
+    return heldClose(fd);
+}
+
+long long fdseek(int fd, long long offset, int whence)
+{
+    if (isChannel(fd)) return channelSeek(fd, offset, whence);
+    return lseek(fd, offset, whence);
+}
+
+#if !MAC
+// copies with whichever of copy_file_range(), splice() and sendfile() suits
+// in and out. returns false if the kernel can't copy them, before copying
+static bool kernelCopy(int in, int out, long long len, long long* copied)
+{
+    struct stat inData, outData;
+    if (fstat(in, &inData) || fstat(out, &outData)) return false;
+    bool piped = S_ISFIFO(inData.st_mode) || S_ISFIFO(outData.st_mode);
+    bool files = S_ISREG(inData.st_mode) && S_ISREG(outData.st_mode);
+    if (!piped && !S_ISREG(inData.st_mode)) return false;
+
+    while (len < 0 || *copied < len)
+    {
+        size_t count = KERNEL_COPY_SIZE;
+        if (len >= 0 && len - *copied < count) count = len - *copied;
+        ssize_t copyLen;
+        if (piped) copyLen = splice(in, NULL, out, NULL, count, SPLICE_F_MOVE);
+        else if (files) copyLen = copy_file_range(in, NULL, out, NULL, count,
+            0);
+        else copyLen = sendfile(out, in, NULL, count);
+        ioCounts.writeSyscalls++;
+        if (copyLen < 0 && errno == EINTR) continue;
+        if (copyLen < 0 && !*copied && (errno == EINVAL || errno == ENOSYS ||
+            errno == EXDEV || errno == EOPNOTSUPP || errno == EBADF))
+        {
+            return false;
+        }
+        if (copyLen < 0) SYS_DIE("copy");
+        if (copyLen == 0) break;
+        *copied += copyLen;
+        ioCounts.bytesRead += copyLen;
+        ioCounts.bytesWritten += copyLen;
+    }
+    return true;
+}
+#endif
+
+long long fdcopy(int in, int out, long long len)
+{
+    long long copied = 0;
+#if !MAC
+    if (!isChannel(in) && !isChannel(out) &&
+        kernelCopy(in, out, len, &copied))
+    {
+        return copied;
+    }
+#endif
+    char* buffer = malloc(COPY_BUFFER_SIZE);
+    if (!buffer) DIE("%s", "Out of memory");
+    while (len < 0 || copied < len)
+    {
+        long count = COPY_BUFFER_SIZE;
+        if (len >= 0 && len - copied < count) count = len - copied;
+        long readLen = fdread(in, buffer, count);
+        if (readLen < 0) SYS_DIE("read");
+        if (readLen == 0) break;
+        if (fdwrite(out, buffer, readLen) < readLen) SYS_DIE("write");
+        copied += readLen;
+    }
+    free(buffer);
+    return copied;
+}
+
 void fdputc(char c, int fd)
 {
-    if (write(fd, &c, 1) < 1) SYS_DIE("write");
+    if (fdwrite(fd, &c, 1) < 1) SYS_DIE("write");
 }
 
 int fdgetc(int fd)
 {
     unsigned char character;
     int readBytes;
-    if ((readBytes = read(fd, &character, 1)) < 0) SYS_DIE("read");
+    if ((readBytes = fdread(fd, &character, 1)) < 0) SYS_DIE("read");
     if (readBytes == 0) return EOF;
     return character;
 }
@@ -32,7 +147,7 @@ bool rdhang(int fd, void* bs, int len)
     if (len == 0) return true;
     int lengthRead = 0;
     int totalRead = 0;
-    while (len > 0 && (lengthRead = read(fd, bytes + totalRead, len)) > 0)
+    while (len > 0 && (lengthRead = fdread(fd, bytes + totalRead, len)) > 0)
     {
         len -= lengthRead;
         totalRead += lengthRead;
@@ -52,7 +167,7 @@ int rdhangPartial(int fd, void* bs, int len)
     if (len == 0) return true;
     int lengthRead = 0;
     int totalRead = 0;
-    while (len > 0 && (lengthRead = read(fd, bytes + totalRead, len)) > 0)
+    while (len > 0 && (lengthRead = fdread(fd, bytes + totalRead, len)) > 0)
     {
         len -= lengthRead;
         totalRead += lengthRead;
@@ -69,7 +184,7 @@ void putBits (int nBits, int code, int fd, BitCache* cache)
     unsigned int c;
 
     if (nBits > (sizeof(int)-1) * CHAR_BIT)
-    exit (fprintf (stderr, "putBits: nBits = %d too large\n", nBits));
+    DIE("putBits: nBits = %d too large", nBits);
 
     code &= (1 << nBits) - 1;                   // Clear high-order bits
     cache->nExtra += nBits;                     // Add new bits to extraBits
@@ -97,7 +212,7 @@ int getBits (int nBits, int fd, BitCache* cache)
     int c;
                                           
     if (nBits > (sizeof(cache->extraBits)-1) * CHAR_BIT)
-    exit (fprintf (stderr, "getBits: nBits = %d too large\n", nBits));
+    DIE("getBits: nBits = %d too large", nBits);
 
     // Read enough new bytes to have at least nBits bits to extract code
     while (cache->nExtra < nBits) {
@@ -112,6 +227,40 @@ int getBits (int nBits, int fd, BitCache* cache)
     return c;
 }
 
+void putLE(unsigned char* at, unsigned long long value, int len)
+{
+    for (int i = 0; i < len; i++) at[i] = value >> (CHAR_BIT * i);
+}
+
+unsigned long long getLE(const unsigned char* at, int len)
+{
+    unsigned long long value = 0;
+    for (int i = 0; i < len; i++)
+        value |= (unsigned long long)at[i] << (CHAR_BIT * i);
+    return value;
+}
+
+int putVarint(unsigned char* at, unsigned long long value)
+{
+    int len = 0;
+    for (; value >= 0x80; value >>= 7) at[len++] = (value & 0x7f) | 0x80;
+    at[len++] = value;
+    return len;
+}
+
+bool getVarint(const unsigned char** at, const unsigned char* end,
+    unsigned long long* value)
+{
+    *value = 0;
+    for (int shift = 0; *at < end && shift < 64; shift += 7)
+    {
+        unsigned char byte = *(*at)++;
+        *value |= (unsigned long long)(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) return true;
+    }
+    return false;
+}
+
 char* byteCount(double* size)
 {
     if (*size > 1000000000.0)
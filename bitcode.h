@@ -29,6 +29,21 @@ void flushBits (int fd, BitCache* cache);
 // Return next code (#bits = nBits) from standard input (EOF on end-of-file)
 int getBits (int nBits, int fd, BitCache* cache);
 
+// read(2), write(2) and close(2), but also accept channels (see channel.h)
+// fdclose() lets go of a descriptor held by a library call (see heldOpen())
+long fdread(int fd, void* bytes, long len);
+long fdwrite(int fd, const void* bytes, long len);
+int fdclose(int fd);
+
+// lseek(2), but also accepts channels, of which only some can seek
+long long fdseek(int fd, long long offset, int whence);
+
+// copies len bytes from in to out, or everything up to EOF if len < 0
+// file descriptors are copied by the kernel where it can, with
+// copy_file_range(2), splice(2) or sendfile(2), and anything else through a
+// buffer. returns the number of bytes copied, which is less than len at EOF
+long long fdcopy(int in, int out, long long len);
+
 // for getting and putting characters from file descriptors
 // does not cache, so is slow
 void fdputc(char c, int fd);
@@ -45,6 +60,22 @@ bool rdhang(int fd, void* bytes, int len);
 // different from read() because will only stop at EOF (not end of pipe)
 int rdhangPartial(int fd, void* bytes, int len);
 
+// puts value in the len bytes at, least significant first, and gets it back
+// for formats which read the same on every host
+void putLE(unsigned char* at, unsigned long long value, int len);
+unsigned long long getLE(const unsigned char* at, int len);
+
+// a varint is 7 bits to a byte, least significant first, with the high bit
+// set on every byte but the last
+#define VARINT_MAX (10)
+
+// returns the number of bytes put, at most VARINT_MAX
+int putVarint(unsigned char* at, unsigned long long value);
+
+// moves *at past the varint, or returns false if it runs past end
+bool getVarint(const unsigned char** at, const unsigned char* end,
+    unsigned long long* value);
+
 // returns static constant string like "MB" or "KB"
 char* byteCount(double* bytes);
 
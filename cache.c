@@ -0,0 +1,229 @@
+#define _GNU_SOURCE
+#include "cache.h"
+#include "encrypt.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+
+char* cachePath = NULL;
+
+// a cache file starts with CACHE_MAGIC, then a byte of CACHE_VERSION
+#define CACHE_MAGIC "FARCACH"
+#define CACHE_MAGIC_SIZE (7)
+#define CACHE_VERSION (1)
+#define CACHE_START (CACHE_MAGIC_SIZE + 1)
+
+// then records, little-endian:
+//  0 device u64           8 inode u64
+// 16 size i64            24 mtime seconds i64
+// 32 mtime nsec u32      36 codec u32
+// 40 checksum u64        48 flags u64
+// 56 extentCount u64     64 payloadLen u64
+// then extentCount extents of offset i64 and len i64, the payload, and
+// RECORD_END in 8 bytes, without which the record was cut short
+// the first KEY_SIZE bytes are what a file is looked up by
+#define KEY_SIZE (40)
+#define RECORD_SIZE (72)
+#define EXTENT_SIZE (16)
+#define RECORD_END (0x444e454843414346ULL)
+
+#define RECORD_ENCODED (1 << 0)
+#define RECORD_SPARSE (1 << 1)
+
+struct cache {
+    int fd;                 // open for appending
+    unsigned char* map;     // the records when it was opened
+    long long mapLen;
+    long long* slots;       // offsets of the latest records by key, or 0
+    long long slotCount;    // a power of 2
+};
+
+static void makeKey(unsigned char key[KEY_SIZE], struct stat* data)
+{
+#if MAC
+    struct timespec mtime = data->st_mtimespec;
+#else
+    struct timespec mtime = data->st_mtim;
+#endif
+    putLE(key, data->st_dev, 8);
+    putLE(key + 8, data->st_ino, 8);
+    putLE(key + 16, data->st_size, 8);
+    putLE(key + 24, mtime.tv_sec, 8);
+    putLE(key + 32, mtime.tv_nsec, 4);
+    putLE(key + 36, CACHE_CODEC, 4);
+}
+
+static unsigned long long hashKey(const unsigned char* key)
+{
+    // mixes the inode and mtime, which differ the most between files
+    unsigned long long hash = getLE(key + 8, 8) ^
+        getLE(key + 24, 8) * 0x9e3779b97f4a7c15ULL;
+    hash ^= hash >> 31;
+    hash *= 0xbf58476d1ce4e5b9ULL;
+    return hash ^ (hash >> 29);
+}
+
+// the length of the record at offset, or 0 if it is not whole
+static long long recordLen(Cache* cache, long long offset)
+{
+    long long left = cache->mapLen - offset;
+    if (left < RECORD_SIZE + 8) return 0;
+    unsigned char* record = cache->map + offset;
+    unsigned long long extentCount = getLE(record + 56, 8);
+    unsigned long long payloadLen = getLE(record + 64, 8);
+    left -= RECORD_SIZE + 8;
+    if (extentCount > left / EXTENT_SIZE) return 0;
+    left -= extentCount * EXTENT_SIZE;
+    if (payloadLen > left) return 0;
+    long long len = RECORD_SIZE + extentCount * EXTENT_SIZE + payloadLen + 8;
+    if (getLE(record + len - 8, 8) != RECORD_END) return 0;
+    return len;
+}
+
+static void addSlot(Cache* cache, long long offset)
+{
+    unsigned char* key = cache->map + offset;
+    long long mask = cache->slotCount - 1;
+    for (long long i = hashKey(key) & mask;; i = (i + 1) & mask)
+    {
+        // a later record of the same file replaces the earlier one
+        if (!cache->slots[i] ||
+            !memcmp(cache->map + cache->slots[i], key, KEY_SIZE))
+        {
+            cache->slots[i] = offset;
+            return;
+        }
+    }
+}
+
+Cache* openCache(char* path)
+{
+    Cache* cache = calloc(1, sizeof(Cache));
+    if (!cache) DIE("%s", "Out of memory");
+    cache->fd = heldOpen(path, O_RDWR|O_CREAT|O_APPEND, ARCHIVE_PERMISSION);
+    if (cache->fd < 0) SYS_DIE("open cache");
+    // another run may be appending
+    if (flock(cache->fd, LOCK_EX)) SYS_DIE("flock");
+    struct stat data;
+    if (fstat(cache->fd, &data)) SYS_DIE("fstat");
+    unsigned char start[CACHE_START] = CACHE_MAGIC;
+    start[CACHE_MAGIC_SIZE] = CACHE_VERSION;
+    if (!data.st_size)
+    {
+        if (write(cache->fd, start, CACHE_START) < CACHE_START)
+            SYS_DIE("write");
+        data.st_size = CACHE_START;
+    }
+    cache->mapLen = data.st_size;
+    cache->map = heldMmap(cache->mapLen, PROT_READ, MAP_SHARED, cache->fd);
+    if (cache->map == MAP_FAILED) SYS_DIE("mmap");
+    if (cache->mapLen < CACHE_START || memcmp(cache->map, start, CACHE_START))
+        DIE("%s is not a cache of this version", path);
+
+    long long count = 0;
+    long long offset = CACHE_START;
+    for (long long len; (len = recordLen(cache, offset)); offset += len)
+        count++;
+    if (offset < cache->mapLen)
+    {
+        PROGRESS("Dropping %lld bytes cut short from the cache",
+            cache->mapLen - offset);
+        if (ftruncate(cache->fd, offset)) SYS_DIE("ftruncate");
+        cache->mapLen = offset;
+    }
+    if (flock(cache->fd, LOCK_UN)) SYS_DIE("flock");
+
+    // at most half full
+    cache->slotCount = 1;
+    while (cache->slotCount < count * 2) cache->slotCount *= 2;
+    cache->slots = calloc(cache->slotCount, sizeof(long long));
+    if (!cache->slots) DIE("%s", "Out of memory");
+    for (offset = CACHE_START; offset < cache->mapLen;
+        offset += recordLen(cache, offset)) addSlot(cache, offset);
+    PROGRESS("The cache holds %lld records", count);
+    return cache;
+}
+
+void closeCache(Cache* cache)
+{
+    if (heldMunmap(cache->map, cache->mapLen)) SYS_ERROR("munmap");
+    if (heldClose(cache->fd)) SYS_ERROR("close cache");
+    free(cache->slots);
+    free(cache);
+}
+
+bool findCached(Cache* cache, struct stat* data, CachedFile* file)
+{
+    unsigned char key[KEY_SIZE];
+    makeKey(key, data);
+    long long mask = cache->slotCount - 1;
+    unsigned char* record = NULL;
+    for (long long i = hashKey(key) & mask; cache->slots[i];
+        i = (i + 1) & mask)
+    {
+        if (!memcmp(cache->map + cache->slots[i], key, KEY_SIZE))
+        {
+            record = cache->map + cache->slots[i];
+            break;
+        }
+    }
+    if (!record) return false;
+
+    unsigned long long flags = getLE(record + 48, 8);
+    file->checksum = getLE(record + 40, 8);
+    file->encoded = !!(flags & RECORD_ENCODED);
+    file->extentCount = getLE(record + 56, 8);
+    file->payloadLen = getLE(record + 64, 8);
+    file->extents = NULL;
+    unsigned char* extent = record + RECORD_SIZE;
+    if (flags & RECORD_SPARSE)
+    {
+        file->extents = malloc(file->extentCount * sizeof(Extent) + 1);
+        if (!file->extents) DIE("%s", "Out of memory");
+        for (long long i = 0; i < file->extentCount; i++)
+        {
+            file->extents[i].offset = getLE(extent, 8);
+            file->extents[i].len = getLE(extent + 8, 8);
+            extent += EXTENT_SIZE;
+        }
+    }
+    file->payload = extent;
+    return true;
+}
+
+void addCached(Cache* cache, struct stat* data, CachedFile* file,
+    int payload)
+{
+    long long payloadLen = file->encoded ? file->payloadLen : 0;
+    long long len = RECORD_SIZE + file->extentCount * EXTENT_SIZE;
+    unsigned char* record = malloc(len);
+    if (!record) DIE("%s", "Out of memory");
+    makeKey(record, data);
+    putLE(record + 40, file->checksum, 8);
+    putLE(record + 48, (file->encoded ? RECORD_ENCODED : 0) |
+        (file->extents ? RECORD_SPARSE : 0), 8);
+    putLE(record + 56, file->extentCount, 8);
+    putLE(record + 64, payloadLen, 8);
+    unsigned char* extent = record + RECORD_SIZE;
+    for (long long i = 0; i < file->extentCount; i++)
+    {
+        putLE(extent, file->extents[i].offset, 8);
+        putLE(extent + 8, file->extents[i].len, 8);
+        extent += EXTENT_SIZE;
+    }
+    unsigned char end[8];
+    putLE(end, RECORD_END, 8);
+
+    if (flock(cache->fd, LOCK_EX)) SYS_DIE("flock");
+    if (fdwrite(cache->fd, record, len) < len ||
+        (payloadLen && fdcopy(payload, cache->fd, payloadLen) < payloadLen) ||
+        fdwrite(cache->fd, end, sizeof(end)) < sizeof(end))
+        SYS_DIE("write cache");
+    if (flock(cache->fd, LOCK_UN)) SYS_DIE("flock");
+    free(record);
+}
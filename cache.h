@@ -0,0 +1,67 @@
+/**
+ * The compression cache (--cache=File) keeps what archive() stored of each
+ * regular file, so that a later run finds a file which has not changed since
+ * and copies what was stored into the new archive, without reading the file
+ * or computing its checksum and encoding again.
+ *
+ * A file is looked up by its device, inode, size and mtime, and CACHE_CODEC.
+ * The cache file only grows: a run maps the records it holds when it is
+ * opened, and appends a record for each file it had to store. A later record
+ * for the same file replaces an earlier one. A record cut short, by a run
+ * which died while writing it, is dropped when the cache is next opened.
+ * Runs sharing a cache take turns appending to it. Delete the file to empty
+ * the cache.
+ *
+ * What is stored is kept as encode() wrote it, unencrypted, so anyone who
+ * can read the cache can read the files in it. encrypt only uses a cache
+ * for archives which are only compressed (-c).
+ */
+
+#ifndef CACHE_H
+#define CACHE_H
+
+#include "bitcode.h"
+#include "crc.h"
+#include <sys/stat.h>
+
+// changes whenever encode() or the checksum would store a file differently,
+// so that records of the old ones are not used
+#define CACHE_CODEC (1)
+
+// the compression cache, or NULL for none. taken when archiving starts
+extern char* cachePath;
+
+// a run of data in a file. a file with holes has several
+typedef struct {
+    long long offset;
+    long long len;
+} Extent;
+
+// what archive() stored of a regular file
+typedef struct {
+    checktype checksum;
+    bool encoded;           // stored as encode() wrote it, or else as is
+    Extent* extents;        // of its data if it has holes, or NULL
+    long long extentCount;
+    const unsigned char* payload; // what encode() wrote, if encoded
+    long long payloadLen;
+} CachedFile;
+
+typedef struct cache Cache;
+
+// maps the cache at path, making it if there is none
+Cache* openCache(char* path);
+void closeCache(Cache* cache);
+
+// finds the regular file of data, from lstat(). its extents are malloced,
+// and its payload is good until the cache is closed
+// may be called from several threads at once
+bool findCached(Cache* cache, struct stat* data, CachedFile* file);
+
+// adds a record of the regular file of data, whose payload is the
+// payloadLen bytes to be read from the descriptor payload if encoded
+// only the next run will find it
+void addCached(Cache* cache, struct stat* data, CachedFile* file,
+    int payload);
+
+#endif
@@ -0,0 +1,522 @@
+#define _GNU_SOURCE
+#include "channel.h"
+#include "encrypt.h"
+#include "stats.h"
+#include "trace.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <stdatomic.h>
+
+#define MAX_CHANNELS (1024)
+
+typedef struct {
+    long (*read)(void* state, void* bytes, long len);
+    long (*write)(void* state, const void* bytes, long len);
+    int (*close)(void* state);
+    void (*abort)(void* state);
+    void* state;
+    long long (*seek)(void* state, long long offset, int whence);
+    void* owner;
+} Channel;
+
+// descriptor CHANNEL_BASE+i is channels[i]. slots are taken and emptied
+// under the lock, but looked up without it on every read and write, so a
+// channel is whole before it is published to other threads
+static _Atomic(Channel*) channels[MAX_CHANNELS];
+static pthread_mutex_t channelsLock = PTHREAD_MUTEX_INITIALIZER;
+
+static int openChannel(Channel channel)
+{
+    Channel* opened = malloc(sizeof(Channel));
+    if (!opened) DIE("%s", "Out of memory");
+    *opened = channel;
+    opened->owner = currentContext();
+    pthread_mutex_lock(&channelsLock);
+    for (int i = 0; i < MAX_CHANNELS; i++)
+    {
+        if (!atomic_load_explicit(channels + i, memory_order_relaxed))
+        {
+            atomic_store_explicit(channels + i, opened, memory_order_release);
+            pthread_mutex_unlock(&channelsLock);
+            return CHANNEL_BASE + i;
+        }
+    }
+    pthread_mutex_unlock(&channelsLock);
+    DIE("%s", "Too many channels open");
+}
+
+static Channel* channelOf(int fd)
+{
+    return atomic_load_explicit(channels + fd - CHANNEL_BASE,
+        memory_order_acquire);
+}
+
+bool isChannel(int fd)
+{
+    return fd >= CHANNEL_BASE && fd < CHANNEL_BASE + MAX_CHANNELS &&
+        channelOf(fd);
+}
+
+long channelRead(int fd, void* bytes, long len)
+{
+    Channel* channel = channelOf(fd);
+    if (!channel || !channel->read)
+    {
+        errno = EBADF;
+        return -1;
+    }
+    return channel->read(channel->state, bytes, len);
+}
+
+long channelWrite(int fd, const void* bytes, long len)
+{
+    Channel* channel = channelOf(fd);
+    if (!channel || !channel->write)
+    {
+        errno = EBADF;
+        return -1;
+    }
+    return channel->write(channel->state, bytes, len);
+}
+
+long long channelSeek(int fd, long long offset, int whence)
+{
+    Channel* channel = channelOf(fd);
+    if (!channel)
+    {
+        errno = EBADF;
+        return -1;
+    }
+    if (!channel->seek)
+    {
+        errno = ESPIPE;
+        return -1;
+    }
+    return channel->seek(channel->state, offset, whence);
+}
+
+// empties slot i, if all or owner owns its channel, and returns what it held
+static Channel* takeChannel(int i, bool all, void* owner)
+{
+    pthread_mutex_lock(&channelsLock);
+    Channel* channel = atomic_load_explicit(channels + i,
+        memory_order_relaxed);
+    if (channel && !all && channel->owner != owner) channel = NULL;
+    if (channel)
+        atomic_store_explicit(channels + i, NULL, memory_order_release);
+    pthread_mutex_unlock(&channelsLock);
+    return channel;
+}
+
+static int freeChannel(Channel* channel)
+{
+    int status = channel->close ? channel->close(channel->state) : 0;
+    free(channel);
+    return status;
+}
+
+int channelClose(int fd)
+{
+    Channel* channel = takeChannel(fd - CHANNEL_BASE, true, NULL);
+    if (!channel)
+    {
+        errno = EBADF;
+        return -1;
+    }
+    return freeChannel(channel);
+}
+
+void abortChannels(void* owner)
+{
+    pthread_mutex_lock(&channelsLock);
+    for (int i = 0; i < MAX_CHANNELS; i++)
+    {
+        Channel* channel = atomic_load_explicit(channels + i,
+            memory_order_relaxed);
+        if (channel && channel->owner == owner && channel->abort)
+            channel->abort(channel->state);
+    }
+    pthread_mutex_unlock(&channelsLock);
+}
+
+void closeChannels(void* owner)
+{
+    for (int i = 0; i < MAX_CHANNELS; i++)
+    {
+        Channel* channel = takeChannel(i, false, owner);
+        if (channel) freeChannel(channel);
+    }
+}
+
+// == MEMORY MODULE ========================================================
+
+struct memoryReader {
+    const char* bytes;
+    long len;
+    long position;
+};
+
+static long memoryRead(void* state, void* bytes, long len)
+{
+    struct memoryReader* reader = state;
+    if (len > reader->len - reader->position)
+        len = reader->len - reader->position;
+    memcpy(bytes, reader->bytes + reader->position, len);
+    reader->position += len;
+    return len;
+}
+
+static int freeState(void* state)
+{
+    free(state);
+    return 0;
+}
+
+int openMemoryReader(const void* bytes, long len)
+{
+    struct memoryReader* reader = malloc(sizeof(*reader));
+    reader->bytes = bytes;
+    reader->len = len;
+    reader->position = 0;
+    Channel channel = {memoryRead, NULL, freeState, NULL, reader};
+    return openChannel(channel);
+}
+
+struct memoryWriter {
+    char** bytes;
+    long* len;
+    long capacity;
+};
+
+static long memoryWrite(void* state, const void* bytes, long len)
+{
+    struct memoryWriter* writer = state;
+    if (*writer->len + len > writer->capacity)
+    {
+        writer->capacity *= 2;
+        if (writer->capacity < *writer->len + len)
+            writer->capacity = *writer->len + len;
+        *writer->bytes = realloc(*writer->bytes, writer->capacity);
+        if (!*writer->bytes) return -1;
+    }
+    memcpy(*writer->bytes + *writer->len, bytes, len);
+    *writer->len += len;
+    return len;
+}
+
+int openMemoryWriter(char** bytes, long* len)
+{
+    struct memoryWriter* writer = malloc(sizeof(*writer));
+    writer->bytes = bytes;
+    writer->len = len;
+    writer->capacity = *bytes ? *len : 0;
+    Channel channel = {NULL, memoryWrite, freeState, NULL, writer};
+    return openChannel(channel);
+}
+
+int openCallbackChannel(long (*read)(void* state, void* bytes, long len),
+    long (*write)(void* state, const void* bytes, long len), void* state)
+{
+    Channel channel = {read, write, NULL, NULL, state};
+    return openChannel(channel);
+}
+
+int openHookedChannel(long (*read)(void* state, void* bytes, long len),
+    long (*write)(void* state, const void* bytes, long len),
+    int (*close)(void* state), void (*abort)(void* state), void* state)
+{
+    Channel channel = {read, write, close, abort, state};
+    return openChannel(channel);
+}
+
+int openSeekableChannel(long (*read)(void* state, void* bytes, long len),
+    long long (*seek)(void* state, long long offset, int whence),
+    int (*close)(void* state), void* state)
+{
+    Channel channel = {read, NULL, close, NULL, state, seek};
+    return openChannel(channel);
+}
+
+// == RING MODULE ==========================================================
+
+// The reader and writer only share head and tail, which each of them
+// advances by a whole block with an atomic store. The lock and condition are
+// only used to sleep when the ring is full or empty.
+struct ring {
+    char* blocks[RING_BLOCKS];
+    long lengths[RING_BLOCKS];
+    atomic_ulong head;      // blocks published by the writer
+    atomic_ulong tail;      // blocks released by the reader
+    atomic_int writerClosed;
+    atomic_int readerClosed;
+    atomic_int ends;        // ends still open. freed when both are closed
+    long fill;              // bytes the writer has put in block head
+    long consumed;          // bytes the reader has taken from block tail
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+};
+
+// blocks of closed rings, reused by the next rings
+#define SPARE_BLOCKS (64)
+static char* spareBlocks[SPARE_BLOCKS];
+static int spareBlockCount = 0;
+static pthread_mutex_t spareBlocksLock = PTHREAD_MUTEX_INITIALIZER;
+
+static char* allocBlock(void)
+{
+    char* block = NULL;
+    pthread_mutex_lock(&spareBlocksLock);
+    if (spareBlockCount > 0) block = spareBlocks[--spareBlockCount];
+    pthread_mutex_unlock(&spareBlocksLock);
+    return block ? block : malloc(RING_BLOCK_SIZE);
+}
+
+static void releaseBlock(char* block)
+{
+    pthread_mutex_lock(&spareBlocksLock);
+    if (spareBlockCount < SPARE_BLOCKS)
+    {
+        spareBlocks[spareBlockCount++] = block;
+        block = NULL;
+    }
+    pthread_mutex_unlock(&spareBlocksLock);
+    free(block);
+}
+
+void reserveBlocks(int count)
+{
+    pthread_mutex_lock(&spareBlocksLock);
+    while (count-- > 0 && spareBlockCount < SPARE_BLOCKS)
+    {
+        char* block = malloc(RING_BLOCK_SIZE);
+        if (!block) break;
+        spareBlocks[spareBlockCount++] = block;
+    }
+    pthread_mutex_unlock(&spareBlocksLock);
+}
+
+static void wakeRing(struct ring* ring)
+{
+    pthread_mutex_lock(&ring->lock);
+    pthread_cond_broadcast(&ring->changed);
+    pthread_mutex_unlock(&ring->lock);
+}
+
+static bool ringHasSpace(struct ring* ring)
+{
+    return atomic_load(&ring->head) - atomic_load(&ring->tail) < RING_BLOCKS
+        || atomic_load(&ring->readerClosed);
+}
+
+static bool ringHasData(struct ring* ring)
+{
+    return atomic_load(&ring->head) != atomic_load(&ring->tail)
+        || atomic_load(&ring->writerClosed);
+}
+
+static void waitRing(struct ring* ring, bool (*ready)(struct ring*))
+{
+    if (ready(ring)) return;
+    // only a wait which blocks is traced
+    TRACE_BEGIN(ready == ringHasSpace ? "waitForSpace" : "waitForData");
+    pthread_mutex_lock(&ring->lock);
+    while (!ready(ring)) pthread_cond_wait(&ring->changed, &ring->lock);
+    pthread_mutex_unlock(&ring->lock);
+    TRACE_END(ready == ringHasSpace ? "waitForSpace" : "waitForData");
+}
+
+static void publishBlock(struct ring* ring)
+{
+    unsigned long head = atomic_load(&ring->head);
+    ring->lengths[head % RING_BLOCKS] = ring->fill;
+    ring->fill = 0;
+    atomic_store(&ring->head, head + 1);
+    wakeRing(ring);
+}
+
+static long ringWrite(void* state, const void* bytes, long len)
+{
+    struct ring* ring = state;
+    long written = 0;
+    while (written < len)
+    {
+        waitRing(ring, ringHasSpace);
+        if (atomic_load(&ring->readerClosed))
+        {
+            errno = EPIPE;
+            return -1;
+        }
+        unsigned long head = atomic_load(&ring->head);
+        char* block = ring->blocks[head % RING_BLOCKS];
+        long count = len - written;
+        if (count > RING_BLOCK_SIZE - ring->fill)
+            count = RING_BLOCK_SIZE - ring->fill;
+        memcpy(block + ring->fill, (const char*)bytes + written, count);
+        ring->fill += count;
+        written += count;
+        if (ring->fill == RING_BLOCK_SIZE) publishBlock(ring);
+    }
+    return written;
+}
+
+static long ringRead(void* state, void* bytes, long len)
+{
+    struct ring* ring = state;
+    waitRing(ring, ringHasData);
+    unsigned long tail = atomic_load(&ring->tail);
+    // writerClosed is set after the last block is published
+    if (tail == atomic_load(&ring->head)) return 0;
+
+    int slot = tail % RING_BLOCKS;
+    long count = ring->lengths[slot] - ring->consumed;
+    if (count > len) count = len;
+    memcpy(bytes, ring->blocks[slot] + ring->consumed, count);
+    ring->consumed += count;
+    if (ring->consumed == ring->lengths[slot])
+    {
+        ring->consumed = 0;
+        atomic_store(&ring->tail, tail + 1);
+        wakeRing(ring);
+    }
+    return count;
+}
+
+static int releaseRing(struct ring* ring)
+{
+    if (atomic_fetch_sub(&ring->ends, 1) > 1) return 0;
+    for (int i = 0; i < RING_BLOCKS; i++) releaseBlock(ring->blocks[i]);
+    pthread_mutex_destroy(&ring->lock);
+    pthread_cond_destroy(&ring->changed);
+    free(ring);
+    return 0;
+}
+
+static int closeRingWriter(void* state)
+{
+    struct ring* ring = state;
+    if (ring->fill > 0)
+    {
+        waitRing(ring, ringHasSpace);
+        if (!atomic_load(&ring->readerClosed)) publishBlock(ring);
+    }
+    atomic_store(&ring->writerClosed, 1);
+    wakeRing(ring);
+    return releaseRing(ring);
+}
+
+static int closeRingReader(void* state)
+{
+    struct ring* ring = state;
+    atomic_store(&ring->readerClosed, 1);
+    wakeRing(ring);
+    return releaseRing(ring);
+}
+
+static void abortRing(void* state)
+{
+    struct ring* ring = state;
+    atomic_store(&ring->readerClosed, 1);
+    atomic_store(&ring->writerClosed, 1);
+    wakeRing(ring);
+}
+
+void makeRing(int fds[2])
+{
+    struct ring* ring = calloc(1, sizeof(*ring));
+    for (int i = 0; i < RING_BLOCKS; i++)
+        ring->blocks[i] = allocBlock();
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+    atomic_init(&ring->writerClosed, 0);
+    atomic_init(&ring->readerClosed, 0);
+    atomic_init(&ring->ends, 2);
+    pthread_mutex_init(&ring->lock, NULL);
+    pthread_cond_init(&ring->changed, NULL);
+
+    Channel reader = {ringRead, NULL, closeRingReader, abortRing, ring};
+    Channel writer = {NULL, ringWrite, closeRingWriter, abortRing, ring};
+    fds[0] = openChannel(reader);
+    fds[1] = openChannel(writer);
+}
+
+// == STAGE MODULE =========================================================
+
+double threadCPUSeconds(void)
+{
+    struct timespec time;
+    if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &time)) return 0;
+    return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+// stages started by this thread and not joined yet
+static __thread Stage* children = NULL;
+
+static void runStageBody(void* arg)
+{
+    Stage* stage = arg;
+    stage->result = stage->run(stage->arg);
+}
+
+static void* runStage(void* arg)
+{
+    Stage* stage = arg;
+    TRACE_THREAD(stage->name);
+    loadOptions(&stage->options);
+    StatsMark start;
+    markStats(&start);
+    double wallStart = monotonicSeconds();
+    stage->failed = !runInContext(stage->context, runStageBody, stage);
+    stage->cpuSeconds = threadCPUSeconds();
+    stage->wallSeconds = monotonicSeconds() - wallStart;
+    statsStage(stage->name, &start);
+    return NULL;
+}
+
+void startStage(Stage* stage, char* name, void* (*run)(void*), void* arg)
+{
+    stage->name = name;
+    stage->run = run;
+    stage->arg = arg;
+    stage->result = NULL;
+    stage->cpuSeconds = 0;
+    stage->wallSeconds = 0;
+    saveOptions(&stage->options);
+    stage->context = currentContext();
+    stage->failed = false;
+    int error = pthread_create(&stage->thread, NULL, runStage, stage);
+    if (error) errno = error, SYS_DIE("pthread_create");
+    stage->next = children;
+    children = stage;
+}
+
+// joins without failing, so it can be used while failing
+static void waitStage(Stage* stage)
+{
+    Stage** link = &children;
+    while (*link && *link != stage) link = &(*link)->next;
+    if (*link) *link = stage->next;
+    int error = pthread_join(stage->thread, NULL);
+    if (error) errno = error, SYS_DIE("pthread_join");
+}
+
+void* joinStage(Stage* stage)
+{
+    waitStage(stage);
+    PROGRESS("%s stage used %gs of CPU", stage->name, stage->cpuSeconds);
+    if (stage->failed) DIE("%s stage failed", stage->name);
+    return stage->result;
+}
+
+void joinChildStages(void)
+{
+    while (children) waitStage(children);
+}
+
+bool isChildStage(Stage* stage)
+{
+    Stage* child = children;
+    while (child && child != stage) child = child->next;
+    return !!child;
+}
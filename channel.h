@@ -0,0 +1,107 @@
+/**
+ * Channels are in-process stand-ins for file descriptors, so the stages of
+ * the program can pass data to each other without going through the kernel.
+ * Descriptors at or above CHANNEL_BASE are channels. fdputc(), fdgetc(),
+ * fdwrite(), fdclose(), fdseek(), rdhang() and rdhangPartial() accept them
+ * anywhere they accept a file descriptor.
+ *
+ * A ring is a channel with a reading end and a writing end, used in place of
+ * pipe() between two threads. It holds a bounded number of large blocks, so a
+ * writer that gets ahead of its reader waits for it (backpressure).
+ */
+
+#ifndef CHANNEL_H
+#define CHANNEL_H
+
+#include "bitcode.h"
+#include "encrypt.h"
+#include <pthread.h>
+
+#define CHANNEL_BASE (1<<20)
+
+// blocks in a ring and the size of each
+#define RING_BLOCKS (8)
+#define RING_BLOCK_SIZE (1<<16)
+
+// like pipe(): fds[0] is the reading end and fds[1] is the writing end
+// only one thread may use each end
+void makeRing(int fds[2]);
+
+// keeps up to count blocks ready for the next rings
+void reserveBlocks(int count);
+
+bool isChannel(int fd);
+
+// same contract as read(2) and write(2)
+// reading returns 0 once the writing end is closed and the ring is drained
+// writing fails with EPIPE once the reading end is closed
+long channelRead(int fd, void* bytes, long len);
+long channelWrite(int fd, const void* bytes, long len);
+
+// same contract as lseek(2). fails with ESPIPE for channels which can't seek
+long long channelSeek(int fd, long long offset, int whence);
+
+// closing the writing end flushes the partially filled block to the reader
+int channelClose(int fd);
+
+// reads the len bytes at bytes and then EOF. bytes must outlive the channel
+int openMemoryReader(const void* bytes, long len);
+
+// appends everything written to *bytes (malloced, NULL to start) and *len
+int openMemoryWriter(char** bytes, long* len);
+
+// calls read or write (either may be NULL) with state, same contract as
+// channelRead() and channelWrite()
+int openCallbackChannel(long (*read)(void* state, void* bytes, long len),
+    long (*write)(void* state, const void* bytes, long len), void* state);
+
+// openCallbackChannel() which also calls close (may be NULL) when it is closed
+// and abort (may be NULL) when its owner aborts (see abortChannels())
+int openHookedChannel(long (*read)(void* state, void* bytes, long len),
+    long (*write)(void* state, const void* bytes, long len),
+    int (*close)(void* state), void (*abort)(void* state), void* state);
+
+// a channel for reading which can also be moved around with fdseek(). seek
+// has the contract of lseek(2), and close (may be NULL) is called on closing
+int openSeekableChannel(long (*read)(void* state, void* bytes, long len),
+    long long (*seek)(void* state, long long offset, int whence),
+    int (*close)(void* state), void* state);
+
+// channels belong to the library call (see currentContext()) that opened them
+// aborting makes their readers see EOF and their writers fail, which ends
+// every stage blocked on them
+void abortChannels(void* owner);
+void closeChannels(void* owner);
+
+// a stage is a thread that runs one part of the pipeline
+typedef struct stage {
+    pthread_t thread;
+    char* name;
+    void* (*run)(void*);
+    void* arg;
+    void* result;
+    double cpuSeconds; // CPU time used by the stage, set when it finishes
+    double wallSeconds; // time the stage ran, set when it finishes
+    Options options;   // of the thread that started it
+    void* context;     // of the thread that started it
+    bool failed;
+    struct stage* next;
+} Stage;
+
+// starts run(arg) in a new thread
+void startStage(Stage* stage, char* name, void* (*run)(void*), void* arg);
+
+// waits for the stage to finish, reports its CPU time and returns its result
+// fails if the stage failed
+void* joinStage(Stage* stage);
+
+// waits for every stage started by this thread which hasn't been joined
+void joinChildStages(void);
+
+// whether stage was started by this thread and hasn't been joined
+bool isChildStage(Stage* stage);
+
+// CPU time used so far by the calling thread
+double threadCPUSeconds(void);
+
+#endif
@@ -1,12 +1,17 @@
 #include "crc.h"
 #include "bitcode.h"
 #include "encrypt.h"
+#include "trace.h"
+#include "progress.h"
 
 // uses CRC described: https://en.wikipedia.org/wiki/Cyclic_redundancy_check
 // CRC_N must be <= sizeof(checktype)
 #define CRC_POLYNOMIAL (0x42F0E1EBA9EA3693) //(0x04C11DB7)
 #define CRC_N (64) // (32)
 
+// bytes checkCRC() reads and writes at a time
+#define CRC_BLOCK_SIZE (1 << 16)
+
 // & with this to find leading bit of a (CRC_N - bit number)
 #define LEAD_BIT_MASK (((checktype)1) << (CRC_N-1))
 
@@ -46,28 +51,55 @@ void padMessage(checktype* message)
 
 checktype computeCRC(FILE* inFile, int outFile)
 {
+    TRACE_BEGIN("computeCRC");
     checktype message = 0;
     int c;
+    // the CRC sees every byte archived, so it counts progress
+    int unreported = 0;
     while ((c = fgetc(inFile)) != EOF)
     {
         appendCharToMessage(&message, c);
         if (outFile >= 0) fdputc(c, outFile);
+        if (reportProgress && ++unreported == PROGRESS_CHUNK)
+            progressBytes(unreported), unreported = 0;
     }
+    if (reportProgress) progressBytes(unreported);
     padMessage(&message);
+    TRACE_END("computeCRC");
     PROGRESS("Cyclic Redundancy Check has value " CHECKTYPE_FORMAT, message);
     return message;
 }
 
-bool checkCRC(int inFile, FILE* outFile, checktype checksum)
+void appendBytesToMessage(checktype* message, const unsigned char* bytes,
+    long long len)
+{
+    for (long long i = 0; i < len; i++)
+    {
+        appendCharToMessage(message, bytes[i]);
+        if (reportProgress && (i + 1) % PROGRESS_CHUNK == 0)
+            progressBytes(PROGRESS_CHUNK);
+    }
+    if (reportProgress) progressBytes(len % PROGRESS_CHUNK);
+}
+
+bool checkCRC(int inFile, int outFile, checktype checksum)
 {
+    TRACE_BEGIN("checkCRC");
     checktype message = 0;
-    int c;
-    while ((c = fdgetc(inFile)) != EOF)
+    // passes the bytes on a block at a time
+    unsigned char block[CRC_BLOCK_SIZE];
+    long readLen;
+    while ((readLen = fdread(inFile, block, CRC_BLOCK_SIZE)) > 0)
     {
-        appendCharToMessage(&message, c);
-        if (outFile) fputc(c, outFile);
+        for (long i = 0; i < readLen; i++)
+            appendCharToMessage(&message, block[i]);
+        if (outFile >= 0 && fdwrite(outFile, block, readLen) < readLen)
+            SYS_DIE("write");
+        if (reportProgress) progressBytes(readLen);
     }
+    if (readLen < 0) SYS_DIE("read");
     padMessage(&message);
+    TRACE_END("checkCRC");
     if (message != checksum)
     {
         PROGRESS("Cyclic Redundancy Checksum " CHECKTYPE_FORMAT
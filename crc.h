@@ -15,6 +15,12 @@ typedef unsigned long long checktype;
 // if outFile is <0, doesn't use it
 checktype computeCRC(FILE* inFile, int outFile);
 
+// for a CRC of bytes in memory, possibly in pieces: start with a message of
+// 0, append each piece, then pad the message to get what computeCRC() would
+void appendBytesToMessage(checktype* message, const unsigned char* bytes,
+    long long len);
+void padMessage(checktype* message);
+
 // input checksum returned by computeCRC
-// if outFile is NULL, doesn't use it
-bool checkCRC(int inFile, FILE* outFile, checktype checksum);
+// if outFile is <0, doesn't use it
+bool checkCRC(int inFile, int outFile, checktype checksum);
@@ -0,0 +1,409 @@
+#define _GNU_SOURCE
+#include "daemon.h"
+#include "libfar.h"
+#include "encrypt.h"
+#include "channel.h"
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <limits.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define PROTOCOL_VERSION (1)
+
+// limits on requests, so a bad client can't exhaust the daemon
+#define MAX_PASSWORD_LEN (1<<16)
+#define MAX_NODES (1<<16)
+
+enum {
+    JOB_PROTECT,   // archive and encrypt
+    JOB_UNPROTECT, // decrypt and extract
+    JOB_ARCHIVE,   // compression only
+    JOB_EXTRACT
+};
+
+// sent by the client with the archive and its stderr as SCM_RIGHTS
+// followed by the password (unless passwordLen is -1 for the default),
+// the client's working directory, and nodeC nodes each preceded by its length
+typedef struct {
+    int version;
+    int job;
+    int flags;       // for farSetFlags()
+    int passwordLen;
+    int rootLen;
+    int nodeC;
+} Request;
+
+// sent back when the job is done, followed by the error message
+typedef struct {
+    int status;      // FAR_OK or FAR_ERROR
+    int errorLen;
+} Reply;
+
+#define REQUEST_FDS (2)
+
+// == TRANSPORT MODULE =====================================================
+
+// unlike rdhang(), these report failures instead of dying, because one
+// client must not bring down the daemon
+static bool sendAll(int socket, const void* bytes, long len)
+{
+    const char* next = bytes;
+    while (len > 0)
+    {
+        long sent = write(socket, next, len);
+        if (sent < 0 && errno == EINTR) continue;
+        if (sent <= 0) return false;
+        next += sent;
+        len -= sent;
+    }
+    return true;
+}
+
+static bool receiveAll(int socket, void* bytes, long len)
+{
+    char* next = bytes;
+    while (len > 0)
+    {
+        long received = read(socket, next, len);
+        if (received < 0 && errno == EINTR) continue;
+        if (received <= 0) return false;
+        next += received;
+        len -= received;
+    }
+    return true;
+}
+
+// reads a string of len bytes. NULL on failure
+static char* receiveString(int socket, int len, int maxLen)
+{
+    if (len < 0 || len > maxLen) return NULL;
+    char* string = malloc(len + 1);
+    if (!string) return NULL;
+    if (!receiveAll(socket, string, len))
+    {
+        free(string);
+        return NULL;
+    }
+    string[len] = '\0';
+    return string;
+}
+
+// == DAEMON MODULE ========================================================
+
+// a request being served. everything is freed by freeJob()
+typedef struct {
+    Request request;
+    int fds[REQUEST_FDS]; // archive, log
+    char* password;
+    char* root;
+    char** nodes;
+} Job;
+
+static void freeJob(Job* job)
+{
+    for (int i = 0; i < REQUEST_FDS; i++)
+        if (job->fds[i] >= 0) close(job->fds[i]);
+    free(job->password);
+    free(job->root);
+    if (job->nodes)
+        for (int i = 0; i < job->request.nodeC; i++) free(job->nodes[i]);
+    free(job->nodes);
+}
+
+// receives the header with its descriptors, then the rest of the request
+static bool receiveJob(int client, Job* job)
+{
+    char control[CMSG_SPACE(sizeof(int) * REQUEST_FDS)];
+    struct iovec iov = {&job->request, sizeof(job->request)};
+    struct msghdr message = {0};
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    message.msg_control = control;
+    message.msg_controllen = sizeof(control);
+
+    long received;
+    while ((received = recvmsg(client, &message, 0)) < 0 && errno == EINTR);
+    if (received <= 0) return false;
+
+    // every descriptor received is the job's, to be closed by freeJob(), or
+    // is closed here, so a bad client can't leave them open in the daemon
+    int fdC = 0;
+    for (struct cmsghdr* header = CMSG_FIRSTHDR(&message); header;
+        header = CMSG_NXTHDR(&message, header))
+    {
+        if (header->cmsg_level != SOL_SOCKET ||
+            header->cmsg_type != SCM_RIGHTS) continue;
+        int count = (header->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for (int i = 0; i < count; i++)
+        {
+            int fd;
+            memcpy(&fd, CMSG_DATA(header) + i * sizeof(int), sizeof(int));
+            if (fdC < REQUEST_FDS) job->fds[fdC++] = fd;
+            else if (close(fd)) SYS_ERROR("close");
+        }
+    }
+    // more was sent than fit, which the kernel dropped
+    if (message.msg_flags & MSG_CTRUNC) return false;
+    if (job->fds[0] < 0 || job->fds[1] < 0) return false;
+
+    // the header may have been split
+    if (!receiveAll(client, (char*)&job->request + received,
+        sizeof(job->request) - received)) return false;
+
+    Request* request = &job->request;
+    if (request->version != PROTOCOL_VERSION) return false;
+    if (request->nodeC < 0 || request->nodeC > MAX_NODES) return false;
+    if (request->passwordLen >= 0 &&
+        !(job->password = receiveString(client, request->passwordLen,
+            MAX_PASSWORD_LEN))) return false;
+    if (!(job->root = receiveString(client, request->rootLen, PATH_MAX)))
+        return false;
+    job->nodes = calloc(request->nodeC + 1, sizeof(char*));
+    if (!job->nodes) return false;
+    for (int i = 0; i < request->nodeC; i++)
+    {
+        int nodeLen;
+        if (!receiveAll(client, &nodeLen, sizeof(nodeLen))) return false;
+        if (!(job->nodes[i] = receiveString(client, nodeLen, PATH_MAX)))
+            return false;
+    }
+    return true;
+}
+
+static int runJob(Job* job, FarContext* context)
+{
+    Request* request = &job->request;
+    int archive = job->fds[0];
+    switch (request->job)
+    {
+        case JOB_PROTECT:
+            return farProtect(context, job->password, archive, job->root,
+                request->nodeC, job->nodes);
+        case JOB_UNPROTECT:
+            return farUnprotect(context, job->password, archive, job->root);
+        case JOB_ARCHIVE:
+            return farArchive(context, archive, job->root, request->nodeC,
+                job->nodes);
+        case JOB_EXTRACT:
+            return farExtract(context, archive, job->root);
+    }
+    return FAR_ERROR;
+}
+
+static void serveClient(int client, FarContext* context)
+{
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    Job job = {.fds = {-1, -1}};
+    if (!receiveJob(client, &job))
+    {
+        WARN("%s", "Dropped invalid request");
+        freeJob(&job);
+        return;
+    }
+
+    // reports go to the client's stderr
+    FILE* log = fdopen(job.fds[1], "w");
+    if (log)
+    {
+        job.fds[1] = -1;
+        setvbuf(log, NULL, _IOLBF, 0);
+    }
+    farSetFlags(context, job.request.flags);
+    farSetLog(context, log);
+
+    Reply reply;
+    reply.status = runJob(&job, context);
+    const char* error = farError(context);
+    if (reply.status == FAR_OK) error = NULL;
+    else if (!error) error = "Invalid job";
+    reply.errorLen = error ? strlen(error) : 0;
+
+    farSetLog(context, NULL);
+    if (log && fclose(log)) SYS_ERROR("fclose");
+    // the client waits for the reply, so the archive must be closed first
+    if (close(job.fds[0])) SYS_ERROR("close");
+    job.fds[0] = -1;
+
+    if (!sendAll(client, &reply, sizeof(reply)) ||
+        !sendAll(client, error, reply.errorLen))
+        SYS_ERROR("reply");
+
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    STATUS("Served job in %gs%s%s", end.tv_sec - start.tv_sec +
+        (end.tv_nsec - start.tv_nsec) / 1e9, error ? ": " : "",
+        error ? error : "");
+    // the password was zeroed by the job
+    freeJob(&job);
+}
+
+static int listener = -1;
+static char* listenerPath = NULL;
+
+static void* runWorker(void* unused)
+{
+    FarContext* context = farNewContext();
+    if (!context) DIE("%s", "Out of memory");
+    while (true)
+    {
+        int client = accept(listener, NULL, NULL);
+        if (client < 0)
+        {
+            if (errno != EINTR && errno != ECONNABORTED) SYS_ERROR("accept");
+            continue;
+        }
+        serveClient(client, context);
+        if (close(client)) SYS_ERROR("close");
+    }
+    return NULL;
+}
+
+// remove the socket so the next daemon can bind to it
+static void catchSignal(int signo)
+{
+    unlink(listenerPath);
+    signal(signo, SIG_DFL);
+    raise(signo);
+}
+
+void runDaemon(char* socketPath, int workers)
+{
+    struct sockaddr_un address = {0};
+    address.sun_family = AF_UNIX;
+    if (strlen(socketPath) >= sizeof(address.sun_path))
+        DIE("Socket path too long: %s", socketPath);
+    strcpy(address.sun_path, socketPath);
+
+    listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listener < 0) SYS_DIE("socket");
+    // a socket left by a daemon that was killed
+    if (unlink(socketPath) && errno != ENOENT) SYS_DIE("unlink");
+    // only the owner may connect
+    mode_t oldMask = umask(0077);
+    if (bind(listener, (struct sockaddr*)&address, sizeof(address)))
+        SYS_DIE("bind");
+    umask(oldMask);
+    if (listen(listener, SOMAXCONN)) SYS_DIE("listen");
+    listenerPath = socketPath;
+
+    // clients that go away must not kill the daemon
+    if (signal(SIGPIPE, SIG_IGN) == SIG_ERR ||
+        signal(SIGINT, catchSignal) == SIG_ERR ||
+        signal(SIGTERM, catchSignal) == SIG_ERR)
+    {
+        DIE("%s", "An error occurred while setting a signal handler");
+    }
+
+    if (workers <= 0) workers = sysconf(_SC_NPROCESSORS_ONLN);
+    // warm up before the first job: the rings of every worker's pipeline
+    reserveBlocks(workers * 2 * RING_BLOCKS);
+
+    STATUS("Serving on %s with %d workers", socketPath, workers);
+    Stage* pool = calloc(workers, sizeof(Stage));
+    for (int i = 0; i < workers; i++)
+        startStage(pool + i, "Worker", runWorker, NULL);
+    // workers never finish
+    for (int i = 0; i < workers; i++)
+        joinStage(pool + i);
+}
+
+// == CLIENT MODULE ========================================================
+
+void requestJob(char* socketPath, bool decrypt, bool compressionOnly,
+    char* password, char* archiveName, int nodeC, char** nodes)
+{
+    int archive;
+    if (decrypt)
+    {
+        archive = STDIN_FILENO;
+        if (strcmp(archiveName, "-")) archive = open(archiveName, O_RDONLY);
+    }
+    else
+    {
+        archive = STDOUT_FILENO;
+        if (strcmp(archiveName, "-"))
+            archive = open(archiveName, O_WRONLY|O_CREAT|O_TRUNC,
+                ARCHIVE_PERMISSION);
+    }
+    if (archive < 0) SYS_DIE("open");
+
+    char* root = getcwd(NULL, 0);
+    if (!root) SYS_DIE("getcwd");
+
+    struct sockaddr_un address = {0};
+    address.sun_family = AF_UNIX;
+    if (strlen(socketPath) >= sizeof(address.sun_path))
+        DIE("Socket path too long: %s", socketPath);
+    strcpy(address.sun_path, socketPath);
+    int server = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (server < 0) SYS_DIE("socket");
+    if (connect(server, (struct sockaddr*)&address, sizeof(address)))
+        SYS_DIE("connect");
+    // the daemon closing early shows up as a failed write, not a signal
+    if (signal(SIGPIPE, SIG_IGN) == SIG_ERR)
+        DIE("%s", "An error occurred while setting a signal handler");
+
+    Request request;
+    request.version = PROTOCOL_VERSION;
+    if (compressionOnly) request.job = decrypt ? JOB_EXTRACT : JOB_ARCHIVE;
+    else request.job = decrypt ? JOB_UNPROTECT : JOB_PROTECT;
+    // the archive is removed here, where its name is known
+    request.flags = optionFlags() & ~(decrypt ? FAR_REMOVE_ORIGINAL : 0);
+    request.passwordLen = password ? strlen(password) : -1;
+    request.rootLen = strlen(root);
+    request.nodeC = nodeC;
+
+    int fds[REQUEST_FDS] = {archive, STDERR_FILENO};
+    char control[CMSG_SPACE(sizeof(fds))];
+    memset(control, 0, sizeof(control));
+    struct iovec iov = {&request, sizeof(request)};
+    struct msghdr message = {0};
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    message.msg_control = control;
+    message.msg_controllen = sizeof(control);
+    struct cmsghdr* header = CMSG_FIRSTHDR(&message);
+    header->cmsg_level = SOL_SOCKET;
+    header->cmsg_type = SCM_RIGHTS;
+    header->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(header), fds, sizeof(fds));
+
+    long sent = sendmsg(server, &message, 0);
+    if (sent < 0) SYS_DIE("sendmsg");
+    bool ok = sendAll(server, (char*)&request + sent, sizeof(request) - sent);
+    if (password) ok = ok && sendAll(server, password, request.passwordLen);
+    ok = ok && sendAll(server, root, request.rootLen);
+    for (int i = 0; ok && i < nodeC; i++)
+    {
+        int nodeLen = strlen(nodes[i]);
+        ok = sendAll(server, &nodeLen, sizeof(nodeLen)) &&
+            sendAll(server, nodes[i], nodeLen);
+    }
+    if (!ok) SYS_DIE("send request");
+    free(root);
+    // the daemon has its own copy
+    if (close(archive)) SYS_ERROR("close");
+
+    Reply reply;
+    if (!receiveAll(server, &reply, sizeof(reply)))
+        DIE("%s", "The daemon ended without finishing the job");
+    if (reply.status != FAR_OK)
+    {
+        char* error = receiveString(server, reply.errorLen, INT_MAX - 1);
+        DIE("%s", error ? error : "The daemon could not finish the job");
+    }
+    if (close(server)) SYS_ERROR("close");
+
+    if (decrypt && strcmp(archiveName, "-") && removeOriginal &&
+        remove(archiveName))
+        SYS_ERROR("remove");
+}
@@ -0,0 +1,31 @@
+/**
+ * Daemon mode: a long-running process serving encrypt and decrypt jobs over
+ * a Unix domain socket, so the cost of starting up, initializing the crypto
+ * libraries and warming the allocator is paid once instead of per archive.
+ *
+ * The daemon keeps a pool of worker threads, each with its own library
+ * context, and reserves ring blocks before the first job. Workers accept
+ * connections themselves, one job per connection.
+ *
+ * A client sends the archive and its stderr as file descriptors, so the
+ * archive is opened with the client's permissions and reports go straight to
+ * the client's terminal. Relative paths are resolved against the client's
+ * working directory. The socket is only accessible to its owner.
+ */
+
+#ifndef DAEMON_H
+#define DAEMON_H
+
+#include "bitcode.h"
+
+// serves jobs on a socket at socketPath with the given number of workers
+// (0 for one per CPU). does not return
+void runDaemon(char* socketPath, int workers);
+
+// has the daemon at socketPath encrypt nodes into archiveName, or decrypt
+// archiveName (nodeC is 0), with this thread's options
+// password NULL for the default. fails like DIE if the job fails
+void requestJob(char* socketPath, bool decrypt, bool compressionOnly,
+    char* password, char* archiveName, int nodeC, char** nodes);
+
+#endif
@@ -0,0 +1,187 @@
+#include "delta.h"
+#include "encrypt.h"
+#include <stdlib.h>
+#include <string.h>
+
+// the checksum of a window of bytes: their sum, and the sum of the sums
+// after each byte, which can both be moved along a byte at a time
+typedef struct {
+    unsigned int a;
+    unsigned int b;
+} Rolling;
+
+static void startRolling(Rolling* sum, const unsigned char* bytes)
+{
+    sum->a = sum->b = 0;
+    for (int i = 0; i < DELTA_BLOCK; i++)
+    {
+        sum->a += bytes[i];
+        sum->b += sum->a;
+    }
+}
+
+// moves the window on past out, taking in
+static void roll(Rolling* sum, unsigned char out, unsigned char in)
+{
+    sum->a += in - out;
+    sum->b += sum->a - DELTA_BLOCK * out;
+}
+
+// each sum is kept to 16 bits
+static unsigned int rollingKey(Rolling* sum)
+{
+    return (sum->a & 0xffff) | sum->b << 16;
+}
+
+// the blocks of the base by their checksum. of blocks with the same
+// checksum only the first is kept, so a base of few different blocks takes
+// no longer to look in
+typedef struct {
+    unsigned int key;
+    long long block; // its index + 1, or 0 for an empty slot
+} BlockSlot;
+
+typedef struct {
+    BlockSlot* slots;
+    long long mask;
+} BlockTable;
+
+static BlockSlot* findSlot(BlockTable* table, unsigned int key)
+{
+    unsigned long long hash = key * 0x9e3779b97f4a7c15ULL;
+    hash ^= hash >> 32;
+    for (long long i = hash & table->mask;; i = (i + 1) & table->mask)
+    {
+        BlockSlot* slot = table->slots + i;
+        if (!slot->block || slot->key == key) return slot;
+    }
+}
+
+static void makeTable(BlockTable* table, const unsigned char* base,
+    long long blockCount)
+{
+    // at most half full
+    long long slotCount = 1;
+    while (slotCount < blockCount * 2) slotCount *= 2;
+    table->slots = calloc(slotCount, sizeof(BlockSlot));
+    if (!table->slots) DIE("%s", "Out of memory");
+    table->mask = slotCount - 1;
+    for (long long i = 0; i < blockCount; i++)
+    {
+        Rolling sum;
+        startRolling(&sum, base + i * DELTA_BLOCK);
+        BlockSlot* slot = findSlot(table, rollingKey(&sum));
+        if (!slot->block) *slot = (BlockSlot){rollingKey(&sum), i + 1};
+    }
+}
+
+// the delta as it is put together
+typedef struct {
+    unsigned char* bytes;
+    long long len;
+    long long size;
+    long long limit; // the most it may come to
+} DeltaOut;
+
+static bool putRun(DeltaOut* out, bool copy, long long len,
+    long long offset, const unsigned char* bytes)
+{
+    if (!len) return true;
+    long long need = out->len + VARINT_MAX * 2 + (copy ? 0 : len);
+    if (need > out->size)
+    {
+        out->size = need > out->size * 2 ? need : out->size * 2;
+        out->bytes = realloc(out->bytes, out->size);
+        if (!out->bytes) DIE("%s", "Out of memory");
+    }
+    unsigned char* at = out->bytes + out->len;
+    at += putVarint(at, (unsigned long long)len << 1 | copy);
+    if (copy) at += putVarint(at, offset);
+    else
+    {
+        memcpy(at, bytes, len);
+        at += len;
+    }
+    out->len = at - out->bytes;
+    return out->len <= out->limit;
+}
+
+bool makeDelta(const unsigned char* base, long long baseLen,
+    const unsigned char* bytes, long long len, unsigned char** delta,
+    long long* deltaLen)
+{
+    if (baseLen < DELTA_BLOCK || len < DELTA_BLOCK) return false;
+    BlockTable table;
+    makeTable(&table, base, baseLen / DELTA_BLOCK);
+    DeltaOut out = {NULL, 0, 0, len / 2};
+
+    // bytes from pending on are not in the delta yet
+    long long pending = 0;
+    long long at = 0;
+    bool fits = true;
+    Rolling sum;
+    startRolling(&sum, bytes);
+    while (fits && at + DELTA_BLOCK <= len)
+    {
+        BlockSlot* slot = findSlot(&table, rollingKey(&sum));
+        long long from = (slot->block - 1) * DELTA_BLOCK;
+        if (!slot->block || memcmp(base + from, bytes + at, DELTA_BLOCK))
+        {
+            if (at + DELTA_BLOCK < len)
+                roll(&sum, bytes[at], bytes[at + DELTA_BLOCK]);
+            at++;
+            fits = out.len + at - pending <= out.limit;
+            continue;
+        }
+        // the run copied grows back into what is pending, and on
+        long long start = at;
+        while (start > pending && from > 0 &&
+            base[from - 1] == bytes[start - 1]) start--, from--;
+        long long end = at + DELTA_BLOCK;
+        long long fromEnd = from + end - start;
+        while (end < len && fromEnd < baseLen && base[fromEnd] == bytes[end])
+            end++, fromEnd++;
+        fits = putRun(&out, false, start - pending, 0, bytes + pending) &&
+            putRun(&out, true, end - start, from, NULL);
+        pending = at = end;
+        if (at + DELTA_BLOCK <= len) startRolling(&sum, bytes + at);
+    }
+    fits = fits && putRun(&out, false, len - pending, 0, bytes + pending);
+    free(table.slots);
+    if (!fits)
+    {
+        free(out.bytes);
+        return false;
+    }
+    *delta = out.bytes;
+    *deltaLen = out.len;
+    return true;
+}
+
+void applyDelta(const unsigned char* base, long long baseLen,
+    const unsigned char* delta, long long deltaLen, int out)
+{
+    const unsigned char* at = delta;
+    const unsigned char* end = delta + deltaLen;
+    while (at < end)
+    {
+        unsigned long long op, offset;
+        if (!getVarint(&at, end, &op)) DIE("%s", "corrupt delta");
+        unsigned long long len = op >> 1;
+        const unsigned char* run = at;
+        if (op & 1)
+        {
+            if (!getVarint(&at, end, &offset) || offset > baseLen ||
+                len > baseLen - offset) DIE("%s", "corrupt delta");
+            run = base + offset;
+        }
+        else if (len > end - at) DIE("%s", "corrupt delta");
+        else at += len;
+        for (unsigned long long written = 0; written < len;)
+        {
+            long writeLen = fdwrite(out, run + written, len - written);
+            if (writeLen <= 0) SYS_DIE("write");
+            written += writeLen;
+        }
+    }
+}
@@ -0,0 +1,40 @@
+/**
+ * A delta stores a file as its changes since an older version of it, the
+ * base: runs of bytes copied from the base, and the bytes between them. A
+ * large file which changed only here and there takes little more than the
+ * bytes which changed.
+ *
+ * The base is cut into DELTA_BLOCK byte blocks, which are looked for in the
+ * file by a checksum rolled along it a byte at a time, as rsync does. Where
+ * the checksum of a block turns up, the bytes are compared, and the run
+ * copied grows both ways for as long as the base and the file still match.
+ *
+ * A delta is a series of varints (see bitcode.h), each the len of a run
+ * shifted left by one, with the low bit set for a copy. A copy is followed
+ * by the varint offset in the base it is copied from, and any other run by
+ * its len bytes.
+ */
+
+#ifndef DELTA_H
+#define DELTA_H
+
+#include "bitcode.h"
+
+// bytes in a block of the base
+#define DELTA_BLOCK (2048)
+// files and bases smaller than this are stored whole
+#define DELTA_MIN (1 << 16)
+
+// makes the delta of the len bytes from the baseLen bytes of base, in
+// *delta (malloced) of *deltaLen bytes, unless it is over half of len, when
+// it returns false
+bool makeDelta(const unsigned char* base, long long baseLen,
+    const unsigned char* bytes, long long len, unsigned char** delta,
+    long long* deltaLen);
+
+// writes the file the deltaLen bytes of delta make from the baseLen bytes of
+// base to out
+void applyDelta(const unsigned char* base, long long baseLen,
+    const unsigned char* delta, long long deltaLen, int out);
+
+#endif
@@ -1,6 +1,13 @@
 #define _XOPEN_SOURCE
 #include "encrypt.h"
 #include "far.h"
+#include "batch.h"
+#include "daemon.h"
+#include "stats.h"
+#include "trace.h"
+#include "progress.h"
+#include "loader.h"
+#include "cache.h"
 #include "lzw.h"
 #ifdef ENCRYPT
 #include "rsa.h"
@@ -13,29 +20,16 @@
 #include <pwd.h>
 #include <unistd.h>
 #include <fcntl.h>
-#include <sys/wait.h>
 #include <signal.h>
 
 #define PASSWORD_PROMPT "Input password: "
 
-// quiet mode
-bool quiet = false;
-// verbose mode
-bool verbose = false;
-// remove original files (listed files on encrypt, archive on decrypt)
-bool removeOriginal = false;
 // just compress
 #ifdef ENCRYPT
 bool compressionOnly = false;
 #else
 bool compressionOnly = true; // make sure this can never be set to false
 #endif
-// execute parts in sequence, without extra processes
-bool series = false;
-
-// only owner has permission for the archive
-// it can be read or (over)written
-#define ARCHIVE_PERMISSION (0600)
 
 #if MAC
 #else
@@ -48,7 +42,7 @@ char* strdup(const char* s1)
 #endif
 
 // doesn't have to worry about encoding, since archive() takes care of that
-// uses a child process to archive/encode and encrypts in the parent
+// archives/encodes in a second thread and encrypts in this one
 void protect(char* password, char* archiveName, char* archiveLZW,
     int nodeC, char** nodes)
 {
@@ -60,86 +54,62 @@ void protect(char* password, char* archiveName, char* archiveLZW,
 
     if (compressionOnly)
     {
-        archive(newFile, archiveLZW, nodeC, nodes);
+        StatsMark mark;
+        markStats(&mark);
+        archive(newFile, NULL, archiveLZW, nodeC, nodes);
+        statsStage("Archive", &mark);
     }
     else
     {
-        int archiveToEncryptPipe[2];
-        if (pipe(archiveToEncryptPipe)) SYS_DIE("pipe");
-
-        pid_t archiveProcess = fork();
-        if (archiveProcess < 0) SYS_DIE("fork");
-        if (archiveProcess == 0)
-        {
-            if (close(archiveToEncryptPipe[0])) SYS_DIE("close");
-            archive(archiveToEncryptPipe[1], archiveLZW, nodeC, nodes);
-            
-            exit(0);
-        }
-        // parent process
-        if (close(archiveToEncryptPipe[1])) SYS_DIE("close");
-#ifdef ENCRYPT
-        encryptRSA(password, archiveToEncryptPipe[0], newFile);
-#endif
-        if (close(archiveToEncryptPipe[0])) SYS_ERROR("close");
-
-        // wait for child process to end (reap it)
-        int archiveStatus = 0;
-        if (waitpid(archiveProcess, &archiveStatus, 0) < 0) SYS_DIE("waitpid");
-        if (archiveStatus)
-            DIE("Archive exited with status %d", STAT(archiveStatus));
+        protectStream(password, newFile, NULL, archiveLZW, nodeC, nodes);
     }
 
 
     if (close(newFile)) SYS_ERROR("close");
 }
 
+// -o on a seekable archive (-x) only decrypts the blocks holding the files
+// asked for and the headers of the members. returns whether it was one
+static bool catIndexed(char* password, int archiveFile)
+{
+#ifdef ENCRYPT
+    if (extractMode != EXTRACT_CAT) return false;
+    int plain = openRSAReader(password, archiveFile);
+    if (plain < 0) return false;
+    StatsMark mark;
+    markStats(&mark);
+    extract(plain, NULL);
+    statsStage("Extract", &mark);
+    if (fdclose(plain)) SYS_ERROR("close");
+    return true;
+#else
+    return false;
+#endif
+}
+
 // extract() takes care of decoding
-// use child process for decrypting, extract in parent
+// decrypts in a second thread and extracts in this one
 void unprotect(char* password, char* archiveName)
 {
     int archiveFile = STDIN_FILENO;
     if (strcmp(archiveName, "-"))
         archiveFile = open(archiveName, O_RDONLY);
     if (archiveFile < 0) SYS_DIE("open");
+    progressSource(archiveFile);
 
-    int decryptToExtractPipe[2] = {0, 0};
-    pid_t decryptProcess = 0;
     if (compressionOnly) {
         // if not decrypting, just pass archiveFile in to extract
-        extract(archiveFile);
+        StatsMark mark;
+        markStats(&mark);
+        extract(archiveFile, NULL);
+        statsStage("Extract", &mark);
     }
-    else
+    else if (!catIndexed(password, archiveFile))
     {
-        if (pipe(decryptToExtractPipe)) SYS_DIE("pipe");
-
-        decryptProcess = fork();
-        if (decryptProcess < 0) SYS_DIE("fork");
-        if (decryptProcess == 0)
-        {
-            if (close(decryptToExtractPipe[0])) SYS_DIE("close");
-
-// definitely defined, but don't want this part to compile without decryptRSA
-#ifdef ENCRYPT
-            decryptRSA(password, archiveFile, decryptToExtractPipe[1]);
-#endif
-            exit(0);
-        }
-        if (close(decryptToExtractPipe[1])) SYS_ERROR("close");
+        unprotectStream(password, archiveFile, NULL);
     }
     if (close(archiveFile)) SYS_ERROR("close");
 
-    if (!compressionOnly) {
-        extract(decryptToExtractPipe[0]);
-
-        if (close(decryptToExtractPipe[0])) SYS_ERROR("close");
-
-        // reap the zombie
-        int status = 0;
-        if (waitpid(decryptProcess, &status, 0) < 0) SYS_DIE("waitpid");
-        if (status) DIE("decryptProcess exit status %d", STAT(status));
-    }
-
     if (strcmp(archiveName, "-") && removeOriginal && remove(archiveName))
         SYS_ERROR("remove");
 }
@@ -153,23 +123,29 @@ void protectS(char* password, char* archiveName, char* archiveFar,
         arch = fopen(archiveName, "w");
     if (!arch) SYS_DIE("fopen");
 
+    StatsMark mark;
+    markStats(&mark);
     if (compressionOnly)
     {
-        archive(fileno(arch), archiveLZW, nodeC, nodes);
+        archive(fileno(arch), NULL, archiveLZW, nodeC, nodes);
+        statsStage("Archive", &mark);
     }
     else
     {
         // archive into far
         FILE* far = fopen(archiveFar, "w");
         if (!far) SYS_DIE("fopen");
-        archive(fileno(far), archiveLZW, nodeC, nodes);
+        archive(fileno(far), NULL, archiveLZW, nodeC, nodes);
         if (fclose(far)) SYS_ERROR("fclose");
+        statsStage("Archive", &mark);
         // encrypt from far to archive
+        markStats(&mark);
         far = fopen(archiveFar, "r");
         if (!far) SYS_DIE("fopen");
 #ifdef ENCRYPT
         encryptRSA(password, fileno(far), fileno(arch));
 #endif
+        statsStage("Encrypt", &mark);
         if (fclose(far)) SYS_ERROR("fclose");
         if (remove(archiveFar)) SYS_ERROR("remove");
     }
@@ -182,12 +158,16 @@ void unprotectS(char* password, char* archiveName, char* archiveFar)
     if (strcmp(archiveName, "-"))
         arch = fopen(archiveName, "r");
     if (!arch) SYS_DIE("fopen");
+    progressSource(fileno(arch));
 
+    StatsMark mark;
+    markStats(&mark);
     if (compressionOnly)
     {
-        extract(fileno(arch));
+        extract(fileno(arch), NULL);
+        statsStage("Extract", &mark);
     }
-    else
+    else if (!catIndexed(password, fileno(arch)))
     {
         // decrypt into far
         FILE* far = fopen(archiveFar, "w");
@@ -196,10 +176,13 @@ void unprotectS(char* password, char* archiveName, char* archiveFar)
         decryptRSA(password, fileno(arch), fileno(far));
 #endif
         if (fclose(far)) SYS_ERROR("fclose");
+        statsStage("Decrypt", &mark);
         // extract from far
+        markStats(&mark);
         far = fopen(archiveFar, "r");
         if (!far) SYS_DIE("fopen");
-        extract(fileno(far));
+        extract(fileno(far), NULL);
+        statsStage("Extract", &mark);
         if (fclose(far)) SYS_ERROR("fclose");
         if (remove(archiveFar)) SYS_ERROR("remove");
     }
@@ -208,7 +191,121 @@ void unprotectS(char* password, char* archiveName, char* archiveFar)
     if (removeOriginal && remove(archiveName)) SYS_ERROR("remove");
 }
 
-#define USAGE_FORMAT "Usage:\n%s [options] ArchiveName File1 File2 ...\n"
+// adds what has changed of nodes to the archive as a new segment (see
+// appendArchive()), in ArchiveName.new, which replaces it once it is whole,
+// so a run which fails leaves the archive as it was. a compressed archive is
+// copied, by the kernel where it can, and grown at its end. an encrypted one
+// is decrypted and encrypted again, as its keystream can't be taken up where
+// it stopped. its members are copied through as they are, so only the
+// changed files are read and encoded
+void protectAppend(char* password, char* archiveName, char* archiveFar,
+    char* archiveLZW, int nodeC, char** nodes)
+{
+    if (!strcmp(archiveName, "-")) DIE("%s", "Can't append to -");
+    StatsMark mark;
+    char newName[strlen(archiveName) + 5];
+    sprintf(newName, "%s.new", archiveName);
+    if (compressionOnly)
+    {
+        int old = open(archiveName, O_RDONLY);
+        if (old < 0 && errno != ENOENT) SYS_DIE("open");
+        int arch = open(newName, O_RDWR|O_CREAT|O_TRUNC, ARCHIVE_PERMISSION);
+        if (arch < 0) SYS_DIE("open");
+        markStats(&mark);
+        if (old >= 0)
+        {
+            struct stat data;
+            if (fstat(old, &data)) SYS_DIE("fstat");
+            if (fdcopy(old, arch, -1) < data.st_size)
+                DIE("%s", "Unable to copy archive");
+            if (close(old)) SYS_ERROR("close");
+            if (lseek(arch, 0, SEEK_SET)) SYS_DIE("lseek");
+        }
+        statsStage("Copy", &mark);
+        markStats(&mark);
+        appendArchive(arch, arch, NULL, archiveLZW, nodeC, nodes);
+        statsStage("Archive", &mark);
+        if (close(arch)) SYS_ERROR("close");
+        if (rename(newName, archiveName)) SYS_DIE("rename");
+        return;
+    }
+
+    int old = open(archiveName, O_RDONLY);
+    if (old < 0 && errno == ENOENT)
+    {
+        // nothing to append to yet
+        if (series)
+            protectS(password, archiveName, archiveFar, archiveLZW, nodeC,
+                nodes);
+        else protect(password, archiveName, archiveLZW, nodeC, nodes);
+        return;
+    }
+    if (old < 0) SYS_DIE("open");
+    // each use of a password zeroes it
+    char* oldPassword = password ? strdup(password) : NULL;
+    int arch = open(newName, O_WRONLY|O_CREAT|O_TRUNC, ARCHIVE_PERMISSION);
+    if (arch < 0) SYS_DIE("open");
+
+    if (series)
+    {
+        int far = open(archiveFar, O_RDWR|O_CREAT|O_TRUNC,
+            ARCHIVE_PERMISSION);
+        if (far < 0) SYS_DIE("open");
+        markStats(&mark);
+#ifdef ENCRYPT
+        decryptRSA(oldPassword, old, far);
+#endif
+        statsStage("Decrypt", &mark);
+        // append to far where it is
+        markStats(&mark);
+        if (lseek(far, 0, SEEK_SET)) SYS_DIE("lseek");
+        appendArchive(far, far, NULL, archiveLZW, nodeC, nodes);
+        statsStage("Archive", &mark);
+        // encrypt from far to archive
+        markStats(&mark);
+        if (lseek(far, 0, SEEK_SET)) SYS_DIE("lseek");
+#ifdef ENCRYPT
+        encryptRSA(password, far, arch);
+#endif
+        statsStage("Encrypt", &mark);
+        if (close(far)) SYS_ERROR("close");
+        if (remove(archiveFar)) SYS_ERROR("remove");
+    }
+    else
+    {
+        appendStream(oldPassword, password, old, arch, NULL, archiveLZW,
+            nodeC, nodes);
+    }
+    free(oldPassword);
+    if (close(old)) SYS_ERROR("close");
+    if (close(arch)) SYS_ERROR("close");
+    if (rename(newName, archiveName)) SYS_DIE("rename");
+}
+
+// the reference archive at path (see far.h), decrypted into a temporary
+// file unless it is only compressed
+int openReferenceArchive(char* password, char* path)
+{
+    int in = open(path, O_RDONLY);
+    if (in < 0) SYS_DIE("open reference");
+    if (compressionOnly) return in;
+    FILE* temp = tmpfile();
+    if (!temp) SYS_DIE("tmpfile");
+    int far = dup(fileno(temp));
+    if (far < 0) SYS_DIE("dup");
+    if (fclose(temp)) SYS_ERROR("fclose");
+    // each use of a password zeroes it
+    char* copy = password ? strdup(password) : NULL;
+#ifdef ENCRYPT
+    decryptRSA(copy, in, far);
+#endif
+    free(copy);
+    if (close(in)) SYS_ERROR("close");
+    return far;
+}
+
+#define USAGE_FORMAT "Usage:\n%s [options] ArchiveName File1 File2 ...\n" \
+    "%s [options] -b Manifest\n"
 
 void printFlagsInfo(char* flags, bool decrypt)
 {
@@ -246,6 +343,46 @@ void printFlagsInfo(char* flags, bool decrypt)
                 "Decompression only. Same as lzwdecompress.":
                 "Compression only. Same as lzwcompress."; break;}
 
+            case 'x':
+            {d = decrypt?
+                "Seekable mode. Detected automatically.":
+                "Seekable mode. Indexes the encrypted archive."; break;}
+
+            case 'd':
+            {d = decrypt?
+                "Drop cache. Has no effect.":
+                "Drop cache. Frees the page cache of files once archived.";
+                break;}
+
+            case 'b':
+            {d = "Batch mode. Runs the jobs listed in the Manifest file.";
+                break;}
+
+            case 't':
+            {d = decrypt?
+                "Test mode. Checks every file in the archive, writing none.":
+                "Test mode. Has no effect.";
+                break;}
+
+            case 'f':
+            {d = decrypt?
+                "Diff mode. Lists how the files here differ from the archive.":
+                "Diff mode. Has no effect.";
+                break;}
+
+            case 'o':
+            {d = decrypt?
+                "Output mode. Writes the Files in the archive to standard "
+                "output.":
+                "Output mode. Has no effect.";
+                break;}
+
+            case 'a':
+            {d = decrypt?
+                "Append mode. Has no effect.":
+                "Append mode. Adds what has changed to ArchiveName.";
+                break;}
+
             default: DIE("Invalid flag to describe: %c", f);
         }
         fprintf(stderr, "-%c: %s\n", f, d);
@@ -256,12 +393,36 @@ void printFlagsInfo(char* flags, bool decrypt)
 void showHelpInfo(bool decrypt)
 {
 #ifdef ENCRYPT
-    fprintf(stderr, USAGE_FORMAT, decrypt ? "decrypt" : "encrypt");
-    printFlagsInfo("rqvpisc", decrypt);
+    char* name = decrypt ? "decrypt" : "encrypt";
+    fprintf(stderr, USAGE_FORMAT, name, name);
+    printFlagsInfo("rqvpiscxdatfob", decrypt);
 #else
-    fprintf(stderr, USAGE_FORMAT, decrypt ? "lzwdecompress" : "lzwcompress");
-    printFlagsInfo("rqvs", decrypt);
+    char* name = decrypt ? "lzwdecompress" : "lzwcompress";
+    fprintf(stderr, USAGE_FORMAT, name, name);
+    printFlagsInfo("rqvsdatfob", decrypt);
 #endif
+    fprintf(stderr, "--jobs=N: Workers for -b and --serve. "
+        "Default is one per CPU.\n");
+    fprintf(stderr, "--serve=Socket: Serves jobs on Socket until killed.\n");
+    fprintf(stderr, "--connect=Socket: Has the daemon on Socket do the job.\n");
+    fprintf(stderr, "--stats=File: Writes statistics of the run to File as "
+        "JSON.\n");
+    fprintf(stderr, "--status-fd=N: Writes progress to descriptor N every "
+        "second and on SIGUSR1.\n");
+    fprintf(stderr, "--readahead=Bytes: Reads up to Bytes of the next files "
+        "ahead. Default 64MB.\n");
+    fprintf(stderr, "--cache=File: Reuses what was stored of unchanged files "
+        "from File.\n");
+    fprintf(stderr, "--reference=File: Stores large files as their changes "
+        "since archive File.\n");
+    fprintf(stderr, "--stdin=Name: Archives standard input as the file "
+        "Name.\n");
+    fprintf(stderr, "--files-from=File: Archives the nodes listed in File, "
+        "each ended by a NUL.\n");
+    fprintf(stderr, "--output-fd=N: Writes the Files of -o to descriptor N "
+        "instead.\n");
+    fprintf(stderr, "--trace=File: Writes a Chrome trace of the run to File. "
+        "Needs make TRACE=1.\n");
     exit(0);
 }
 
@@ -301,12 +462,66 @@ int main(int argc, char** argv)
     bool showPassword = false;
     
     bool defaultPassword = false;
+    bool batch = false;
+    bool append = false;
+    int jobs = 0;
+    char* servePath = NULL;
+    char* connectPath = NULL;
+    char* statsPath = NULL;
+    char* tracePath = NULL;
+    char* referencePath = NULL;
+    char* listPath = NULL;
+    int statusFd = -1;
     int flagIndex = 1;
     while (flagIndex < argc && argv[flagIndex][0] == '-')
     {
         char* flag = argv[flagIndex]+1;
         int flagCount = strlen(flag);
         if (flagCount == 0) break; // ArchiveName is "-"
+        if (flag[0] == '-')
+        {
+            // long options are --name=value
+            char* end;
+            if (!strncmp(flag, "-jobs=", 6))
+            {
+                if ((jobs = strtol(flag + 6, &end, 10)) <= 0 || *end)
+                    showHelpInfo(decrypt);
+            }
+            else if (!strncmp(flag, "-serve=", 7) && flag[7])
+                servePath = flag + 7;
+            else if (!strncmp(flag, "-connect=", 9) && flag[9])
+                connectPath = flag + 9;
+            else if (!strncmp(flag, "-stats=", 7) && flag[7])
+                statsPath = flag + 7;
+            else if (!strncmp(flag, "-status-fd=", 11))
+            {
+                if ((statusFd = strtol(flag + 11, &end, 10)) < 0 ||
+                    end == flag + 11 || *end) showHelpInfo(decrypt);
+            }
+            else if (!strncmp(flag, "-trace=", 7) && flag[7])
+                tracePath = flag + 7;
+            else if (!strncmp(flag, "-readahead=", 11))
+            {
+                if ((readaheadBytes = strtoll(flag + 11, &end, 10)) < 0 ||
+                    end == flag + 11 || *end) showHelpInfo(decrypt);
+            }
+            else if (!strncmp(flag, "-cache=", 7) && flag[7])
+                cachePath = flag + 7;
+            else if (!strncmp(flag, "-reference=", 11) && flag[11])
+                referencePath = flag + 11;
+            else if (!strncmp(flag, "-files-from=", 12) && flag[12])
+                listPath = flag + 12;
+            else if (!strncmp(flag, "-stdin=", 7) && flag[7] &&
+                flag[strlen(flag)-1] != '/') streamName = flag + 7;
+            else if (!strncmp(flag, "-output-fd=", 11))
+            {
+                if ((catFd = strtol(flag + 11, &end, 10)) < 0 ||
+                    end == flag + 11 || *end) showHelpInfo(decrypt);
+            }
+            else showHelpInfo(decrypt);
+            flagIndex++;
+            continue;
+        }
         for (int fIndex = 0; fIndex < flagCount; fIndex++)
         {
             if (flag[fIndex] == 'r') removeOriginal = true;
@@ -316,15 +531,38 @@ int main(int argc, char** argv)
             else if (flag[fIndex] == 'p') showPassword = true;
             else if (flag[fIndex] == 'i') defaultPassword = true;
             else if (flag[fIndex] == 'c') compressionOnly = true;
+            else if (flag[fIndex] == 'x') seekable = true;
 #endif
             else if (flag[fIndex] == 's') series = true;
+            else if (flag[fIndex] == 'd') dropCache = true;
+            else if (flag[fIndex] == 'b') batch = true;
+            else if (flag[fIndex] == 'a') append = true;
+            else if (flag[fIndex] == 't') extractMode = EXTRACT_TEST;
+            else if (flag[fIndex] == 'f') extractMode = EXTRACT_DIFF;
+            else if (flag[fIndex] == 'o') extractMode = EXTRACT_CAT;
             else showHelpInfo(decrypt);
         }
         flagIndex++;
     }
 
-    if (decrypt && argc-flagIndex < 1) showHelpInfo(decrypt);
-    if (!decrypt && argc-flagIndex < 2) showHelpInfo(decrypt);
+    // the daemon takes its passwords and files from its clients
+    if (servePath) runDaemon(servePath, jobs);
+
+    if ((decrypt || batch) && argc-flagIndex < 1) showHelpInfo(decrypt);
+    // with --stdin or --files-from, the Files may be left out
+    if (!decrypt && !batch &&
+        argc-flagIndex < (streamName || listPath ? 1 : 2))
+        showHelpInfo(decrypt);
+    bool listInput = listPath && !strcmp(listPath, "-");
+    if (streamName && listInput)
+        DIE("%s", "--stdin and --files-from=- can't both read standard input");
+    if (decrypt && !batch && extractMode == EXTRACT_CAT)
+    {
+        // the Files to write out
+        if (argc-flagIndex < 2) showHelpInfo(decrypt);
+        catNameC = argc-flagIndex-1;
+        catNames = argv+flagIndex+1;
+    }
 
     // take password as input
     char* password = NULL;
@@ -333,6 +571,12 @@ int main(int argc, char** argv)
         // terminal input
         FILE* devtty = fopen("/dev/tty", "r");
         passread = devtty ? devtty : stdin;
+        if (!devtty && (streamName || listInput) && !decrypt && !batch &&
+            !connectPath)
+        {
+            DIE("%s", "Standard input is taken, so the password must be "
+                "typed at a terminal, or use -i");
+        }
 
         struct termios TermConf;
         if (tcgetattr(fileno(passread), &TermConf)) SYS_ERROR("tcgetattr");
@@ -376,7 +620,8 @@ int main(int argc, char** argv)
                 SYS_ERROR("tcsetattr");
             // I just swallowed the newline
             FILE* writetty = fopen("/dev/tty", "w");
-            fprintf(writetty ? writetty : stdout, "\n");
+            // standard output may be what -o writes to
+            fprintf(writetty ? writetty : stderr, "\n");
             if (writetty && fclose(writetty)) SYS_ERROR("fclose");
         }
 
@@ -388,6 +633,78 @@ int main(int argc, char** argv)
 
     char* archiveName = argv[flagIndex];
 
+    // timed from here, after the password is typed
+    if (statsPath) startStats();
+    TRACE_THREAD("main");
+#ifndef TRACE
+    if (tracePath) WARN("%s", "--trace is ignored, build with make TRACE=1");
+#endif
+
+    if (cachePath && connectPath)
+        WARN("%s", "--cache is ignored with --connect");
+    else if (cachePath && !compressionOnly)
+    {
+        // what it keeps is not encrypted, and would give the files away
+        WARN("%s", "--cache is ignored without -c");
+        cachePath = NULL;
+    }
+    if (referencePath && (batch || connectPath))
+        WARN("%s", "--reference is ignored with -b and --connect");
+    else if (referencePath)
+        referenceArchive = openReferenceArchive(password, referencePath);
+    if (streamName && (decrypt || batch || connectPath))
+    {
+        WARN("%s", "--stdin is ignored on decrypt, and with -b and --connect");
+        streamName = NULL;
+    }
+    if (listPath && (decrypt || batch || connectPath))
+        WARN("%s", "--files-from is ignored on decrypt, and with -b and "
+            "--connect");
+    else if (listPath)
+    {
+        listFd = listInput ? STDIN_FILENO : open(listPath, O_RDONLY);
+        if (listFd < 0) SYS_DIE("open list");
+    }
+    if (append && (batch || connectPath))
+        WARN("%s", "-a is ignored with -b and --connect");
+    if (extractMode != EXTRACT_FILES && connectPath)
+        WARN("%s", "-t, -f and -o are ignored with --connect");
+    if (extractMode != EXTRACT_FILES && removeOriginal)
+    {
+        // the archive is only read, so it is kept
+        WARN("%s", "-r is ignored with -t, -f and -o");
+        removeOriginal = false;
+    }
+    if (statusFd >= 0 && (batch || connectPath))
+        WARN("%s", "--status-fd is ignored with -b and --connect");
+    else if (statusFd >= 0)
+    {
+        // archiving measures the files, extracting measures the archive.
+        // what is read from a pipe can't be measured first
+        long long total = decrypt || listFd >= 0 || streamName ? -1 :
+            archiveBytes(NULL, argc-flagIndex-1, argv+flagIndex+1);
+        startProgress(statusFd, total);
+    }
+
+    if (batch)
+    {
+        int failures = runBatch(archiveName, password, jobs, compressionOnly);
+        if (!compressionOnly && !defaultPassword) free(password);
+        if (statsPath) writeStats(statsPath, "batch");
+#ifdef TRACE
+        if (tracePath) writeTrace(tracePath);
+#endif
+        return failures ? EXIT_FAILURE : 0;
+    }
+
+    if (connectPath)
+    {
+        requestJob(connectPath, decrypt, compressionOnly, password,
+            archiveName, argc-flagIndex-1, argv+flagIndex+1);
+        if (!compressionOnly && !defaultPassword) free(password);
+        return 0;
+    }
+
     int archiveNameLen = strlen(archiveName);
 
     // make room for .lzw with null terminator
@@ -402,6 +719,11 @@ int main(int argc, char** argv)
         {
             unprotectS(password, archiveName, archiveFar);
         }
+        else if (append)
+        {
+            protectAppend(password, archiveName, archiveFar, archiveLZW,
+                argc-flagIndex-1, argv+flagIndex+1);
+        }
         else
         {
             protectS(password, archiveName, archiveFar, archiveLZW,
@@ -416,6 +738,11 @@ int main(int argc, char** argv)
             // Decrypt
             unprotect(password, archiveName);
         }
+        else if (append)
+        {
+            protectAppend(password, archiveName, NULL, archiveLZW,
+                argc-flagIndex-1, argv+flagIndex+1);
+        }
         else
         {
             // Encrypt
@@ -426,6 +753,13 @@ int main(int argc, char** argv)
     free(archiveLZW);
 
     if (!compressionOnly && !defaultPassword) free(password);
+    if (referenceArchive >= 0 && close(referenceArchive)) SYS_ERROR("close");
+    if (listFd > STDIN_FILENO && close(listFd)) SYS_ERROR("close");
+    stopProgress();
+    if (statsPath) writeStats(statsPath, progName);
+#ifdef TRACE
+    if (tracePath) writeTrace(tracePath);
+#endif
 }
 
 
@@ -23,8 +23,9 @@
  *       password is correct).
  *
  * -s    Series mode. Executes the three parts of the program in sequence.
- *       Uses fewer processes and file descriptors. Default is parallel mode,
- *       which is almost always faster but status logs are more confusing.
+ *       Uses fewer threads and memory. Default is parallel mode, which runs
+ *       the parts as threads connected by ring buffers (see channel.h). It is
+ *       almost always faster but status logs are more confusing.
  *
  * -i    Insecure mode. Does not prompt for password, instead using the default
  *       password DEFAULT_PASSWORD defined in keys.h. Overrides -p flag.
@@ -32,7 +33,113 @@
  * -c    Compression/Decompression only. Same as using lzwcompress and
  *       lzwdecompress when compiled with make compression
  *
+ * -x    Seekable mode. On encrypt, reseeds the keystream in blocks and appends
+ *       an index of the blocks, so any part of the archive can be decrypted
+ *       without decrypting everything before it. decrypt detects this on its
+ *       own, so the flag has no effect there.
+ *
+ * -d    Drop cache. On encrypt, tells the kernel the pages of each file won't
+ *       be needed again once it is archived (POSIX_FADV_DONTNEED), so a
+ *       backup does not push what other programs are using out of the page
+ *       cache. This also drops pages of the files they had cached already.
+ *       No effect on decrypt.
+ *
+ * -a    Append mode. On encrypt, adds a segment to the existing archive
+ *       ArchiveName with only the files whose type, mode, mtime, size or
+ *       contents have changed, and marks the ones gone from under File1
+ *       File2 ... as deleted (see far.h). A regular file whose mode, mtime
+ *       and size have not changed is read for its Cyclic Redundancy Check.
+ *       Decrypting it gives the files as of the latest segment. The new
+ *       archive is made as ArchiveName.new and renamed over it once whole,
+ *       so a run which fails leaves it as it was. A compressed archive (-c)
+ *       is copied and grown there. An encrypted one is encrypted again,
+ *       without compressing the unchanged files again. Made if there is
+ *       none. No effect on decrypt, or with -b or --connect.
+ *
+ * -t    Test mode. On decrypt, decrypts, decodes and checks every file in the
+ *       archive against its Cyclic Redundancy Check without writing any of
+ *       them, and fails if any do not match. The files of an archive which is
+ *       only compressed (-c) are checked in parallel, a thread to each CPU,
+ *       unless in series mode. No effect on encrypt.
+ *
+ * -f    Diff mode. On decrypt, compares the files in the archive, as of its
+ *       latest segment, with those in the working directory, and lists each
+ *       one which is missing (-), added to a directory (+), of another type
+ *       (T), of other contents by size or checksum (M), or of another mode
+ *       or mtime only (m). Fails if any differ. No effect on encrypt.
+ *
+ * -o    Output mode. On decrypt, writes the contents of the regular files
+ *       File1 File2 ..., named as in the archive, and of those in
+ *       directories so named, one after another to standard output, or to
+ *       --output-fd=N, without writing anything to disk. Fails if a name has
+ *       no files. Of an archive file which is only compressed (-c), only
+ *       the latest version of each file is decoded, and the rest of the
+ *       archive is passed over. Of one encrypted with -x, the same is done
+ *       through its index, decrypting only the blocks holding those files
+ *       and the headers of the others. Of any other, the files are gathered
+ *       in a temporary file, and the latest versions written once it is
+ *       read to its end. No effect on encrypt.
+ *
+ * -b    Batch mode. ArchiveName is a manifest of archives to encrypt and
+ *       decrypt (see batch.h), which run at the same time on a pool of
+ *       --jobs=N worker threads, by default one per CPU. The password is
+ *       asked for once and used for every job.
+ *
+ * --serve=Socket    Daemon mode. Serves jobs from clients on the Unix socket
+ *       Socket with --jobs=N workers, until killed (see daemon.h).
+ *       Takes no ArchiveName.
+ *
+ * --connect=Socket  Client mode. Has the daemon on Socket do the job, with
+ *       the same arguments and output as doing it here.
+ *
+ * --stats=File      Writes JSON statistics of the run to File when it ends:
+ *       wall and CPU time, bytes and system calls of each stage, and the
+ *       size, ratio and encoding and CRC times of each file (see stats.h).
+ *       Not collected with --connect, where the daemon does the work.
+ *
+ * --status-fd=N     Writes a line of JSON with the bytes done, throughput,
+ *       time left and current file to descriptor N every second and when
+ *       sent SIGUSR1 (see progress.h). Archiving scans the files first to
+ *       know the total. Not with -b or --connect.
+ *
+ * --readahead=Bytes Reads up to Bytes of the next files ahead of the one
+ *       being archived, or has the kernel read them (see loader.h). Default
+ *       64MB. 0 turns it off. Not in series mode.
+ *
+ * --cache=File      On encrypt, keeps what is stored of each file in the
+ *       cache File, and copies it into the archive instead of reading and
+ *       encoding the file again while its size and mtime stay the same (see
+ *       cache.h). Made if there is none. Only with -c, as the cache is not
+ *       encrypted, and would give away the files of an encrypted archive to
+ *       anyone who can read it. Not with --connect.
+ *
+ * --reference=File  Stores each file of 64KB or more which the archive File
+ *       also has as its changes since the version there (see delta.h), so a
+ *       file which changed a little takes a little room. decrypt needs the
+ *       same File to rebuild them. File is decrypted with the same password.
+ *       Not with -b or --connect.
+ *
+ * --stdin=Name      On encrypt, archives what is read from standard input
+ *       until EOF as the file Name, after File1 File2 ..., which may then be
+ *       left out. It is compressed a chunk at a time as it comes, so output
+ *       from a pipe needs no room on disk first. Needs the password from a
+ *       terminal, or -i or -c. Not with -b or --connect.
+ *
+ * --files-from=File On encrypt, archives after File1 File2 ..., which may
+ *       then be left out, the nodes named in File, or standard input if File
+ *       is -, each ended by a NUL, as find -print0 writes them. They are
+ *       archived in the order given, and a directory named is archived
+ *       without walking into it, so the list says what is in it. File is
+ *       read as the archiving goes, so it may come from a pipe which is
+ *       still being written. From standard input, needs the password from
+ *       a terminal, or -i or -c. Not with -b or --connect.
+ *
+ * --trace=File      Writes the spans of each thread to File as a Chrome
+ *       trace, for chrome://tracing or Perfetto (see trace.h). Only in
+ *       builds made with make TRACE=1, and not with --connect.
+ *
  * Flags may be separated or condensed, so -pq and -pv -q are both valid
+ * Long options are written --name=value and may not be condensed
  * 
  * The following filenames must be unused
  * (files will be overwritten if writable),
@@ -66,6 +173,10 @@
 
 #include "bitcode.h"
 #include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <dirent.h>
 
 // if MAC is zero,
 // struct stat must have member st_atime and company
@@ -75,34 +186,111 @@
 
 #define DEFAULT_PASSWORD "password"
 
-extern bool quiet;
-extern bool verbose;
-extern bool removeOriginal;
-extern bool series;
+// only owner has permission for the archive
+// it can be read or (over)written
+#define ARCHIVE_PERMISSION (0600)
+
+// options are per thread, so library contexts (see libfar.h) can differ
+// stages (see channel.h) start with the options of the thread starting them
+extern __thread bool quiet;
+extern __thread bool verbose;
+extern __thread bool removeOriginal;
+extern __thread bool series;
+extern __thread bool seekable;
+extern __thread bool dropCache;
+// where reports go, stderr if NULL
+extern __thread FILE* logFile;
+
+typedef struct {
+    bool quiet;
+    bool verbose;
+    bool removeOriginal;
+    bool series;
+    bool seekable;
+    bool dropCache;
+    FILE* logFile;
+} Options;
+
+// copy this thread's options out and in
+void saveOptions(Options* options);
+void loadOptions(Options* options);
+
+// this thread's options as flags for farSetFlags() (see libfar.h)
+int optionFlags(void);
 
 #define EXIT_FAILURE 1
 
+#define LOG (logFile ? logFile : stderr)
+
 // use for major status changes and minor errors
-#define STATUS(format,...) if(!quiet)fprintf(stderr,format "\n",__VA_ARGS__)
+#define STATUS(format,...) if(!quiet)fprintf(LOG,format "\n",__VA_ARGS__)
 // use for minor progress reports
-#define PROGRESS(format,...) if(verbose)fprintf(stderr,format "\n",__VA_ARGS__)
+#define PROGRESS(format,...) if(verbose)fprintf(LOG,format "\n",__VA_ARGS__)
 
 // no newline, string literal
-#define PROGRESS_PART(format) if(verbose)fprintf(stderr,format)
+#define PROGRESS_PART(format) if(verbose)fprintf(LOG,format)
 
-// Write message to stderr using format FORMAT
-#define WARN(format,...) fprintf (stderr, format "\n", __VA_ARGS__)
+// Write message to stderr (or logFile) using format FORMAT
+#define WARN(format,...) fprintf (LOG, format "\n", __VA_ARGS__)
 
 // Write message to stderr using format FORMAT and exit.
-#define DIE(format,...)  WARN(format,__VA_ARGS__), exit (EXIT_FAILURE)
+// Inside a library call, makes the call fail with the message instead.
+#define DIE(format,...)  fatal(format,__VA_ARGS__)
 
 // call after system call fails to print error associated with errno
-#define SYS_ERROR(name) if(!quiet)perror(name)
+#define SYS_ERROR(name) if(!quiet)fprintf(LOG,"%s: %s\n",name,strerror(errno))
 // system error followed by return from current function
 #define SYS_ERR_DONE(name) {SYS_ERROR(name);return;}
 // fatal system error
-#define SYS_DIE(name) perror(name),exit(EXIT_FAILURE)
+#define SYS_DIE(name) fatal("%s: %s",name,strerror(errno))
 
 #define STAT(x) (WIFEXITED(x) ? WEXITSTATUS(x) : 128+WTERMSIG(x))
 
+// behind DIE and SYS_DIE. does not return
+void fatal(const char* format, ...) __attribute__((noreturn));
+
+// the library call (FarContext) running on this thread, or NULL
+void* currentContext(void);
+
+// runs run(arg) so that failures on this thread go to context
+// returns whether it finished. with a NULL context, failures exit
+bool runInContext(void* context, void (*run)(void*), void* arg);
+
+// open(2), close(2), mmap(2) (of the whole of fd from its start), munmap(2),
+// tmpfile(3), fclose(3), opendir(3) and closedir(3), which inside a library
+// call also hold what they open for it, so that it is released if the call
+// fails (see releaseHeld())
+int heldOpen(const char* path, int flags, mode_t mode);
+int heldClose(int fd);
+void* heldMmap(size_t len, int prot, int flags, int fd);
+int heldMunmap(void* map, size_t len);
+FILE* heldTmpfile(void);
+int heldFclose(FILE* file);
+DIR* heldOpendir(const char* path);
+int heldClosedir(DIR* directory);
+
+// holds a descriptor opened otherwise, until heldClose()
+void holdFd(int fd);
+
+// holds a temporary file by its path, which is removed if the call fails
+void holdPath(const char* path);
+void letGoPath(const char* path);
+
+// releases what the failed library call of context held. its stages must
+// have ended
+void releaseHeld(void* context);
+
+// archives nodes (relative to root) and encrypts them into out, as stages
+// of a pipeline
+void protectStream(char* password, int out, char* root, char* archiveLZW,
+    int nodeC, char** nodes);
+
+// decrypts the archive in with oldPassword, appends to it as appendArchive()
+// does, and encrypts the result to out with password, as stages of a pipeline
+void appendStream(char* oldPassword, char* password, int in, int out,
+    char* root, char* archiveLZW, int nodeC, char** nodes);
+
+// decrypts in and extracts it into root, as stages of a pipeline
+void unprotectStream(char* password, int in, char* root);
+
 #endif
\ No newline at end of file
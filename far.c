@@ -2,7 +2,6 @@
 #include "far.h"
 #include "encrypt.h"
 #include <sys/types.h>
-#include <sys/wait.h>
 #include <sys/stat.h>
 #include <dirent.h>
 #include <stdlib.h>
@@ -11,216 +10,2882 @@
 #include <unistd.h>
 #include <sys/time.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <ftw.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <pthread.h>
 #include "bitcode.h"
 #include "lzw.h"
 #include "crc.h"
+#include "channel.h"
+#include "stats.h"
+#include "trace.h"
+#include "progress.h"
+#include "loader.h"
+#include "cache.h"
+#include "delta.h"
+
+// arguments and result of a thread which encodes a file
+typedef struct {
+    int inFile;
+    int outFile;
+    char* node;
+    char* nodeLZW;
+    bool didEncode;
+} EncodeArgs;
+
+static void* runEncode(void* arg)
+{
+    EncodeArgs* args = arg;
+    PROGRESS("Encoding %s to %s", args->node,
+        args->nodeLZW ? args->nodeLZW : "memory");
+    args->didEncode = encode(args->inFile, args->outFile);
+    PROGRESS("Encoding %s complete", args->node);
+    if (fdclose(args->inFile)) SYS_ERROR("close");
+    return NULL;
+}
+
+// arguments of a thread which decodes a file
+typedef struct {
+    int inFile;
+    int outFile;
+    off_t size;
+} DecodeArgs;
+
+static void* runDecode(void* arg)
+{
+    DecodeArgs* args = arg;
+    decode(args->inFile, args->outFile, args->size);
+    // closing sends EOF, so check until EOF
+    if (fdclose(args->outFile)) SYS_ERROR("close");
+    return NULL;
+}
+
+// files of at least this many bytes are mapped, smaller ones are read
+#define MAP_THRESHOLD (1 << 20)
+
+// set in the flags of a member with holes. the extents of its data follow
+// its size in the archive, and only the data is stored
+#define FLAG_SPARSE (UINT64_C(1) << 62)
+
+static long long extentsLen(Extent* extents, long long count)
+{
+    long long len = 0;
+    for (long long i = 0; i < count; i++) len += extents[i].len;
+    return len;
+}
+
+// the CRC of the extents of bytes, as if they were one run
+static checktype extentsCRC(unsigned char* bytes, Extent* extents,
+    long long count)
+{
+    TRACE_BEGIN("computeCRC");
+    checktype message = 0;
+    for (long long i = 0; i < count; i++)
+    {
+        appendBytesToMessage(&message, bytes + extents[i].offset,
+            extents[i].len);
+    }
+    padMessage(&message);
+    TRACE_END("computeCRC");
+    PROGRESS("Cyclic Redundancy Check has value " CHECKTYPE_FORMAT, message);
+    return message;
+}
+
+// lists the extents of file if it has holes, and returns whether it does
+// only files of MAP_THRESHOLD bytes or more count, so both sides map them
+static bool findHoles(int file, long long size, Extent** extents,
+    long long* count)
+{
+#ifdef SEEK_HOLE
+    if (size < MAP_THRESHOLD) return false;
+    // most files, and every file on a filesystem without holes, have their
+    // first hole at the end
+    off_t hole = lseek(file, 0, SEEK_HOLE);
+    if (hole < 0 || hole >= size) return false;
+    // a file of nothing but a hole has no extents, but still has a list
+    long long capacity = 16;
+    *extents = malloc(capacity * sizeof(Extent));
+    if (!*extents) DIE("%s", "Out of memory");
+    *count = 0;
+    off_t offset = 0;
+    while (offset < size)
+    {
+        off_t data = lseek(file, offset, SEEK_DATA);
+        if (data < 0 && errno == ENXIO) break; // a hole to the end
+        if (data < 0) SYS_DIE("lseek");
+        hole = lseek(file, data, SEEK_HOLE);
+        if (hole < 0) SYS_DIE("lseek");
+        if (hole > size) hole = size;
+        if (*count == capacity)
+        {
+            capacity *= 2;
+            *extents = realloc(*extents, capacity * sizeof(Extent));
+            if (!*extents) DIE("%s", "Out of memory");
+        }
+        (*extents)[(*count)++] = (Extent){data, hole - data};
+        offset = hole;
+    }
+    return true;
+#else
+    return false;
+#endif
+}
+
+// the bytes of a file being archived
+typedef struct {
+    unsigned char* bytes;
+    long long len;
+    bool mapped;
+    bool loaded;     // read by the loader, and freed after
+    Extent* extents; // where the data is
+    long long extentCount;
+    Extent whole;    // the one extent of a file without holes
+} FileBytes;
+
+// reused for every file read instead of mapped, and for every extracted file
+// which is not mapped (see openOutput()). stage threads come and go with
+// every archive, so each thread's are freed as it exits
+static __thread unsigned char* readBuffer = NULL;
+static __thread long long readBufferSize = 0;
+static __thread unsigned char* writeBuffer = NULL;
+static __thread long long writeBufferSize = 0;
+static pthread_key_t buffersKey;
+static pthread_once_t buffersKeyOnce = PTHREAD_ONCE_INIT;
+
+static void freeBuffers(void* unused)
+{
+    free(readBuffer);
+    readBuffer = NULL;
+    readBufferSize = 0;
+    free(writeBuffer);
+    writeBuffer = NULL;
+    writeBufferSize = 0;
+}
+
+static void makeBuffersKey(void)
+{
+    pthread_key_create(&buffersKey, freeBuffers);
+}
+
+// the thread has a buffer, to be freed when it exits
+static void watchBuffers(void)
+{
+    pthread_once(&buffersKeyOnce, makeBuffersKey);
+    pthread_setspecific(buffersKey, &readBuffer);
+}
+
+// maps or reads the len bytes of file. the file must not shrink meanwhile
+// extents are where its data is, or NULL if it has no holes
+// loaded is the len bytes already read by the loader (see loader.h), or NULL
+static void loadFile(int file, long long len, Extent* extents,
+    long long extentCount, unsigned char* loaded, FileBytes* bytes)
+{
+    bytes->len = len;
+    bytes->whole = (Extent){0, len};
+    bytes->extents = extents ? extents : &bytes->whole;
+    bytes->extentCount = extents ? extentCount : 1;
+    bytes->loaded = !!loaded;
+    if (loaded)
+    {
+        bytes->bytes = loaded;
+        bytes->mapped = false;
+        return;
+    }
+    bytes->mapped = len >= MAP_THRESHOLD;
+    if (bytes->mapped)
+    {
+        bytes->bytes = heldMmap(len, PROT_READ, MAP_PRIVATE, file);
+        if (bytes->bytes == MAP_FAILED) SYS_DIE("mmap");
+        madvise(bytes->bytes, len, MADV_SEQUENTIAL);
+        // read once, front to back, by the CRC and the encoder together
+        // holes need no reading
+        long page = sysconf(_SC_PAGESIZE);
+        for (long long i = 0; i < bytes->extentCount; i++)
+        {
+            long long start = bytes->extents[i].offset / page * page;
+            madvise(bytes->bytes + start, bytes->extents[i].offset +
+                bytes->extents[i].len - start, MADV_WILLNEED);
+        }
+        return;
+    }
+    if (len > readBufferSize)
+    {
+        free(readBuffer);
+        readBuffer = malloc(len);
+        if (!readBuffer) DIE("%s", "Out of memory");
+        readBufferSize = len;
+        watchBuffers();
+    }
+    bytes->bytes = readBuffer;
+    long long done = 0;
+    while (done < len)
+    {
+        ssize_t readLen = pread(file, readBuffer + done, len - done, done);
+        if (readLen < 0 && errno == EINTR) continue;
+        if (readLen < 0) SYS_DIE("pread");
+        if (readLen == 0) DIE("%s", "File shrank while being archived");
+        done += readLen;
+    }
+}
+
+static void unloadFile(FileBytes* bytes)
+{
+    if (bytes->mapped && heldMunmap(bytes->bytes, bytes->len))
+        SYS_ERROR("munmap");
+    if (bytes->loaded) free(bytes->bytes);
+}
+
+// reads the data of a FileBytes, skipping its holes (see openCallbackChannel())
+typedef struct {
+    FileBytes* file;
+    long long index; // extent being read
+    long long done;  // bytes of it read
+} ExtentReader;
+
+static long readExtents(void* state, void* bytes, long len)
+{
+    ExtentReader* reader = state;
+    FileBytes* file = reader->file;
+    while (reader->index < file->extentCount &&
+        reader->done == file->extents[reader->index].len)
+    {
+        reader->index++;
+        reader->done = 0;
+    }
+    if (reader->index == file->extentCount) return 0;
+    Extent* extent = file->extents + reader->index;
+    long long count = extent->len - reader->done;
+    if (count > len) count = len;
+    memcpy(bytes, file->bytes + extent->offset + reader->done, count);
+    reader->done += count;
+    return count;
+}
+
+// where an extracted file goes. files of MAP_THRESHOLD bytes or more, and
+// files with holes, are written in place. they are written through a mapping
+// once their space is allocated, and otherwise with pwrite(2), as a full disk
+// would be a SIGBUS through a mapping. smaller files are collected in a
+// buffer and written at once
+typedef struct {
+    int fd;             // -1 to throw the bytes away
+    unsigned char* bytes;
+    long long size;     // from the member header
+    bool mapped;
+    bool positioned;    // written with pwrite(2), so bytes is NULL
+    bool crc;           // whether a positioned file keeps the CRC in message
+    checktype message;  // of what was written, before padMessage()
+    Extent* extents;    // where the data goes
+    long long extentCount;
+    long long index;    // extent being written
+    long long done;     // bytes of it written
+    long long fill;     // bytes written in all
+    Extent whole;       // the one extent of a file without holes
+} OutputFile;
+
+// extents are where the data goes, or NULL if there are no holes
+static void openOutput(int fd, long long size, Extent* extents,
+    long long extentCount, OutputFile* output)
+{
+    output->fd = fd;
+    output->size = size;
+    output->whole = (Extent){0, size};
+    output->extents = extents ? extents : &output->whole;
+    output->extentCount = extents ? extentCount : 1;
+    output->index = output->done = output->fill = 0;
+    output->bytes = NULL;
+    output->mapped = output->positioned = output->crc = false;
+    output->message = 0;
+    if (fd >= 0 && (size >= MAP_THRESHOLD || extents))
+    {
+        // one allocation instead of growing a write at a time
+        // the holes of a sparse file are left unallocated
+        bool reserved = false;
+#if !MAC
+        if (!extents && !fallocate(fd, 0, 0, size)) reserved = true;
+        else if (!extents && errno != EOPNOTSUPP) SYS_DIE("fallocate");
+#endif
+        if (ftruncate(fd, size)) SYS_DIE("ftruncate");
+        output->positioned = !reserved;
+        if (output->positioned) return;
+        output->mapped = true;
+        output->bytes = heldMmap(size, PROT_READ|PROT_WRITE, MAP_SHARED, fd);
+        if (output->bytes == MAP_FAILED) SYS_DIE("mmap");
+        madvise(output->bytes, size, MADV_SEQUENTIAL);
+        return;
+    }
+    if (fd < 0) return;
+    if (size > writeBufferSize)
+    {
+        free(writeBuffer);
+        // aligned for the write(2) at the end
+        if (posix_memalign((void**)&writeBuffer, 4096, size))
+            DIE("%s", "Out of memory");
+        writeBufferSize = size;
+        watchBuffers();
+    }
+    output->bytes = writeBuffer;
+}
+
+// the write of a channel (see openCallbackChannel())
+static long writeOutput(void* state, const void* bytes, long len)
+{
+    OutputFile* output = state;
+    long written = 0;
+    while (written < len)
+    {
+        if (output->index == output->extentCount)
+        {
+            if (written) break;
+            errno = EFBIG;
+            return -1;
+        }
+        Extent* extent = output->extents + output->index;
+        long long count = extent->len - output->done;
+        if (count > len - written) count = len - written;
+        if (output->bytes)
+        {
+            memcpy(output->bytes + extent->offset + output->done,
+                (const char*)bytes + written, count);
+        }
+        else if (output->positioned)
+        {
+            count = pwrite(output->fd, (const char*)bytes + written, count,
+                extent->offset + output->done);
+            ioCounts.writeSyscalls++;
+            if (count < 0 && errno == EINTR) continue;
+            if (count < 0 && written) break;
+            if (count < 0) return -1;
+            ioCounts.bytesWritten += count;
+            if (output->crc)
+            {
+                appendBytesToMessage(&output->message,
+                    (const unsigned char*)bytes + written, count);
+            }
+        }
+        output->done += count;
+        written += count;
+        if (output->done == extent->len)
+        {
+            output->index++;
+            output->done = 0;
+        }
+    }
+    output->fill += written;
+    return written;
+}
+
+// whether what was written to output has checksum. a file thrown away
+// passes. a positioned file must have had crc set before it was written
+static bool checkOutput(OutputFile* output, checktype checksum)
+{
+    if (output->positioned)
+    {
+        checktype message = output->message;
+        padMessage(&message);
+        return message == checksum;
+    }
+    return !output->bytes || extentsCRC(output->bytes, output->extents,
+        output->extentCount) == checksum;
+}
+
+// writes out what was not written, and trims a file which came up short
+static void closeOutput(OutputFile* output)
+{
+    if (output->mapped || output->positioned)
+    {
+        if (output->mapped && heldMunmap(output->bytes, output->size))
+            SYS_ERROR("munmap");
+        if (output->extents == &output->whole && output->fill < output->size
+            && ftruncate(output->fd, output->fill)) SYS_ERROR("ftruncate");
+    }
+    else if (output->fd >= 0)
+    {
+        for (long long written = 0; written < output->fill;)
+        {
+            long writeLen = fdwrite(output->fd, output->bytes + written,
+                output->fill - written);
+            if (writeLen < 0 && errno == EINTR) continue;
+            if (writeLen < 0) SYS_DIE("write");
+            written += writeLen;
+        }
+    }
+    if (output->fd >= 0 && heldClose(output->fd)) SYS_ERROR("close");
+}
+
+// == MEMBER MODULE ========================================================
+
+// archives start with ARCHIVE_MAGIC and a byte of ARCHIVE_VERSION. archives
+// from before them start with their first member, laid out as the host that
+// wrote it lays out an int, mode_t, struct timeval, u_long and off_t
+#define ARCHIVE_MAGIC "FAR"
+#define ARCHIVE_MAGIC_SIZE (3)
+#define ARCHIVE_VERSION (1)
+
+// a member header is the varint length of the rest of it, then varints of
+//   the length of the start of the name shared with the member before
+//   the length of the rest of the name, followed by those bytes
+//   mode, atime and mtime seconds (zigzag), atime and mtime nsec, flags
+// and for a regular file
+//   size, followed by the checksum in 8 little-endian bytes
+//   storedLen
+//   extentCount, then of each extent how far it starts after the end of
+//   the one before, and its len
+//   with FLAG_DELTA, deltaLen, followed by the checksum of its base in 8
+//   little-endian bytes
+// a varint is as putVarint() puts it
+// a header of length 0 starts a segment appended to the archive (see
+// appendArchive()), whose first name shares nothing. a member with
+// FLAG_DELETED is a tombstone, and one with FLAG_STREAM says how long it is
+// in its data (see archiveStream()). both have nothing after their flags
+
+// set in the flags of a tombstone, which says its node was deleted since the
+// segments before
+#define FLAG_DELETED (UINT64_C(1) << 61)
+
+// set in the flags of a regular file stored as a delta (see delta.h) of
+// deltaLen bytes from its latest version in a reference archive, its base
+#define FLAG_DELTA (UINT64_C(1) << 60)
+
+// set in the flags of a regular file whose size was not known when its
+// header was written, as it was read from a pipe
+#define FLAG_STREAM (UINT64_C(1) << 59)
+
+// what a member header holds
+typedef struct {
+    char* name;         // of nameLen bytes, not terminated
+    int nameLen;
+    mode_t mode;
+    struct timespec times[2];
+    uint64_t flags;
+    long long size;
+    checktype checksum;
+    Extent* extents;    // NULL unless flags has FLAG_SPARSE
+    long long extentCount;
+    long long storedLen; // of the data after the header, or -1 if unknown
+    long long deltaLen;  // with FLAG_DELTA
+    checktype baseChecksum;
+} Member;
+
+// so small negative numbers are small varints too
+static unsigned long long zigzag(long long value)
+{
+    return value < 0 ? ~((unsigned long long)value << 1) :
+        (unsigned long long)value << 1;
+}
+
+static long long unzigzag(unsigned long long value)
+{
+    return value & 1 ? -(long long)(value >> 1) - 1 : (long long)(value >> 1);
+}
+
+// the atime and mtime of data, to the nanosecond where the host keeps them
+static void statTimes(struct stat* data, struct timespec times[2])
+{
+#if MAC
+    times[0] = data->st_atimespec;
+    times[1] = data->st_mtimespec;
+#else
+    times[0] = data->st_atim;
+    times[1] = data->st_mtim;
+#endif
+}
+
+static bool sameTime(struct timespec one, struct timespec two)
+{
+    return one.tv_sec == two.tv_sec && one.tv_nsec == two.tv_nsec;
+}
+
+// reused for every header written or read
+static __thread unsigned char* headerBuffer = NULL;
+static __thread long long headerBufferSize = 0;
+// the name of the member last written, which the next one starts from
+static __thread char* lastName = NULL;
+static __thread int lastNameLen = 0;
+static __thread int lastNameSize = 0;
+
+static unsigned char* headerSpace(long long len)
+{
+    if (len > headerBufferSize)
+    {
+        free(headerBuffer);
+        headerBuffer = malloc(len);
+        if (!headerBuffer) DIE("%s", "Out of memory");
+        headerBufferSize = len;
+    }
+    return headerBuffer;
+}
+
+// keeps the first shared bytes of *name, of *size, and puts suffix after
+static void extendName(char** name, int* size, int shared, const char* suffix,
+    int suffixLen)
+{
+    if (shared + suffixLen > *size)
+    {
+        *size = shared + suffixLen > *size * 2 ? shared + suffixLen :
+            *size * 2;
+        *name = realloc(*name, *size);
+        if (!*name) DIE("%s", "Out of memory");
+    }
+    memcpy(*name + shared, suffix, suffixLen);
+}
+
+// at the end of an archive, so threads which come and go keep no buffers
+static void freeHeaderBuffers(void)
+{
+    free(headerBuffer);
+    headerBuffer = NULL;
+    headerBufferSize = 0;
+    free(lastName);
+    lastName = NULL;
+    lastNameLen = lastNameSize = 0;
+}
+
+static void writeArchiveStart(int archive)
+{
+    unsigned char start[ARCHIVE_MAGIC_SIZE + 1] = ARCHIVE_MAGIC;
+    start[ARCHIVE_MAGIC_SIZE] = ARCHIVE_VERSION;
+    if (fdwrite(archive, start, sizeof(start)) < sizeof(start))
+        SYS_DIE("write");
+    lastNameLen = 0;
+}
+
+// the whole header, in one write
+static void writeMember(int archive, Member* member)
+{
+    int shared = 0;
+    while (shared < lastNameLen && shared < member->nameLen &&
+        lastName[shared] == member->name[shared]) shared++;
+    int suffixLen = member->nameLen - shared;
+
+    // the rest goes after room for its length
+    unsigned char* header = headerSpace(VARINT_MAX * 15 + 16 + suffixLen +
+        member->extentCount * VARINT_MAX * 2);
+    unsigned char* rest = header + VARINT_MAX;
+    unsigned char* at = rest;
+    at += putVarint(at, shared);
+    at += putVarint(at, suffixLen);
+    memcpy(at, member->name + shared, suffixLen);
+    at += suffixLen;
+    at += putVarint(at, member->mode);
+    at += putVarint(at, zigzag(member->times[0].tv_sec));
+    at += putVarint(at, zigzag(member->times[1].tv_sec));
+    at += putVarint(at, member->times[0].tv_nsec);
+    at += putVarint(at, member->times[1].tv_nsec);
+    at += putVarint(at, member->flags);
+    if (member->name[member->nameLen-1] != '/' &&
+        !(member->flags & (FLAG_DELETED|FLAG_STREAM)))
+    {
+        at += putVarint(at, member->size);
+        putLE(at, member->checksum, 8);
+        at += 8;
+        at += putVarint(at, member->storedLen);
+        at += putVarint(at, member->extentCount);
+        long long end = 0;
+        for (long long i = 0; i < member->extentCount; i++)
+        {
+            at += putVarint(at, member->extents[i].offset - end);
+            at += putVarint(at, member->extents[i].len);
+            end = member->extents[i].offset + member->extents[i].len;
+        }
+        if (member->flags & FLAG_DELTA)
+        {
+            at += putVarint(at, member->deltaLen);
+            putLE(at, member->baseChecksum, 8);
+            at += 8;
+        }
+    }
+    unsigned char len[VARINT_MAX];
+    int lenLen = putVarint(len, at - rest);
+    header = rest - lenLen;
+    memcpy(header, len, lenLen);
+    if (fdwrite(archive, header, at - header) < at - header) SYS_DIE("write");
+
+    extendName(&lastName, &lastNameSize, shared, member->name + shared,
+        suffixLen);
+    lastNameLen = member->nameLen;
+}
+
+// the names after it share nothing with those before
+static void writeSegmentStart(int archive)
+{
+    fdputc(0, archive);
+    lastNameLen = 0;
+}
+
+// says name, as archived, was deleted
+static void writeTombstone(int archive, char* name)
+{
+    Member member = {name, strlen(name), 0, {{0, 0}, {0, 0}}, FLAG_DELETED};
+    writeMember(archive, &member);
+}
+
+// reads members of an archive, after its start
+typedef struct {
+    int archive;
+    int version;       // 0 for an archive from before ARCHIVE_MAGIC
+    bool started;      // the first nameLen of such an archive was read
+    int startNameLen;
+    char* name;        // of the last member, malloced
+    int nameLen;
+    int nameSize;
+} MemberReader;
+
+// the rest of a member of an archive from before ARCHIVE_MAGIC, after its
+// nameLen
+static void readLegacyMember(MemberReader* reader, Member* member)
+{
+    int archive = reader->archive;
+    member->name = (char*)headerSpace(member->nameLen);
+    if (!rdhang(archive, member->name, member->nameLen))
+        SYS_DIE("Unable to read name");
+    if (!rdhang(archive, &member->mode, sizeof(member->mode)))
+        SYS_DIE("Unable to read mode");
+    struct timeval times[2];
+    if (!rdhang(archive, times, sizeof(times)))
+        SYS_DIE("Unable to read timevals");
+    for (int i = 0; i < 2; i++)
+        TIMEVAL_TO_TIMESPEC(times + i, member->times + i);
+    // as wide as the host that wrote it made it
+    u_long flags;
+    if (!rdhang(archive, &flags, sizeof(flags)))
+        SYS_DIE("Unable to read flags");
+    member->flags = flags;
+    member->size = 0;
+    member->checksum = 0;
+    member->extentCount = 0;
+    if (member->name[member->nameLen-1] == '/') return;
+
+    off_t size;
+    if (!rdhang(archive, &size, sizeof(size)))
+        DIE("%s", "Unable to read size");
+    member->size = size;
+    if (!rdhang(archive, &member->checksum, sizeof(member->checksum)))
+        DIE("%s", "Unable to read checksum");
+}
+
+// a member of an archive of ARCHIVE_VERSION, or false at the end
+static bool readCompactMember(MemberReader* reader, Member* member)
+{
+    int archive = reader->archive;
+    // the length of the rest comes first, a byte at a time
+    unsigned long long len = 0;
+    while (!len)
+    {
+        unsigned char byte = 0x80;
+        for (int shift = 0; byte & 0x80; shift += 7)
+        {
+            if (!rdhang(archive, &byte, 1))
+            {
+                if (!shift) return false;
+                DIE("%s", "Unable to read header");
+            }
+            if (shift > 28) DIE("%s", "corrupt member header");
+            len |= (unsigned long long)(byte & 0x7f) << shift;
+        }
+        if (len > INT_MAX) DIE("%s", "corrupt member header");
+        // the start of a segment
+        if (!len) reader->nameLen = 0;
+    }
+    unsigned char* header = headerSpace(len);
+    if (!rdhang(archive, header, len)) DIE("%s", "Unable to read header");
+
+    const unsigned char* at = header;
+    const unsigned char* end = header + len;
+    unsigned long long shared, suffixLen;
+    if (!getVarint(&at, end, &shared) || !getVarint(&at, end, &suffixLen) ||
+        shared > reader->nameLen || suffixLen > end - at ||
+        !(shared + suffixLen)) DIE("%s", "corrupt member header");
+    extendName(&reader->name, &reader->nameSize, shared, (char*)at,
+        suffixLen);
+    at += suffixLen;
+    reader->nameLen = shared + suffixLen;
+    member->name = reader->name;
+    member->nameLen = reader->nameLen;
+
+    unsigned long long mode, seconds[2], nsec[2], flags;
+    bool read = getVarint(&at, end, &mode) &&
+        getVarint(&at, end, seconds) && getVarint(&at, end, seconds + 1) &&
+        getVarint(&at, end, nsec) && getVarint(&at, end, nsec + 1) &&
+        nsec[0] < 1000000000 && nsec[1] < 1000000000 &&
+        getVarint(&at, end, &flags);
+    member->mode = mode;
+    for (int i = 0; i < 2; i++)
+    {
+        member->times[i].tv_sec = unzigzag(seconds[i]);
+        member->times[i].tv_nsec = nsec[i];
+    }
+    member->flags = flags;
+    member->size = 0;
+    member->checksum = 0;
+    member->extentCount = 0;
+    if (read && (flags & FLAG_STREAM))
+    {
+        read = !(flags & (FLAG_SPARSE|FLAG_DELTA)) &&
+            member->name[member->nameLen-1] != '/';
+    }
+    else if (read && member->name[member->nameLen-1] != '/' &&
+        !(flags & FLAG_DELETED))
+    {
+        unsigned long long size, storedLen, extentCount;
+        read = getVarint(&at, end, &size) && size <= LLONG_MAX &&
+            end - at >= 8;
+        if (read)
+        {
+            member->size = size;
+            member->checksum = getLE(at, 8);
+            at += 8;
+        }
+        read = read && getVarint(&at, end, &storedLen) &&
+            storedLen <= LLONG_MAX;
+        if (read) member->storedLen = storedLen;
+        // every extent takes two bytes at least
+        read = read && getVarint(&at, end, &extentCount) &&
+            extentCount <= size && extentCount <= (end - at) / 2 &&
+            (!extentCount || (flags & FLAG_SPARSE));
+        if (read && (flags & FLAG_SPARSE))
+        {
+            member->extentCount = extentCount;
+            member->extents = malloc(extentCount * sizeof(Extent) + 1);
+            if (!member->extents) DIE("%s", "Out of memory");
+        }
+        unsigned long long offset = 0;
+        for (long long i = 0; read && i < member->extentCount; i++)
+        {
+            unsigned long long gap, extentLen;
+            read = getVarint(&at, end, &gap) &&
+                getVarint(&at, end, &extentLen);
+            offset += gap;
+            member->extents[i] = (Extent){offset, extentLen};
+            offset += extentLen;
+        }
+        if (read && (flags & FLAG_DELTA))
+        {
+            unsigned long long deltaLen;
+            read = !(flags & FLAG_SPARSE) &&
+                getVarint(&at, end, &deltaLen) && deltaLen <= INT_MAX &&
+                end - at >= 8;
+            if (read)
+            {
+                member->deltaLen = deltaLen;
+                member->baseChecksum = getLE(at, 8);
+                at += 8;
+            }
+        }
+    }
+    if (!read || at != end) DIE("%s", "corrupt member header");
+    return true;
+}
+
+// reads the header of the next member, or returns false at the end
+// the name is good until the next call. the extents are malloced
+static bool readMember(MemberReader* reader, Member* member)
+{
+    member->extents = NULL;
+    member->storedLen = -1;
+    member->deltaLen = 0;
+    if (reader->version)
+    {
+        if (!readCompactMember(reader, member)) return false;
+    }
+    else
+    {
+        if (reader->started) member->nameLen = reader->startNameLen;
+        else if (!rdhang(reader->archive, &member->nameLen,
+            sizeof(member->nameLen))) return false;
+        reader->started = false;
+        if (member->nameLen <= 0) DIE("%s", "Unable to read name");
+        readLegacyMember(reader, member);
+    }
+
+    for (long long i = 0; i < member->extentCount; i++)
+    {
+        if (member->extents[i].offset < 0 || member->extents[i].len < 0 ||
+            member->extents[i].offset > member->size - member->extents[i].len)
+            DIE("%s", "corrupt extents");
+    }
+    return true;
+}
+
+// reads the start of an archive, which says how its members are laid out
+static void startMembers(int archive, MemberReader* reader)
+{
+    *reader = (MemberReader){archive, 0, false, 0, NULL, 0, 0};
+    unsigned char start[ARCHIVE_MAGIC_SIZE + 1];
+    // an archive from before ARCHIVE_MAGIC may be empty
+    if (!rdhang(archive, start, sizeof(start))) return;
+    if (memcmp(start, ARCHIVE_MAGIC, ARCHIVE_MAGIC_SIZE))
+    {
+        // no name is long enough to look like ARCHIVE_MAGIC
+        memcpy(&reader->startNameLen, start, sizeof(reader->startNameLen));
+        reader->started = true;
+        return;
+    }
+    reader->version = start[ARCHIVE_MAGIC_SIZE];
+    if (reader->version != ARCHIVE_VERSION)
+        DIE("Unknown archive version %d", reader->version);
+}
+
+static void endMembers(MemberReader* reader)
+{
+    free(reader->name);
+    freeHeaderBuffers();
+}
+
+// == STREAM MODULE ========================================================
+
+// the data of a FLAG_STREAM member is chunks of up to STREAM_CHUNK bytes
+// each, each the varint len of what it holds and the varint len of what is
+// stored of it, followed by those bytes as encode() wrote them, or as a 0
+// byte and the bytes as they are if that did not make them smaller. then a
+// varint 0, the varint size of the whole, and its checksum in 8
+// little-endian bytes
+#define STREAM_CHUNK (1 << 20)
+
+// a write(2) may stop short of a large mapping
+static void writeBytes(int fd, const unsigned char* bytes, long long len)
+{
+    for (long long written = 0; written < len;)
+    {
+        long writeLen = fdwrite(fd, bytes + written, len - written);
+        if (writeLen <= 0) SYS_DIE("write");
+        written += writeLen;
+    }
+}
+
+// a varint of the data of a stream member, counted in *storedLen
+static unsigned long long readStreamVarint(int stored, long long* storedLen)
+{
+    unsigned long long value = 0;
+    unsigned char byte = 0x80;
+    for (int shift = 0; byte & 0x80; shift += 7)
+    {
+        if (!rdhang(stored, &byte, 1)) DIE("%s", "Unable to read member");
+        if (shift > 63) DIE("%s", "corrupt stream");
+        value |= (unsigned long long)(byte & 0x7f) << shift;
+        ++*storedLen;
+    }
+    return value;
+}
+
+static void putStreamVarint(int archive, unsigned long long value)
+{
+    unsigned char bytes[VARINT_MAX];
+    writeBytes(archive, bytes, putVarint(bytes, value));
+}
+
+// reads the size and checksum of a stream member, after its last chunk
+static void readStreamEnd(int stored, Member* member, long long storedLen)
+{
+    unsigned long long size = readStreamVarint(stored, &storedLen);
+    unsigned char checksum[8];
+    if (size > LLONG_MAX || !rdhang(stored, checksum, 8))
+        DIE("%s", "corrupt stream");
+    member->size = size;
+    member->checksum = getLE(checksum, 8);
+    member->storedLen = storedLen + 8;
+}
+
+/**
+ * Reads archive in chunks of STREAM_CHUNK bytes until EOF into a member of
+ * archive with FLAG_STREAM, as a regular file named name. Each chunk is
+ * encoded on its own, and is stored as it is if that does not make it
+ * smaller, so what can't be compressed costs little. Nothing is read twice
+ */
+static void archiveStream(int archive, int in, char* name)
+{
+    PROGRESS("Archiving standard input as %s", name);
+    progressMember(name);
+    struct timespec now = {time(NULL), 0};
+    Member member = {name, strlen(name), S_IFREG | ARCHIVE_PERMISSION,
+        {now, now}, FLAG_STREAM};
+    writeMember(archive, &member);
+
+    FileStats stats = {name, 0, 0, 0, 0, 0, statsPrunes()};
+    checktype checksum = 0;
+    unsigned char* chunk = malloc(STREAM_CHUNK);
+    if (!chunk) DIE("%s", "Out of memory");
+    long len;
+    while ((len = rdhangPartial(in, chunk, STREAM_CHUNK)) > 0)
+    {
+        double crcStart = monotonicSeconds();
+        appendBytesToMessage(&checksum, chunk, len);
+        stats.crcSeconds += monotonicSeconds() - crcStart;
+
+        double encodeStart = monotonicSeconds();
+        char* encodedBytes = NULL;
+        long encodedLen = 0;
+        int encodeInput = openMemoryReader(chunk, len);
+        int encoded = openMemoryWriter(&encodedBytes, &encodedLen);
+        bool didEncode = encode(encodeInput, encoded);
+        if (fdclose(encodeInput)) SYS_ERROR("close");
+        if (fdclose(encoded)) SYS_ERROR("close");
+        stats.codecSeconds += monotonicSeconds() - encodeStart;
+
+        putStreamVarint(archive, len);
+        if (didEncode)
+        {
+            putStreamVarint(archive, encodedLen);
+            writeBytes(archive, (unsigned char*)encodedBytes, encodedLen);
+            stats.storedSize += encodedLen;
+            stats.encoded = true;
+        }
+        else
+        {
+            putStreamVarint(archive, 1 + len);
+            fdputc(0, archive);
+            writeBytes(archive, chunk, len);
+            stats.storedSize += 1 + len;
+        }
+        free(encodedBytes);
+        stats.size += len;
+        if (reportProgress) progressBytes(len);
+    }
+    free(chunk);
+    padMessage(&checksum);
+    putStreamVarint(archive, 0);
+    putStreamVarint(archive, stats.size);
+    unsigned char end[8];
+    putLE(end, checksum, 8);
+    writeBytes(archive, end, sizeof(end));
+    PROGRESS("%s took %lld bytes from standard input", name, stats.size);
+    stats.prunes = statsPrunes() - stats.prunes;
+    statsFile(&stats);
+}
+
+// decodes the chunks of the stream member stored next in stored to out, or
+// to nowhere if out < 0, and reads its size, checksum and storedLen from
+// their end. returns whether what was decoded matches them
+static bool decodeStream(int stored, Member* member, int out)
+{
+    checktype message = 0;
+    long long size = 0;
+    long long storedLen = 0;
+    unsigned long long len;
+    while ((len = readStreamVarint(stored, &storedLen)))
+    {
+        unsigned long long chunkLen = readStreamVarint(stored, &storedLen);
+        if (len > STREAM_CHUNK || chunkLen > len + 1 || !chunkLen)
+            DIE("%s", "corrupt stream");
+        unsigned char* chunk = malloc(chunkLen);
+        if (!chunk) DIE("%s", "Out of memory");
+        if (!rdhang(stored, chunk, chunkLen))
+            DIE("%s", "Unable to read member");
+        storedLen += chunkLen;
+
+        char* bytes = NULL;
+        long bytesLen = 0;
+        int chunkInput = openMemoryReader(chunk, chunkLen);
+        int decoded = openMemoryWriter(&bytes, &bytesLen);
+        decode(chunkInput, decoded, len);
+        if (fdclose(chunkInput)) SYS_ERROR("close");
+        if (fdclose(decoded)) SYS_ERROR("close");
+        appendBytesToMessage(&message, (unsigned char*)bytes, bytesLen);
+        if (out >= 0) writeBytes(out, (unsigned char*)bytes, bytesLen);
+        size += bytesLen;
+        free(bytes);
+        free(chunk);
+    }
+    padMessage(&message);
+    readStreamEnd(stored, member, storedLen);
+    return size == member->size && message == member->checksum;
+}
+
+// gets past the data of the stream member next in archive, copying it to
+// copy, or if copy < 0 seeking past it, or reading it where archive can't
+// seek. reads its size, checksum and storedLen from the end
+static void passStream(int archive, Member* member, int copy)
+{
+    long long storedLen = 0;
+    unsigned long long len;
+    while ((len = readStreamVarint(archive, &storedLen)))
+    {
+        unsigned long long chunkLen = readStreamVarint(archive, &storedLen);
+        if (len > STREAM_CHUNK || chunkLen > len + 1 || !chunkLen)
+            DIE("%s", "corrupt stream");
+        storedLen += chunkLen;
+        if (copy >= 0)
+        {
+            putStreamVarint(copy, len);
+            putStreamVarint(copy, chunkLen);
+            if (fdcopy(archive, copy, chunkLen) < chunkLen)
+                DIE("%s", "Unable to read member");
+        }
+        else if (fdseek(archive, chunkLen, SEEK_CUR) < 0)
+        {
+            unsigned char skipped[1 << 12];
+            for (long long left = chunkLen; left > 0; left -= sizeof(skipped))
+            {
+                if (!rdhang(archive, skipped, left < sizeof(skipped) ?
+                    left : sizeof(skipped)))
+                    DIE("%s", "Unable to read member");
+            }
+        }
+    }
+    readStreamEnd(archive, member, storedLen);
+    if (copy >= 0)
+    {
+        putStreamVarint(copy, 0);
+        putStreamVarint(copy, member->size);
+        unsigned char end[8];
+        putLE(end, member->checksum, 8);
+        writeBytes(copy, end, sizeof(end));
+    }
+}
+
+// == WALK MODULE ==========================================================
+
+// a node the walk comes to, in the order nodes are archived
+typedef struct {
+    char* node;        // malloced, with room to append a /
+    int rootLen;       // of the root/ prefix left out of its archived name
+    struct stat data;  // from lstat()
+    const char* error; // the call which failed on node, or NULL
+    int errorNumber;
+    bool leaving;      // the walk is done with the directory node
+    // when appending (see appendArchive()):
+    bool unchanged;    // since the node was last archived
+    bool replacing;    // a node of another type by its name, deleted first
+} Step;
+
+// a directory being walked, on top of the one it is in
+typedef struct walkDirectory {
+    DIR* directory;
+    char* node;
+    int nodeLen;
+    int rootLen;
+    struct walkDirectory* up;
+} WalkDirectory;
+
+// walks nodes as archive() takes them (see far.h), without recursion
+typedef struct {
+    char* root;
+    int nodeC;
+    char** nodes;
+    int next;                   // of nodes
+    WalkDirectory* directories; // being walked, innermost first
+    int list;                   // of nodes after them (see listFd), or -1
+    char* listBytes;            // read from list, from listStart on
+    int listStart;
+    int listEnd;
+    int listSize;
+} Walk;
+
+// list is read as the walk comes to it, so it can be written as it goes
+static void startWalk(Walk* walk, char* root, int nodeC, char** nodes,
+    int list)
+{
+    *walk = (Walk){root, nodeC, nodes, 0, NULL, list};
+}
+
+// the next node of the list, good until the next call, or NULL at its end
+static char* nextListed(Walk* walk)
+{
+    while (walk->list >= 0)
+    {
+        char* start = walk->listBytes + walk->listStart;
+        int len = walk->listEnd - walk->listStart;
+        char* end = len ? memchr(start, '\0', len) : NULL;
+        if (end)
+        {
+            walk->listStart += end - start + 1;
+            // empty names are passed over
+            if (end > start) return start;
+            continue;
+        }
+        // the start of a name is kept, and more read after it
+        if (len) memmove(walk->listBytes, start, len);
+        walk->listStart = 0;
+        walk->listEnd = len;
+        if (len + 1 >= walk->listSize)
+        {
+            walk->listSize = walk->listSize ? walk->listSize * 2 : 1 << 16;
+            walk->listBytes = realloc(walk->listBytes, walk->listSize);
+            if (!walk->listBytes) DIE("%s", "Out of memory");
+        }
+        long readLen;
+        do readLen = fdread(walk->list, walk->listBytes + len,
+            walk->listSize - len - 1);
+        while (readLen < 0 && errno == EINTR);
+        if (readLen < 0) SYS_DIE("read list");
+        if (!readLen)
+        {
+            // the last name need not end in a NUL
+            walk->list = -1;
+            walk->listBytes[len] = '\0';
+            if (len) return walk->listBytes;
+        }
+        walk->listEnd += readLen;
+    }
+    free(walk->listBytes);
+    walk->listBytes = NULL;
+    return NULL;
+}
+
+// gives node (malloced) to step, and goes into it if it is a directory,
+// unless not to enter it
+static void visitNode(Walk* walk, char* node, int rootLen, bool enter,
+    Step* step)
+{
+    int nodeLen = strlen(node);
+    while (nodeLen > rootLen && node[nodeLen-1] == '/') node[--nodeLen] = '\0';
+    *step = (Step){node, rootLen};
+    if (lstat(node, &step->data))
+    {
+        step->error = "lstat";
+        step->errorNumber = errno;
+        return;
+    }
+    if (!S_ISDIR(step->data.st_mode) || !enter) return;
+    // an unopenable directory is still archived, and reported after
+    DIR* directory = heldOpendir(node);
+    if (!directory)
+    {
+        step->error = "opendir";
+        step->errorNumber = errno;
+        return;
+    }
+    WalkDirectory* entered = malloc(sizeof(WalkDirectory));
+    if (!entered || !(node = strdup(node))) DIE("%s", "Out of memory");
+    *entered = (WalkDirectory){directory, node, nodeLen, rootLen,
+        walk->directories};
+    walk->directories = entered;
+}
+
+// the next node, or the end of a directory. returns false when done
+static bool walkNext(Walk* walk, Step* step)
+{
+    while (walk->directories)
+    {
+        WalkDirectory* current = walk->directories;
+        // the time spent in the directory itself is the traversal
+        TRACE_BEGIN("directory");
+        struct dirent* subnode = readdir(current->directory);
+        TRACE_END("directory");
+        if (!subnode)
+        {
+            *step = (Step){current->node, current->rootLen};
+            step->leaving = true;
+            if (heldClosedir(current->directory))
+            {
+                step->error = "closedir";
+                step->errorNumber = errno;
+            }
+            walk->directories = current->up;
+            free(current);
+            return true;
+        }
+        if (!strcmp(subnode->d_name, ".") || !strcmp(subnode->d_name, ".."))
+            continue;
+        int nameLen = strlen(subnode->d_name);
+        if (nameLen >= 4 && strcmp(subnode->d_name+nameLen-4, ".lzw")==0)
+        {
+            // may be the temporary file of an archive being made
+            PROGRESS("Passing over %s/%s", current->node, subnode->d_name);
+            continue;
+        }
+        // with room to append a /
+        char* subNodePath = malloc(current->nodeLen + nameLen + 3);
+        if (!subNodePath) DIE("%s", "Out of memory");
+        memcpy(subNodePath, current->node, current->nodeLen);
+        subNodePath[current->nodeLen] = '/';
+        memcpy(subNodePath + current->nodeLen + 1, subnode->d_name,
+            nameLen + 1);
+        visitNode(walk, subNodePath, current->rootLen, true, step);
+        return true;
+    }
+    // the nodes listed are only what they are named, as the list names what
+    // is in a directory it wants
+    bool listed = walk->next == walk->nodeC;
+    char* given = listed ? nextListed(walk) : walk->nodes[walk->next++];
+    if (!given) return false;
+    // absolute nodes are archived as they are
+    int rootLen = walk->root && given[0] != '/' ? strlen(walk->root) + 1 : 0;
+    char* node = calloc(rootLen + strlen(given) + 2, 1);
+    if (!node) DIE("%s", "Out of memory");
+    if (rootLen) sprintf(node, "%s/", walk->root);
+    strcat(node, given);
+    visitNode(walk, node, rootLen, !listed, step);
+    return true;
+}
+
+static void stepError(Step* step)
+{
+    errno = step->errorNumber;
+    SYS_ERROR(step->error);
+}
+
+// == APPEND MODULE ========================================================
+
+// the latest member by a name in an archive being appended to
+typedef struct {
+    char* name;        // as archived, malloced, or NULL for an empty slot
+    int nameLen;
+    mode_t mode;
+    long long size;
+    struct timespec mtime;
+    bool deleted;      // its latest member is a tombstone
+    bool seen;         // the walk came to it
+    // of a regular file in a reference archive
+    uint64_t flags;
+    checktype checksum;
+    Extent* extents;   // NULL unless flags has FLAG_SPARSE
+    long long extentCount;
+    long long stored;  // where its data starts in the archive
+    long long storedLen;
+} Latest;
+
+// the latest members of an archive, by name
+typedef struct {
+    Latest* slots;
+    long long slotCount; // a power of 2, or 0
+    long long count;
+    int nodeC;           // being appended
+    char** nodes;
+} MemberIndex;
+
+static unsigned long long hashName(const char* name, int len)
+{
+    // FNV-1a
+    unsigned long long hash = 0xcbf29ce484222325ULL;
+    for (int i = 0; i < len; i++)
+        hash = (hash ^ (unsigned char)name[i]) * 0x100000001b3ULL;
+    return hash;
+}
+
+// the slot of name, which is empty if it has none
+static Latest* findLatest(MemberIndex* index, const char* name, int len)
+{
+    // an index of no members has no slots
+    static Latest none;
+    if (!index->slotCount) return &none;
+    long long mask = index->slotCount - 1;
+    for (long long i = hashName(name, len) & mask;; i = (i + 1) & mask)
+    {
+        Latest* latest = index->slots + i;
+        if (!latest->name || (latest->nameLen == len &&
+            !memcmp(latest->name, name, len))) return latest;
+    }
+}
+
+static void addLatest(MemberIndex* index, Member* member)
+{
+    // at most half full
+    if ((index->count + 1) * 2 > index->slotCount)
+    {
+        MemberIndex grown = *index;
+        grown.slotCount = index->slotCount ? index->slotCount * 2 : 1024;
+        grown.slots = calloc(grown.slotCount, sizeof(Latest));
+        if (!grown.slots) DIE("%s", "Out of memory");
+        for (long long i = 0; i < index->slotCount; i++)
+        {
+            Latest* latest = index->slots + i;
+            if (latest->name)
+                *findLatest(&grown, latest->name, latest->nameLen) = *latest;
+        }
+        free(index->slots);
+        *index = grown;
+    }
+    Latest* latest = findLatest(index, member->name, member->nameLen);
+    if (!latest->name)
+    {
+        latest->name = malloc(member->nameLen);
+        if (!latest->name) DIE("%s", "Out of memory");
+        memcpy(latest->name, member->name, member->nameLen);
+        latest->nameLen = member->nameLen;
+        index->count++;
+    }
+    latest->mode = member->mode;
+    latest->size = member->size;
+    latest->mtime = member->times[1];
+    latest->deleted = !!(member->flags & FLAG_DELETED);
+    latest->flags = member->flags;
+    latest->checksum = member->checksum;
+}
+
+// whether name, or the directory of that name, is path or is in it
+static bool nameUnder(char* name, int nameLen, const char* path, int pathLen)
+{
+    return nameLen >= pathLen && !memcmp(name, path, pathLen) &&
+        (nameLen == pathLen || name[pathLen] == '/');
+}
+
+// what is under path can't be told, so none of it is deleted
+static void seeUnder(MemberIndex* index, const char* path)
+{
+    int pathLen = strlen(path);
+    for (long long i = 0; i < index->slotCount; i++)
+    {
+        Latest* latest = index->slots + i;
+        if (latest->name &&
+            nameUnder(latest->name, latest->nameLen, path, pathLen))
+            latest->seen = true;
+    }
+}
+
+// whether the file at path has the bytes of latest. path is read at the
+// extents latest had, and the holes between them must be zeros
+static bool sameContents(char* path, Latest* latest)
+{
+    int file = heldOpen(path, O_RDONLY, 0);
+    if (file < 0)
+    {
+        SYS_ERROR("open");
+        return false;
+    }
+    FileBytes bytes;
+    loadFile(file, latest->size, latest->extents, latest->extentCount, NULL,
+        &bytes);
+    bool same = extentsCRC(bytes.bytes, bytes.extents, bytes.extentCount) ==
+        latest->checksum;
+    long long end = 0;
+    for (long long i = 0; same && i <= bytes.extentCount; i++)
+    {
+        long long next = i < bytes.extentCount ? bytes.extents[i].offset :
+            bytes.len;
+        for (long long j = end; same && j < next; j++) same = !bytes.bytes[j];
+        if (i < bytes.extentCount) end = next + bytes.extents[i].len;
+    }
+    unloadFile(&bytes);
+    if (heldClose(file)) SYS_ERROR("close");
+    return same;
+}
+
+// sets step->unchanged and step->replacing, noting that the walk came to it.
+// a regular file of the same mode, mtime and size is read to tell, as it may
+// have been rewritten within the same tick of the clock
+static void checkStep(MemberIndex* index, Step* step)
+{
+    if (step->leaving) return;
+    char* name = step->node + step->rootLen;
+    if (step->error)
+    {
+        // a node which is gone is deleted with what was in it
+        if (!strcmp(step->error, "lstat") && step->errorNumber == ENOENT)
+            return;
+        seeUnder(index, name);
+        if (!strcmp(step->error, "lstat")) return;
+    }
+    struct stat* data = &step->data;
+    bool directory = S_ISDIR(data->st_mode);
+    int len = strlen(name);
+    char key[len + 2];
+    memcpy(key, name, len);
+    key[len] = '/';
+    Latest* latest = findLatest(index, key, len + directory);
+    if (latest->name)
+    {
+        latest->seen = true;
+        struct timespec times[2];
+        statTimes(data, times);
+        step->unchanged = !latest->deleted &&
+            latest->mode == data->st_mode &&
+            sameTime(latest->mtime, times[1]) && (directory ||
+            (latest->size == data->st_size &&
+            sameContents(step->node, latest)));
+    }
+    // the name of the node as the other type
+    Latest* other = findLatest(index, key, len + !directory);
+    if (other->name && !other->deleted)
+    {
+        other->seen = true;
+        step->replacing = true;
+    }
+}
+
+static int compareNamesDown(const void* one, const void* two)
+{
+    Latest* const* a = one;
+    Latest* const* b = two;
+    int len = (*a)->nameLen < (*b)->nameLen ? (*a)->nameLen : (*b)->nameLen;
+    int compare = memcmp((*b)->name, (*a)->name, len);
+    return compare ? compare : (*b)->nameLen - (*a)->nameLen;
+}
+
+// deletes what was under the nodes appended, but which the walk didn't
+// come to, with what is in a directory before the directory
+static void writeTombstones(int archive, MemberIndex* index)
+{
+    Latest** gone = malloc(index->count * sizeof(Latest*) + 1);
+    if (!gone) DIE("%s", "Out of memory");
+    long long goneCount = 0;
+    for (long long i = 0; i < index->slotCount; i++)
+    {
+        Latest* latest = index->slots + i;
+        if (!latest->name || latest->deleted || latest->seen) continue;
+        int nameLen = latest->nameLen;
+        if (latest->name[nameLen-1] == '/') nameLen--;
+        for (int j = 0; j < index->nodeC; j++)
+        {
+            // named as given, without the slashes the walk leaves off
+            char* node = index->nodes[j];
+            int nodeLen = strlen(node);
+            while (nodeLen > 1 && node[nodeLen-1] == '/') nodeLen--;
+            if (nameUnder(latest->name, nameLen, node, nodeLen))
+            {
+                gone[goneCount++] = latest;
+                break;
+            }
+        }
+    }
+    qsort(gone, goneCount, sizeof(Latest*), compareNamesDown);
+    for (long long i = 0; i < goneCount; i++)
+    {
+        char name[gone[i]->nameLen + 1];
+        memcpy(name, gone[i]->name, gone[i]->nameLen);
+        name[gone[i]->nameLen] = '\0';
+        PROGRESS("Deleting %s", name);
+        writeTombstone(archive, name);
+    }
+    PROGRESS("Deleted %lld nodes", goneCount);
+    free(gone);
+}
+
+static void freeIndex(MemberIndex* index)
+{
+    for (long long i = 0; i < index->slotCount; i++)
+    {
+        free(index->slots[i].name);
+        free(index->slots[i].extents);
+    }
+    free(index->slots);
+}
+
+// == REFERENCE MODULE =====================================================
+
+int referenceArchive = -1;
+
+// an archive regular files are stored against (see delta.h), mapped whole
+typedef struct {
+    unsigned char* map;
+    long long mapLen;
+    MemberIndex index; // its latest members
+} Reference;
+
+static Reference* openReference(int archive)
+{
+    Reference* reference = calloc(1, sizeof(Reference));
+    if (!reference) DIE("%s", "Out of memory");
+    struct stat data;
+    if (fstat(archive, &data)) SYS_DIE("fstat");
+    if (lseek(archive, 0, SEEK_SET)) SYS_DIE("lseek");
+    MemberReader reader;
+    startMembers(archive, &reader);
+    if (!reader.version && reader.started)
+        DIE("%s", "Archives without a version can't be references");
+    Member member;
+    while (readMember(&reader, &member))
+    {
+        addLatest(&reference->index, &member);
+        Latest* latest = findLatest(&reference->index, member.name,
+            member.nameLen);
+        free(latest->extents);
+        latest->extents = member.extents;
+        latest->extentCount = member.extentCount;
+        latest->stored = lseek(archive, 0, SEEK_CUR);
+        if (latest->stored < 0) SYS_DIE("lseek");
+        if (member.flags & FLAG_STREAM)
+        {
+            passStream(archive, &member, -1);
+            latest->size = member.size;
+            latest->checksum = member.checksum;
+        }
+        latest->storedLen = member.storedLen > 0 ? member.storedLen : 0;
+        if (!(member.flags & FLAG_STREAM) &&
+            lseek(archive, latest->storedLen, SEEK_CUR) < 0)
+            SYS_DIE("lseek");
+    }
+    endMembers(&reader);
+    if (lseek(archive, 0, SEEK_CUR) != data.st_size)
+        DIE("%s", "Reference archive ends in the middle of a member");
+    reference->mapLen = data.st_size;
+    if (reference->mapLen)
+    {
+        reference->map = heldMmap(reference->mapLen, PROT_READ, MAP_SHARED,
+            archive);
+        if (reference->map == MAP_FAILED) SYS_DIE("mmap");
+    }
+    PROGRESS("The reference archive holds %lld nodes",
+        reference->index.count);
+    return reference;
+}
+
+static void closeReference(Reference* reference)
+{
+    if (reference->mapLen && heldMunmap(reference->map, reference->mapLen))
+        SYS_ERROR("munmap");
+    freeIndex(&reference->index);
+    free(reference);
+}
+
+// the latest version of the regular file name in the reference, or NULL if
+// a file by that name can't be stored against it. a file the reference
+// stores as a delta is not a base, as its own base is not at hand, nor is
+// one stored in chunks
+static Latest* findBase(Reference* reference, const char* name, int nameLen)
+{
+    Latest* base = findLatest(&reference->index, name, nameLen);
+    if (!base->name || base->deleted || name[nameLen-1] == '/' ||
+        (base->flags & (FLAG_DELTA|FLAG_STREAM)) || base->size < DELTA_MIN)
+        return NULL;
+    return base;
+}
+
+// decodes base into a temporary file, and maps its size bytes
+static unsigned char* loadBase(Reference* reference, Latest* base)
+{
+    TRACE_BEGIN("loadBase");
+    FILE* temp = heldTmpfile();
+    if (!temp) SYS_DIE("tmpfile");
+    if (ftruncate(fileno(temp), base->size)) SYS_DIE("ftruncate");
+    unsigned char* bytes = heldMmap(base->size, PROT_READ|PROT_WRITE,
+        MAP_SHARED, fileno(temp));
+    if (bytes == MAP_FAILED) SYS_DIE("mmap");
+    // the mapping keeps the file until it is unmapped
+    if (heldFclose(temp)) SYS_ERROR("fclose");
+
+    // its data goes between its holes, as extract() puts it
+    OutputFile output;
+    openOutput(-1, base->size, base->extents, base->extentCount, &output);
+    output.bytes = bytes;
+    long long dataLen = extentsLen(output.extents, output.extentCount);
+    int stored = openMemoryReader(reference->map + base->stored,
+        base->storedLen);
+    int outputChannel = openCallbackChannel(NULL, writeOutput, &output);
+    decode(stored, outputChannel, dataLen);
+    if (fdclose(outputChannel)) SYS_ERROR("close");
+    if (fdclose(stored)) SYS_ERROR("close");
+    if (output.fill != dataLen || extentsCRC(bytes, output.extents,
+        output.extentCount) != base->checksum)
+        DIE("%s", "Cyclic Redundancy Check of the reference failed");
+    TRACE_END("loadBase");
+    return bytes;
+}
+
+static void unloadBase(Latest* base, unsigned char* bytes)
+{
+    if (heldMunmap(bytes, base->size)) SYS_ERROR("munmap");
+}
+
+// == ARCHIVE MODULE =======================================================
+
+/**
+ * Given archive open for writing and a step of the walk, copy its node into
+ * archive. loaded is what the loader got of a regular file, or NULL to open
+ * and read it here. a regular file in reference may be stored as a delta
+ * The first rootLen characters of node are left out of its archived name
+ */
+static void archiveStep(int archive, Step* step, Loaded* loaded,
+    Cache* cache, Reference* reference, char* nodeLZW)
+{
+    char* node = step->node;
+    int rootLen = step->rootLen;
+    int nodeLen = strlen(node);
+    if (step->leaving)
+    {
+        if (step->error) stepError(step);
+        else if (removeOriginal && rmdir(node)) SYS_ERROR("rmdir");
+        return;
+    }
+    PROGRESS("Archiving node %s", node);
+    if (step->error && !strcmp(step->error, "lstat"))
+    {
+        stepError(step);
+        return;
+    }
+    struct stat nodeData = step->data;
+    if (step->unchanged)
+    {
+        PROGRESS("%s is unchanged", node);
+        // it is counted in the total all the same
+        if (reportProgress && S_ISREG(nodeData.st_mode))
+            progressBytes(nodeData.st_size);
+        if (step->error) stepError(step);
+        if (removeOriginal && !S_ISDIR(nodeData.st_mode) && remove(node))
+            SYS_ERROR("remove");
+        return;
+    }
+    if (step->replacing)
+    {
+        // the node of the other type by its name goes first
+        char other[nodeLen - rootLen + 2];
+        strcpy(other, node + rootLen);
+        if (!S_ISDIR(nodeData.st_mode)) strcat(other, "/");
+        writeTombstone(archive, other);
+    }
+
+    mode_t mode = nodeData.st_mode;
+    // store these so they can be restored
+    struct timespec times[2];
+    statTimes(&nodeData, times);
+    // default value so encrypt on linux (no flags) can be decrypted on mac
+    uint64_t flags = 0;
+#if MAC
+    flags = nodeData.st_flags;
+#endif
+
+    if (S_ISDIR(mode))
+    {
+        // append a / to make sure it's extracted as a directory
+        node[nodeLen++] = '/';
+    }
+    else if (!S_ISREG(mode))
+    {
+        STATUS("Unrecognized inode type %d", nodeData.st_mode);
+        return;
+    }
+    // a file in the reference is read to find what changed, even if the
+    // cache has it
+    Latest* base = reference && S_ISREG(mode) ? findBase(reference,
+        node + rootLen, nodeLen - rootLen) : NULL;
+    // a regular file stored before, and unchanged since, need not be read
+    CachedFile cached;
+    bool inCache = cache && S_ISREG(mode) && !base &&
+        findCached(cache, &nodeData, &cached);
+    // a regular file is opened first, to know whether it has holes
+    int file = -1;
+    Extent* extents = inCache ? cached.extents : NULL;
+    long long extentCount = inCache ? cached.extentCount : 0;
+    if (S_ISREG(mode) && !(inCache && cached.encoded))
+    {
+        file = loaded ? loaded->fd : heldOpen(node, O_RDONLY, 0);
+        if (file < 0 && loaded) errno = loaded->error;
+        if (file < 0)
+        {
+            free(extents);
+            SYS_ERR_DONE("open");
+        }
+        // the size now open, in case it changed since lstat()
+        if (loaded && loaded->size >= 0) nodeData.st_size = loaded->size;
+        else if (fstat(file, &nodeData)) SYS_DIE("fstat");
+        if (inCache && nodeData.st_size != step->data.st_size)
+        {
+            inCache = false;
+            free(extents);
+            extents = NULL;
+            extentCount = 0;
+        }
+        if (!inCache)
+            findHoles(file, nodeData.st_size, &extents, &extentCount);
+        if (extents || nodeData.st_size < DELTA_MIN) base = NULL;
+    }
+    if (extents) flags |= FLAG_SPARSE;
+    Member member = {node + rootLen, nodeLen - rootLen, mode,
+        {times[0], times[1]}, flags, 0, 0, extents, extentCount};
+    if (S_ISDIR(mode))
+    {
+        writeMember(archive, &member);
+        node[--nodeLen] = '\0';
+        // its nodes are the next steps of the walk
+        if (step->error) stepError(step);
+    }
+    else if (inCache && cached.encoded)
+    {
+        // what was stored of it goes in again
+        progressMember(node + rootLen);
+        member.size = nodeData.st_size;
+        member.checksum = cached.checksum;
+        member.storedLen = cached.payloadLen;
+        writeMember(archive, &member);
+        TRACE_BEGIN("copyCached");
+        writeBytes(archive, cached.payload, cached.payloadLen);
+        TRACE_END("copyCached");
+        if (reportProgress) progressBytes(member.size);
+        PROGRESS("%s is unchanged since it was cached", node);
+        FileStats stats = {node + rootLen, member.size, cached.payloadLen, 1,
+            0, 0, 0, true};
+        statsFile(&stats);
+        free(extents);
+        if (removeOriginal && remove(node)) SYS_ERROR("remove");
+    }
+    else
+    {
+        // regular file
+        progressMember(node + rootLen);
+        // the length tells extract() where to stop reading
+        off_t size = nodeData.st_size;
+        member.size = size;
+        if (flags & FLAG_SPARSE)
+        {
+            PROGRESS("%s has %lld bytes of data in %lld extents", node,
+                extentsLen(extents, extentCount), extentCount);
+        }
+        FileBytes input;
+        loadFile(file, size, extents, extentCount,
+            loaded ? loaded->bytes : NULL, &input);
+
+        // what is stored of a file with a base is what changed since,
+        // unless most of it did
+        unsigned char* delta = NULL;
+        long long deltaLen = 0;
+        if (base)
+        {
+            TRACE_BEGIN("makeDelta");
+            unsigned char* baseBytes = loadBase(reference, base);
+            if (makeDelta(baseBytes, base->size, input.bytes, size, &delta,
+                &deltaLen))
+            {
+                PROGRESS("%s changed by %lld bytes of delta", node,
+                    deltaLen);
+                member.flags |= FLAG_DELTA;
+                member.deltaLen = deltaLen;
+                member.baseChecksum = base->checksum;
+            }
+            unloadBase(base, baseBytes);
+            TRACE_END("makeDelta");
+        }
+        FileBytes deltaBytes = {delta, deltaLen, false, false, NULL, 1,
+            {0, deltaLen}};
+        deltaBytes.extents = &deltaBytes.whole;
+        // the bytes encoded or copied into the archive
+        FileBytes* stored = delta ? &deltaBytes : &input;
+
+        // without nodeLZW, the encoded file is kept in memory
+        char* encodedBytes = NULL;
+        long encodedLen = 0;
+        int encoded;
+        if (nodeLZW)
+        {
+            encoded = heldOpen(nodeLZW, O_WRONLY|O_CREAT|O_TRUNC, 0600);
+            // removed below, or by the failure of a library call
+            if (encoded >= 0) holdPath(nodeLZW);
+        }
+        else encoded = openMemoryWriter(&encodedBytes, &encodedLen);
+        if (encoded < 0) SYS_ERR_DONE("open lzw");
+
+        bool didEncode = true;
+        checktype checksum;
+        FileStats stats = {node + rootLen, size, 0, 0, 0, 0, statsPrunes()};
+        double crcStart = monotonicSeconds();
+
+        // the encoder reads the bytes in memory too
+        ExtentReader reader = {stored, 0, 0};
+        int encodeInput = openCallbackChannel(readExtents, NULL, &reader);
+        if (inCache)
+        {
+            // it did not encode before, so it is only copied again
+            checksum = cached.checksum;
+            didEncode = false;
+            if (fdclose(encodeInput)) SYS_ERROR("close");
+            if (reportProgress)
+                progressBytes(extentsLen(input.extents, input.extentCount));
+        }
+        else if (series)
+        {
+            checksum = extentsCRC(input.bytes, input.extents,
+                input.extentCount);
+            stats.crcSeconds = monotonicSeconds() - crcStart;
+            double encodeStart = monotonicSeconds();
+            didEncode = encode(encodeInput, encoded);
+            if (fdclose(encodeInput)) SYS_ERROR("close");
+            stats.codecSeconds = monotonicSeconds() - encodeStart;
+        }
+        else
+        {
+            // compute CRC while another thread encodes the same bytes
+            EncodeArgs args = {encodeInput, encoded, node, nodeLZW, false};
+            Stage encodeStage;
+            startStage(&encodeStage, "Encode", runEncode, &args);
+
+            checksum = extentsCRC(input.bytes, input.extents,
+                input.extentCount);
+            stats.crcSeconds = monotonicSeconds() - crcStart;
+
+            joinStage(&encodeStage);
+            didEncode = args.didEncode;
+            stats.codecSeconds = encodeStage.wallSeconds;
+        }
+        // the holes, which the total counts, are done without reading them
+        if (reportProgress && extents)
+            progressBytes(size - extentsLen(extents, extentCount));
+        stats.encoded = didEncode;
+        stats.prunes = statsPrunes() - stats.prunes;
+
+        // the header goes out once the checksum and the length of what
+        // follows are known, before the data
+        member.checksum = checksum;
+        if (!didEncode)
+        {
+            member.storedLen = 1 + extentsLen(stored->extents,
+                stored->extentCount);
+        }
+        else if (nodeLZW) member.storedLen = lseek(encoded, 0, SEEK_CUR);
+        else member.storedLen = encodedLen;
+        writeMember(archive, &member);
+
+        if (fdclose(encoded)) SYS_ERROR("close");
+
+        
+        if (didEncode && !nodeLZW)
+        {
+            TRACE_BEGIN("copyMemory");
+            if (fdwrite(archive, encodedBytes, encodedLen) < encodedLen)
+                SYS_DIE("write");
+            stats.storedSize = encodedLen;
+            TRACE_END("copyMemory");
+        }
+        else if (didEncode)
+        {
+            // write from nodeLZW to archive
+            TRACE_BEGIN("copyTemp");
+            int lzw = heldOpen(nodeLZW, O_RDONLY, 0);
+            if (lzw < 0) SYS_DIE("open");
+            stats.storedSize = fdcopy(lzw, archive, -1);
+            if (heldClose(lzw)) SYS_ERROR("close");
+            TRACE_END("copyTemp");
+        }
+        else
+        {
+            fdputc(0, archive);
+            stats.storedSize++;
+            // copy from node to archive. a mapped node goes file to file in
+            // the kernel (see fdcopy()), which reads the same pages the
+            // mapping does, so what is copied is what the CRC saw
+            struct stat archiveData;
+            bool kernelCopy = stored == &input && input.mapped &&
+                !isChannel(archive) && !fstat(archive, &archiveData) &&
+                S_ISREG(archiveData.st_mode);
+            TRACE_BEGIN("copyRaw");
+            for (long long i = 0; i < stored->extentCount; i++)
+            {
+                Extent* extent = stored->extents + i;
+                if (!kernelCopy)
+                {
+                    writeBytes(archive, stored->bytes + extent->offset,
+                        extent->len);
+                }
+                else if (lseek(file, extent->offset, SEEK_SET) < 0)
+                    SYS_DIE("lseek");
+                else if (fdcopy(file, archive, extent->len) < extent->len)
+                    DIE("%s shrank while being archived", node);
+                stats.storedSize += extent->len;
+            }
+            TRACE_END("copyRaw");
+        }
+        // for the next run, unless it changed since lstat(), or what is
+        // stored of it depends on the reference
+        if (cache && !inCache && !delta && size == step->data.st_size)
+        {
+            CachedFile stored = {checksum, didEncode, extents, extentCount,
+                NULL, stats.storedSize};
+            int payload = -1;
+            if (didEncode && nodeLZW) payload = heldOpen(nodeLZW, O_RDONLY, 0);
+            else if (didEncode)
+                payload = openMemoryReader(encodedBytes, encodedLen);
+            if (didEncode && payload < 0) SYS_DIE("open");
+            addCached(cache, &step->data, &stored, payload);
+            if (payload >= 0 && fdclose(payload)) SYS_ERROR("close");
+        }
+        unloadFile(&input);
+        free(delta);
+#if !MAC
+        // what this read is not kept for later, at the expense of what else
+        // had it cached
+        if (dropCache) posix_fadvise(file, 0, 0, POSIX_FADV_DONTNEED);
+#endif
+        free(extents);
+        if (heldClose(file)) SYS_ERROR("close");
+        statsFile(&stats);
+        if (nodeLZW) letGoPath(nodeLZW);
+        if (nodeLZW && remove(nodeLZW)) SYS_ERROR("remove");
+        free(encodedBytes);
+        
+        if (removeOriginal && remove(node)) SYS_ERROR("remove");
+    }
+}
+
+long long archiveBytes(char* root, int nodeC, char** nodes)
+{
+    long long bytes = 0;
+    Walk walk;
+    startWalk(&walk, root, nodeC, nodes, -1);
+    Step step;
+    while (walkNext(&walk, &step))
+    {
+        if (!step.leaving && !step.error && S_ISREG(step.data.st_mode))
+            bytes += step.data.st_size;
+        free(step.node);
+    }
+    return bytes;
+}
+
+// arguments of the thread which walks ahead of the archiver
+typedef struct {
+    Walk walk;
+    int loader;
+    Cache* cache;
+    MemberIndex* index;
+} ScanArgs;
+
+static void* runScan(void* arg)
+{
+    ScanArgs* args = arg;
+    Step step;
+    while (walkNext(&args->walk, &step))
+    {
+        Step* scanned = malloc(sizeof(Step));
+        if (!scanned) DIE("%s", "Out of memory");
+        if (args->index) checkStep(args->index, &step);
+        *scanned = step;
+        // regular files are loaded, and the other steps passed along, as
+        // are files whose encoding is in the cache, or which are unchanged
+        bool load = !step.leaving && !step.error && !step.unchanged &&
+            S_ISREG(step.data.st_mode);
+        CachedFile cached;
+        if (load && args->cache &&
+            findCached(args->cache, &step.data, &cached))
+        {
+            load = !cached.encoded;
+            free(cached.extents);
+        }
+        LoadRequest request = {load ? scanned->node : NULL, scanned};
+        if (fdwrite(args->loader, &request, sizeof(request)) <
+            sizeof(request)) SYS_DIE("write");
+    }
+    if (fdclose(args->loader)) SYS_ERROR("close");
+    return NULL;
+}
+
+// archives the nodes after what is already in archive. with an index, only
+// those which changed since
+static void archiveNodes(int archive, MemberIndex* index, char* root,
+    char* nodeLZW, int nodeC, char** nodes)
+{
+    Cache* cache = cachePath ? openCache(cachePath) : NULL;
+    Reference* reference = referenceArchive >= 0 ?
+        openReference(referenceArchive) : NULL;
+    if (series)
+    {
+        Walk walk;
+        startWalk(&walk, root, nodeC, nodes, listFd);
+        Step step;
+        while (walkNext(&walk, &step))
+        {
+            if (index) checkStep(index, &step);
+            archiveStep(archive, &step, NULL, cache, reference, nodeLZW);
+            free(step.node);
+        }
+    }
+    else
+    {
+        // another thread walks ahead, so the files are opened and read
+        // before they are archived
+        int loader[2];
+        makeLoader(loader, MAP_THRESHOLD);
+        ScanArgs args;
+        startWalk(&args.walk, root, nodeC, nodes, listFd);
+        args.loader = loader[1];
+        args.cache = cache;
+        args.index = index;
+        Stage scanStage;
+        startStage(&scanStage, "Scan", runScan, &args);
+
+        Loaded loaded;
+        while (rdhang(loader[0], &loaded, sizeof(loaded)))
+        {
+            Step* step = loaded.tag;
+            archiveStep(archive, step, loaded.path ? &loaded : NULL, cache,
+                reference, nodeLZW);
+            free(step->node);
+            free(step);
+        }
+        if (fdclose(loader[0])) SYS_ERROR("close");
+        joinStage(&scanStage);
+    }
+    if (streamName)
+    {
+        archiveStream(archive, STDIN_FILENO, streamName);
+        // it is not gone, wherever it is named
+        Latest* latest = index ? findLatest(index, streamName,
+            strlen(streamName)) : NULL;
+        if (latest && latest->name) latest->seen = true;
+    }
+    if (cache) closeCache(cache);
+    if (reference) closeReference(reference);
+}
+
+char* streamName = NULL;
+int listFd = -1;
 
 /**
- * Given archive open for writing and path to inode, copy node into archive
- * Input file descriptor open for writing
+ * Input archive file descriptor open for writing.
  */
-void archiveNode(int archive, char* node, char* nodeLZW)
+void archive(int archive, char* root, char* nodeLZW, int nodeC, char** nodes)
 {
-    int nodeLen = strlen(node);
-    while (nodeLen > 0 && node[nodeLen-1] == '/') node[--nodeLen] = '\0';
-    PROGRESS("Archiving node %s", node);
-    struct stat nodeData;
-    if (lstat(node, &nodeData)) SYS_ERR_DONE("lstat");
+    STATUS("%s", "Archiving");
+    writeArchiveStart(archive);
+    archiveNodes(archive, NULL, root, nodeLZW, nodeC, nodes);
+    freeHeaderBuffers();
+    PROGRESS("%s", "Archive complete");
+}
 
-    mode_t mode = nodeData.st_mode;
-    // store these so they can be restored
-    struct timeval times[2];
-    // default value so encrypt on linux (no flags) can be decrypted on mac
-    u_long flags = 0;
-#if MAC
-    // pretty sure this one doesn't work
-    TIMESPEC_TO_TIMEVAL(times, &nodeData.st_atimespec);
-    TIMESPEC_TO_TIMEVAL(times+1, &nodeData.st_mtimespec);
-    flags = nodeData.st_flags;
-#else
-    times[0].tv_sec = nodeData.st_atime;
-    times[1].tv_sec = nodeData.st_mtime;
-    times[0].tv_usec = times[1].tv_usec = 0;
-#endif
+void appendArchive(int archive, int previous, char* root, char* nodeLZW,
+    int nodeC, char** nodes)
+{
+    STATUS("%s", "Appending");
+    bool inPlace = archive == previous;
+    MemberReader reader;
+    startMembers(previous, &reader);
+    if (!reader.version && !reader.started)
+    {
+        // nothing to append to
+        endMembers(&reader);
+        writeArchiveStart(archive);
+        archiveNodes(archive, NULL, root, nodeLZW, nodeC, nodes);
+        freeHeaderBuffers();
+        PROGRESS("%s", "Archive complete");
+        return;
+    }
+    if (!reader.version)
+        DIE("%s", "Archives without a version can't be appended to");
+    if (!inPlace) writeArchiveStart(archive);
 
-    if (S_ISDIR(mode))
+    // what is there is kept, and is what the nodes are compared with
+    MemberIndex index = {NULL, 0, 0, nodeC, nodes};
+    Member member;
+    while (readMember(&reader, &member))
     {
-        // append a / to make sure it's extracted as a directory
-        node[nodeLen++] = '/';
+        long long storedLen = member.storedLen > 0 ? member.storedLen : 0;
+        if (!inPlace) writeMember(archive, &member);
+        if (member.flags & FLAG_STREAM)
+            passStream(previous, &member, inPlace ? -1 : archive);
+        else if (inPlace)
+        {
+            if (lseek(previous, storedLen, SEEK_CUR) < 0) SYS_DIE("lseek");
+        }
+        else if (fdcopy(previous, archive, storedLen) < storedLen)
+            DIE("%s", "Unable to read member");
+        addLatest(&index, &member);
+        Latest* latest = findLatest(&index, member.name, member.nameLen);
+        free(latest->extents);
+        latest->extents = member.extents;
+        latest->extentCount = member.extentCount;
     }
-    else if (!S_ISREG(mode))
+    struct stat data;
+    if (inPlace && (fstat(previous, &data) ||
+        lseek(previous, 0, SEEK_CUR) != data.st_size))
+        DIE("%s", "Archive ends in the middle of a member");
+    PROGRESS("Appending to %lld nodes", index.count);
+    endMembers(&reader);
+
+    writeSegmentStart(archive);
+    archiveNodes(archive, &index, root, nodeLZW, nodeC, nodes);
+    writeTombstones(archive, &index);
+    freeIndex(&index);
+    freeHeaderBuffers();
+    PROGRESS("%s", "Append complete");
+}
+
+// == CHECK MODULE =========================================================
+
+int extractMode = EXTRACT_FILES;
+
+// the CRC of what is written to it, as a channel (see openCallbackChannel())
+typedef struct {
+    checktype message;
+    long long len;
+} CheckSink;
+
+static long writeCheck(void* state, const void* bytes, long len)
+{
+    CheckSink* sink = state;
+    appendBytesToMessage(&sink->message, bytes, len);
+    sink->len += len;
+    if (reportProgress) progressBytes(len);
+    return len;
+}
+
+// decodes the regular file member stored next in stored, and checks it
+// against its checksum, without writing it anywhere
+static bool testMember(int stored, Member* member, Reference* reference)
+{
+    double start = monotonicSeconds();
+    CheckSink sink = {0, 0};
+    int sinkChannel = openCallbackChannel(NULL, writeCheck, &sink);
+    long long len = member->flags & FLAG_SPARSE ?
+        extentsLen(member->extents, member->extentCount) : member->size;
+    bool found = true;
+    if (member->flags & FLAG_STREAM)
     {
-        STATUS("Unrecognized inode type %d", nodeData.st_mode);
-        return;
+        // its size and checksum are at the end of its chunks
+        decodeStream(stored, member, sinkChannel);
+        len = member->size;
     }
-    // write the name of this node
-    if (write(archive, &nodeLen, sizeof(nodeLen))<sizeof(nodeLen))
-        SYS_DIE("write");
-    if (write(archive, node, nodeLen)<nodeLen) SYS_DIE("write");
-    // write the mode of this node
-    if (write(archive, &mode, sizeof(mode))<sizeof(mode)) SYS_DIE("write");
+    else if (member->flags & FLAG_DELTA)
+    {
+        char* changes = NULL;
+        long changesLen = 0;
+        int changesChannel = openMemoryWriter(&changes, &changesLen);
+        decode(stored, changesChannel, member->deltaLen);
+        if (fdclose(changesChannel)) SYS_ERROR("close");
+        Latest* base = reference ? findBase(reference, member->name,
+            member->nameLen) : NULL;
+        found = base && base->checksum == member->baseChecksum;
+        if (found)
+        {
+            unsigned char* baseBytes = loadBase(reference, base);
+            applyDelta(baseBytes, base->size, (unsigned char*)changes,
+                changesLen, sinkChannel);
+            unloadBase(base, baseBytes);
+        }
+        free(changes);
+    }
+    else decode(stored, sinkChannel, len);
+    if (fdclose(sinkChannel)) SYS_ERROR("close");
+    padMessage(&sink.message);
+
+    char name[member->nameLen + 1];
+    memcpy(name, member->name, member->nameLen);
+    name[member->nameLen] = '\0';
+    FileStats stats = {name, member->size, member->storedLen, -1,
+        monotonicSeconds() - start};
+    statsFile(&stats);
+    if (!found)
+    {
+        WARN("%s needs the reference archive it was stored against", name);
+        return false;
+    }
+    if (sink.len != len || sink.message != member->checksum)
+    {
+        WARN("%s failed its Cyclic Redundancy Check", name);
+        return false;
+    }
+    PROGRESS("%s passed", name);
+    return true;
+}
 
-    // write the times and flags of this node
-    int timeSize = sizeof(struct timeval) * 2;
-    if (write(archive, times, timeSize)<timeSize) SYS_DIE("write");
-    // write the flags
-    if (write(archive, &flags, sizeof(flags))<sizeof(flags)) SYS_DIE("write");
+// a regular file member of an archive being tested in parallel
+typedef struct {
+    Member member;     // its name and extents malloced
+    long long stored;  // where its data starts in the archive
+    bool passed;
+} TestJob;
 
-    if (S_ISDIR(mode))
+// the threads testing an archive take the next job in turn
+typedef struct {
+    unsigned char* map;
+    Reference* reference;
+    TestJob* jobs;
+    long long jobCount;
+    atomic_llong next;
+} TestPool;
+
+static void* runTest(void* arg)
+{
+    TestPool* pool = arg;
+    long long i;
+    while ((i = atomic_fetch_add(&pool->next, 1)) < pool->jobCount)
     {
-        node[--nodeLen] = '\0';
-        
-        // in the case of an unopenable directory, report error after archiving
-        DIR* directory = opendir(node);
-        if (!directory) SYS_ERR_DONE("opendir");
-        // now look through each thing in directory
-        struct dirent* subnode;
-        while ((subnode = readdir(directory)))
-        {
-            if (!strcmp(subnode->d_name, ".") || !strcmp(subnode->d_name, ".."))
-                continue;
-            int nameLen = strlen(subnode->d_name);
-            if (nameLen >= 4 && strcmp(subnode->d_name+nameLen-4, ".lzw")==0)
-                continue;
-            char* subNodePath = calloc(nodeLen + nameLen + 2, 1);
-            sprintf(subNodePath, "%s/%s", node, subnode->d_name);
-            archiveNode(archive, subNodePath, nodeLZW);
-            free(subNodePath);
+        TestJob* job = pool->jobs + i;
+        progressMember(job->member.name);
+        int stored = openMemoryReader(pool->map + job->stored,
+            job->member.storedLen);
+        job->passed = testMember(stored, &job->member, pool->reference);
+        if (fdclose(stored)) SYS_ERROR("close");
+    }
+    return NULL;
+}
+
+// tests the members of a whole archive file with a thread for each CPU.
+// returns how many failed
+static long long testInParallel(MemberReader* reader, Reference* reference)
+{
+    int archive = reader->archive;
+    long long jobCapacity = 64;
+    TestPool pool = {NULL, reference, malloc(jobCapacity * sizeof(TestJob)),
+        0};
+    if (!pool.jobs) DIE("%s", "Out of memory");
+    atomic_init(&pool.next, 0);
+    Member member;
+    while (readMember(reader, &member))
+    {
+        off_t stored = lseek(archive, 0, SEEK_CUR);
+        long long storedLen = member.storedLen > 0 ? member.storedLen : 0;
+        if (stored < 0) SYS_DIE("lseek");
+        if (member.flags & FLAG_STREAM) passStream(archive, &member, -1);
+        else if (lseek(archive, storedLen, SEEK_CUR) < 0) SYS_DIE("lseek");
+        if (member.name[member.nameLen-1] == '/' ||
+            (member.flags & FLAG_DELETED))
+        {
+            free(member.extents);
+            continue;
+        }
+        if (pool.jobCount == jobCapacity)
+        {
+            jobCapacity *= 2;
+            pool.jobs = realloc(pool.jobs, jobCapacity * sizeof(TestJob));
+            if (!pool.jobs) DIE("%s", "Out of memory");
         }
+        TestJob* job = pool.jobs + pool.jobCount++;
+        job->member = member;
+        // terminated, for progressMember()
+        job->member.name = malloc(member.nameLen + 1);
+        if (!job->member.name) DIE("%s", "Out of memory");
+        memcpy(job->member.name, member.name, member.nameLen);
+        job->member.name[member.nameLen] = '\0';
+        job->stored = stored;
+    }
+    struct stat data;
+    if (fstat(archive, &data)) SYS_DIE("fstat");
+    if (lseek(archive, 0, SEEK_CUR) != data.st_size)
+        DIE("%s", "Archive ends in the middle of a member");
+    if (data.st_size)
+    {
+        pool.map = heldMmap(data.st_size, PROT_READ, MAP_SHARED, archive);
+        if (pool.map == MAP_FAILED) SYS_DIE("mmap");
+        madvise(pool.map, data.st_size, MADV_WILLNEED);
+    }
+
+    long threadCount = sysconf(_SC_NPROCESSORS_ONLN);
+    if (threadCount < 1) threadCount = 1;
+    if (threadCount > pool.jobCount) threadCount = pool.jobCount;
+    PROGRESS("Testing %lld files in %ld threads", pool.jobCount,
+        threadCount);
+    Stage stages[threadCount + 1];
+    for (long i = 0; i < threadCount; i++)
+        startStage(stages + i, "Test", runTest, &pool);
+    for (long i = 0; i < threadCount; i++) joinStage(stages + i);
 
-        if (closedir(directory)) SYS_ERR_DONE("closedir");
-        if (removeOriginal && rmdir(node)) SYS_ERR_DONE("rmdir");
+    long long failures = 0;
+    for (long long i = 0; i < pool.jobCount; i++)
+    {
+        failures += !pool.jobs[i].passed;
+        free(pool.jobs[i].member.name);
+        free(pool.jobs[i].member.extents);
     }
+    free(pool.jobs);
+    if (pool.map && heldMunmap(pool.map, data.st_size)) SYS_ERROR("munmap");
+    return failures;
+}
+
+// decodes and checks every regular file in archive, writing nothing. the
+// members of an archive file which says how long each one is are tested in
+// parallel, and those of a stream one after another
+static void testArchive(int archive)
+{
+    STATUS("%s", "Testing");
+    Reference* reference = referenceArchive >= 0 ?
+        openReference(referenceArchive) : NULL;
+    MemberReader reader;
+    startMembers(archive, &reader);
+    struct stat data;
+    long long failures = 0;
+    if (!series && reader.version && !fstat(archive, &data) &&
+        S_ISREG(data.st_mode)) failures = testInParallel(&reader, reference);
     else
     {
-        // first put length (so know where to stop when reading)
-        off_t size = nodeData.st_size;
-        if (write(archive, &size, sizeof(size))<sizeof(size)) SYS_DIE("write");
-        // regular file
-        FILE* file = fopen(node, "r");
-        if (!file) SYS_ERR_DONE("fopen");
+        Member member;
+        while (readMember(&reader, &member))
+        {
+            if (member.name[member.nameLen-1] != '/' &&
+                !(member.flags & FLAG_DELETED))
+            {
+                char name[member.nameLen + 1];
+                memcpy(name, member.name, member.nameLen);
+                name[member.nameLen] = '\0';
+                progressMember(name);
+                failures += !testMember(archive, &member, reference);
+            }
+            free(member.extents);
+        }
+    }
+    endMembers(&reader);
+    if (reference) closeReference(reference);
+    if (failures) DIE("Files which failed the test: %lld", failures);
+    STATUS("%s", "Test complete");
+}
 
-        int encoded = open(nodeLZW, O_WRONLY|O_CREAT|O_TRUNC, 0600);
-        if (encoded < 0) SYS_ERR_DONE("open lzw");
+// what is stored of a regular file is skipped over
+static long skipStored(void* state, const void* bytes, long len)
+{
+    return len;
+}
 
-        bool didEncode = true;
-        checktype checksum;
+static int compareNamesUp(const void* one, const void* two)
+{
+    return compareNamesDown(two, one);
+}
 
-        if (series)
+// lists how the nodes under root differ from the latest members of archive
+// on standard output, a line to each, starting with
+//   - if it is not there
+//   + if it is there, in a directory the archive has, but not in the archive
+//   T if it is of another type
+//   M if it has other contents, by size or Cyclic Redundancy Check
+//   m if it only has another mode or mtime
+static void diffArchive(int archive, char* root)
+{
+    STATUS("%s", "Comparing");
+    MemberIndex index = {NULL, 0, 0, 0, NULL};
+    MemberReader reader;
+    startMembers(archive, &reader);
+    Member member;
+    int skip = openCallbackChannel(NULL, skipStored, NULL);
+    while (readMember(&reader, &member))
+    {
+        // the size and checksum of a stream member are at its end
+        if (member.flags & FLAG_STREAM) passStream(archive, &member, -1);
+        addLatest(&index, &member);
+        Latest* latest = findLatest(&index, member.name, member.nameLen);
+        free(latest->extents);
+        latest->extents = member.extents;
+        latest->extentCount = member.extentCount;
+        if (member.name[member.nameLen-1] == '/' ||
+            (member.flags & (FLAG_DELETED|FLAG_STREAM))) continue;
+        // only the header is needed. the data is passed over, or decoded
+        // where it does not say how long it is
+        if (member.storedLen >= 0)
         {
-            checksum = computeCRC(file, -1);
-            if (fclose(file)) SYS_DIE("fclose");
-            file = fopen(node, "r");
-            if (!file) SYS_DIE("fopen");
-            didEncode = encode(fileno(file), encoded);
+            if (lseek(archive, member.storedLen, SEEK_CUR) < 0 &&
+                fdcopy(archive, skip, member.storedLen) < member.storedLen)
+                DIE("%s", "Unable to read member");
         }
         else
         {
-            // compute CRC and pipe file to encode
-            int computeCRCToEncodePipe[2];
-            if (pipe(computeCRCToEncodePipe)) SYS_DIE("pipe");
+            decode(archive, skip, member.flags & FLAG_SPARSE ?
+                extentsLen(member.extents, member.extentCount) :
+                member.size);
+        }
+    }
+    if (fdclose(skip)) SYS_ERROR("close");
+    endMembers(&reader);
 
-            pid_t encodeProcess = fork();
-            if (encodeProcess < 0) SYS_DIE("fork");
-            if (encodeProcess == 0)
-            {
-                if (close(computeCRCToEncodePipe[1])) SYS_DIE("close");
-                // encode this file
-                PROGRESS("Encoding %s to %s", node, nodeLZW);
-                didEncode = encode(computeCRCToEncodePipe[0], encoded);
-                PROGRESS("Encoding %s complete", node);
+    Latest** latest = malloc(index.count * sizeof(Latest*) + 1);
+    if (!latest) DIE("%s", "Out of memory");
+    long long count = 0;
+    for (long long i = 0; i < index.slotCount; i++)
+    {
+        if (index.slots[i].name && !index.slots[i].deleted)
+            latest[count++] = index.slots + i;
+    }
+    qsort(latest, count, sizeof(Latest*), compareNamesUp);
+
+    int rootLen = root ? strlen(root) + 1 : 0;
+    long long differences = 0;
+    for (long long i = 0; i < count; i++)
+    {
+        Latest* node = latest[i];
+        int nameLen = node->nameLen;
+        bool directory = node->name[nameLen-1] == '/';
+        char path[rootLen + nameLen + NAME_MAX + 2];
+        if (root) sprintf(path, "%s/", root);
+        memcpy(path + rootLen, node->name, nameLen);
+        path[rootLen + nameLen - directory] = '\0';
+        char* name = path + rootLen;
+        progressMember(name);
+
+        char change = 0;
+        struct stat data;
+        if (lstat(path, &data))
+        {
+            if (errno != ENOENT) SYS_ERROR("lstat");
+            change = '-';
+        }
+        else if ((data.st_mode & S_IFMT) != (node->mode & S_IFMT))
+            change = 'T';
+        else if (!directory && (data.st_size != node->size ||
+            !sameContents(path, node))) change = 'M';
+        else
+        {
+            struct timespec times[2];
+            statTimes(&data, times);
+            if (data.st_mode != node->mode ||
+                !sameTime(times[1], node->mtime)) change = 'm';
+        }
+        if (change)
+        {
+            printf("%c %s%s\n", change, name, directory ? "/" : "");
+            differences++;
+        }
+        if (!directory || change == '-' || change == 'T') continue;
 
-                exit(didEncode ? 0 : UNCOMPRESSABLE);
+        // what is in the directory, but not in the archive
+        DIR* dir = heldOpendir(path);
+        if (!dir)
+        {
+            SYS_ERROR("opendir");
+            continue;
+        }
+        int pathLen = strlen(path);
+        path[pathLen++] = '/';
+        struct dirent* entry;
+        while ((entry = readdir(dir)))
+        {
+            if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, ".."))
+                continue;
+            int entryLen = strlen(entry->d_name);
+            memcpy(path + pathLen, entry->d_name, entryLen + 1);
+            bool entryDirectory = entry->d_type == DT_DIR ||
+                (entry->d_type == DT_UNKNOWN && !lstat(path, &data) &&
+                S_ISDIR(data.st_mode));
+            strcpy(path + pathLen + entryLen, "/");
+            // one of the other type is listed with T
+            int entryNameLen = pathLen + entryLen - rootLen;
+            Latest* found = findLatest(&index, name, entryNameLen);
+            Latest* foundDirectory = findLatest(&index, name,
+                entryNameLen + 1);
+            path[pathLen + entryLen + entryDirectory] = '\0';
+            if ((!found->name || found->deleted) &&
+                (!foundDirectory->name || foundDirectory->deleted))
+            {
+                printf("+ %s\n", name);
+                differences++;
             }
+        }
+        if (heldClosedir(dir)) SYS_ERROR("closedir");
+    }
+    if (fflush(stdout)) SYS_ERROR("fflush");
+    free(latest);
+    freeIndex(&index);
+    if (differences) DIE("Nodes which differ from the archive: %lld",
+        differences);
+    STATUS("%s", "Comparison complete");
+}
 
-            if (close(computeCRCToEncodePipe[0])) SYS_ERROR("close");
+// == CAT MODULE ===========================================================
 
-            checksum = computeCRC(file, computeCRCToEncodePipe[1]);
-            if (close(computeCRCToEncodePipe[1])) SYS_DIE("close");
+int catNameC = 0;
+char** catNames = NULL;
+int catFd = STDOUT_FILENO;
 
-            int encodeStatus = 0;
-            if (waitpid(encodeProcess, &encodeStatus, 0) < 0)
-                SYS_DIE("waitpid");
+// writes the data of a file to fd as a channel (see openCallbackChannel()),
+// with zeros for its holes, and takes its CRC
+typedef struct {
+    int fd;
+    Extent* extents;   // where the data goes
+    long long extentCount;
+    long long index;   // extent being written
+    long long done;    // bytes of it written
+    long long written; // bytes written to fd
+    checktype message;
+    Extent whole;      // the one extent of a file without holes
+} CatOutput;
+
+static const unsigned char zeros[1 << 16];
+
+// writes zeros to fd until it has written up to end
+static void catHole(CatOutput* cat, long long end)
+{
+    while (cat->written < end)
+    {
+        long long len = end - cat->written;
+        if (len > sizeof(zeros)) len = sizeof(zeros);
+        writeBytes(cat->fd, zeros, len);
+        cat->written += len;
+    }
+}
 
-            if (STAT(encodeStatus) == UNCOMPRESSABLE) didEncode = false;
-            else if (encodeStatus) DIE("Encode status %d", STAT(encodeStatus));
+static long writeCat(void* state, const void* bytes, long len)
+{
+    CatOutput* cat = state;
+    long written = 0;
+    while (written < len)
+    {
+        if (cat->index == cat->extentCount)
+        {
+            if (written) break;
+            errno = EFBIG;
+            return -1;
+        }
+        Extent* extent = cat->extents + cat->index;
+        catHole(cat, extent->offset + cat->done);
+        long long count = extent->len - cat->done;
+        if (count > len - written) count = len - written;
+        writeBytes(cat->fd, (const unsigned char*)bytes + written, count);
+        appendBytesToMessage(&cat->message,
+            (const unsigned char*)bytes + written, count);
+        cat->done += count;
+        cat->written += count;
+        written += count;
+        if (cat->done == extent->len)
+        {
+            cat->index++;
+            cat->done = 0;
+        }
+    }
+    if (reportProgress) progressBytes(written);
+    return written;
+}
 
+// whether name is in catNames, or in a directory named there. the names it
+// comes under are marked in found, unless NULL
+static bool catNamed(char* name, int nameLen, bool* found)
+{
+    bool named = false;
+    for (int i = 0; i < catNameC; i++)
+    {
+        int len = strlen(catNames[i]);
+        while (len > 1 && catNames[i][len-1] == '/') len--;
+        if (nameUnder(name, nameLen, catNames[i], len))
+        {
+            named = true;
+            if (found) found[i] = true;
         }
+    }
+    return named;
+}
 
-        if (write(archive, &checksum, sizeof(checksum)) < sizeof(checksum))
-                SYS_DIE("write");
+// whether member is a regular file named (see catNamed())
+static bool catSelected(Member* member, bool* found)
+{
+    return S_ISREG(member->mode) && !(member->flags & FLAG_DELETED) &&
+        catNamed(member->name, member->nameLen, found);
+}
 
-        if (fclose(file)) SYS_ERROR("fclose");
-        if (close(encoded)) SYS_ERROR("close");
+// decodes the regular file member stored next in stored to out
+static void catMember(int stored, Member* member, Reference* reference,
+    int out)
+{
+    char name[member->nameLen + 1];
+    memcpy(name, member->name, member->nameLen);
+    name[member->nameLen] = '\0';
+    PROGRESS("Writing out %s", name);
+    progressMember(name);
+    double start = monotonicSeconds();
+    CatOutput cat = {out, member->extents, member->extentCount, 0, 0, 0, 0,
+        {0, member->size}};
+    if (!(member->flags & FLAG_SPARSE))
+    {
+        cat.extents = &cat.whole;
+        cat.extentCount = 1;
+    }
+    if (member->flags & FLAG_STREAM)
+    {
+        // its size is known at the end
+        cat.whole.len = LLONG_MAX;
+    }
+    int catChannel = openCallbackChannel(NULL, writeCat, &cat);
+    if (member->flags & FLAG_STREAM)
+        decodeStream(stored, member, catChannel);
+    else if (member->flags & FLAG_DELTA)
+    {
+        char* changes = NULL;
+        long changesLen = 0;
+        int changesChannel = openMemoryWriter(&changes, &changesLen);
+        decode(stored, changesChannel, member->deltaLen);
+        if (fdclose(changesChannel)) SYS_ERROR("close");
+        Latest* base = reference ? findBase(reference, member->name,
+            member->nameLen) : NULL;
+        if (!base || base->checksum != member->baseChecksum)
+            DIE("%s needs the reference archive it was stored against", name);
+        unsigned char* baseBytes = loadBase(reference, base);
+        applyDelta(baseBytes, base->size, (unsigned char*)changes,
+            changesLen, catChannel);
+        unloadBase(base, baseBytes);
+        free(changes);
+    }
+    else
+    {
+        decode(stored, catChannel, extentsLen(cat.extents,
+            cat.extentCount));
+    }
+    if (fdclose(catChannel)) SYS_ERROR("close");
+    // the holes at the end
+    catHole(&cat, member->size);
+    padMessage(&cat.message);
+    FileStats stats = {name, member->size, member->storedLen, -1,
+        monotonicSeconds() - start};
+    statsFile(&stats);
+    if (cat.message != member->checksum)
+        DIE("%s failed its Cyclic Redundancy Check", name);
+}
 
-        
-        if (didEncode)
+// whether the member name which was at stored is the latest by its name in
+// index, and not deleted since with a directory it was in. stored is any
+// number which grows along the archive
+static bool catLatest(MemberIndex* index, char* name, int nameLen,
+    long long stored)
+{
+    Latest* latest = findLatest(index, name, nameLen);
+    if (latest->stored != stored || latest->deleted) return false;
+    for (int len = nameLen - 1; len > 0; len--)
+    {
+        if (name[len-1] != '/') continue;
+        Latest* directory = findLatest(index, name, len);
+        if (directory->name && directory->deleted &&
+            directory->stored > stored) return false;
+    }
+    return true;
+}
+
+// a file selected from a stream, decoded into the spool
+typedef struct {
+    char* name;        // malloced
+    int nameLen;
+    long long seq;     // of its member, counting from the start
+    long long spooled; // where it starts in the spool
+    long long len;
+} Spooled;
+
+// decodes the regular files selected from a stream with a version
+// into a temporary file, as which of them are the latest can't be known
+// until its end, and then writes those to catFd
+static void catSpooled(MemberReader* reader, Reference* reference,
+    bool* found)
+{
+    int archive = reader->archive;
+    FILE* spoolFile = heldTmpfile();
+    if (!spoolFile) SYS_DIE("tmpfile");
+    int spool = fileno(spoolFile);
+    MemberIndex index = {NULL, 0, 0, 0, NULL};
+    long long spooledCapacity = 64;
+    long long spooledCount = 0;
+    Spooled* spooled = malloc(spooledCapacity * sizeof(Spooled));
+    if (!spooled) DIE("%s", "Out of memory");
+    int skip = openCallbackChannel(NULL, skipStored, NULL);
+    long long seq = 0;
+    Member member;
+    while (readMember(reader, &member))
+    {
+        addLatest(&index, &member);
+        findLatest(&index, member.name, member.nameLen)->stored = ++seq;
+        if (catSelected(&member, NULL))
         {
-            // write from nodeLZW to archive
-            FILE* lzw = fopen(nodeLZW, "r");
-            if (!lzw) SYS_DIE("fopen");
-            int c;
-            while ((c = fgetc(lzw)) != EOF)
+            if (spooledCount == spooledCapacity)
             {
-                fdputc(c, archive);
+                spooledCapacity *= 2;
+                spooled = realloc(spooled, spooledCapacity * sizeof(Spooled));
+                if (!spooled) DIE("%s", "Out of memory");
             }
-            if (fclose(lzw)) SYS_ERROR("close");
+            Spooled* file = spooled + spooledCount++;
+            file->name = malloc(member.nameLen);
+            if (!file->name) DIE("%s", "Out of memory");
+            memcpy(file->name, member.name, member.nameLen);
+            file->nameLen = member.nameLen;
+            file->seq = seq;
+            file->spooled = lseek(spool, 0, SEEK_CUR);
+            catMember(archive, &member, reference, spool);
+            file->len = lseek(spool, 0, SEEK_CUR) - file->spooled;
         }
-        else
+        else if (member.flags & FLAG_STREAM)
+            passStream(archive, &member, -1);
+        else if (member.name[member.nameLen-1] != '/' &&
+            !(member.flags & FLAG_DELETED) && fdcopy(archive, skip,
+            member.storedLen) < member.storedLen)
+            DIE("%s", "Unable to read member");
+        free(member.extents);
+    }
+    if (fdclose(skip)) SYS_ERROR("close");
+
+    for (long long i = 0; i < spooledCount; i++)
+    {
+        Spooled* file = spooled + i;
+        if (catLatest(&index, file->name, file->nameLen, file->seq) &&
+            catNamed(file->name, file->nameLen, found))
         {
-            fdputc(0, archive);
-            // copy from node to archive
-            FILE* f = fopen(node, "r");
-            if (!f) SYS_DIE("fopen");
-            int c;
-            while ((c = fgetc(f)) != EOF)
+            if (lseek(spool, file->spooled, SEEK_SET) < 0) SYS_DIE("lseek");
+            if (fdcopy(spool, catFd, file->len) < file->len)
+                DIE("%s", "Unable to read spool");
+        }
+        free(file->name);
+    }
+    free(spooled);
+    freeIndex(&index);
+    if (heldFclose(spoolFile)) SYS_ERROR("fclose");
+}
+
+// writes the latest version of each regular file selected (see
+// catSelected()) to catFd one after another, in the order of the archive.
+// from an archive file with a version, or a channel which can seek
+// (see openRSAReader()), only they are decoded, with the others passed
+// over, and nothing is written to disk. from a stream of one, appended to
+// or not, they are gathered in a temporary file first
+static void catArchive(int archive)
+{
+    STATUS("%s", "Writing out");
+    Reference* reference = referenceArchive >= 0 ?
+        openReference(referenceArchive) : NULL;
+    bool found[catNameC + 1];
+    memset(found, 0, sizeof(found));
+    MemberReader reader;
+    startMembers(archive, &reader);
+    // a channel can only be read from anywhere if it can seek
+    struct stat data;
+    bool seekable = isChannel(archive) ?
+        fdseek(archive, 0, SEEK_CUR) >= 0 :
+        !fstat(archive, &data) && S_ISREG(data.st_mode);
+    if (reader.version && seekable)
+    {
+        // the selected files, in order, are found first, then decoded
+        MemberIndex index = {NULL, 0, 0, 0, NULL};
+        long long jobCapacity = 64;
+        long long jobCount = 0;
+        TestJob* jobs = malloc(jobCapacity * sizeof(TestJob));
+        if (!jobs) DIE("%s", "Out of memory");
+        Member member;
+        while (readMember(&reader, &member))
+        {
+            long long stored = fdseek(archive, 0, SEEK_CUR);
+            long long storedLen = member.storedLen > 0 ? member.storedLen : 0;
+            if (stored < 0) SYS_DIE("lseek");
+            if (member.flags & FLAG_STREAM) passStream(archive, &member, -1);
+            else if (fdseek(archive, storedLen, SEEK_CUR) < 0)
+                SYS_DIE("lseek");
+            addLatest(&index, &member);
+            findLatest(&index, member.name, member.nameLen)->stored = stored;
+            if (!catSelected(&member, NULL))
             {
-                fdputc(c, archive);
+                free(member.extents);
+                continue;
+            }
+            if (jobCount == jobCapacity)
+            {
+                jobCapacity *= 2;
+                jobs = realloc(jobs, jobCapacity * sizeof(TestJob));
+                if (!jobs) DIE("%s", "Out of memory");
             }
-            if (fclose(f)) SYS_ERROR("close");
+            TestJob* job = jobs + jobCount++;
+            job->member = member;
+            job->member.name = malloc(member.nameLen + 1);
+            if (!job->member.name) DIE("%s", "Out of memory");
+            memcpy(job->member.name, member.name, member.nameLen);
+            job->member.name[member.nameLen] = '\0';
+            job->stored = stored;
         }
-        if (remove(nodeLZW)) SYS_ERROR("remove");
-        
-        if (removeOriginal && remove(node)) SYS_ERROR("remove");
+        long long end = fdseek(archive, 0, SEEK_CUR);
+        if (end != fdseek(archive, 0, SEEK_END))
+            DIE("%s", "Archive ends in the middle of a member");
+        // a channel is read where each member is, and a file mapped
+        unsigned char* map = NULL;
+        if (end && !isChannel(archive))
+        {
+            map = heldMmap(end, PROT_READ, MAP_SHARED, archive);
+            if (map == MAP_FAILED) SYS_DIE("mmap");
+        }
+        for (long long i = 0; i < jobCount; i++)
+        {
+            Member* selected = &jobs[i].member;
+            if (catLatest(&index, selected->name, selected->nameLen,
+                jobs[i].stored) && catSelected(selected, found))
+            {
+                if (map)
+                {
+                    int stored = openMemoryReader(map + jobs[i].stored,
+                        selected->storedLen);
+                    catMember(stored, selected, reference, catFd);
+                    if (fdclose(stored)) SYS_ERROR("close");
+                }
+                else if (fdseek(archive, jobs[i].stored, SEEK_SET) < 0)
+                    SYS_DIE("lseek");
+                else catMember(archive, selected, reference, catFd);
+            }
+            free(selected->name);
+            free(selected->extents);
+        }
+        if (map && heldMunmap(map, end)) SYS_ERROR("munmap");
+        free(jobs);
+        freeIndex(&index);
+    }
+    else if (reader.version) catSpooled(&reader, reference, found);
+    else
+    {
+        // an archive without a version has no versions of files to choose
+        // from
+        Member member;
+        int skip = openCallbackChannel(NULL, skipStored, NULL);
+        while (readMember(&reader, &member))
+        {
+            bool file = member.name[member.nameLen-1] != '/' &&
+                !(member.flags & FLAG_DELETED);
+            if (catSelected(&member, found))
+                catMember(archive, &member, reference, catFd);
+            else if (file)
+            {
+                decode(archive, skip, member.flags & FLAG_SPARSE ?
+                    extentsLen(member.extents, member.extentCount) :
+                    member.size);
+            }
+            free(member.extents);
+        }
+        if (fdclose(skip)) SYS_ERROR("close");
     }
+    endMembers(&reader);
+    if (reference) closeReference(reference);
+    int missing = 0;
+    for (int i = 0; i < catNameC; i++)
+    {
+        if (found[i]) continue;
+        WARN("%s is not a file in the archive, nor a directory of files",
+            catNames[i]);
+        missing++;
+    }
+    if (missing) DIE("Names which are not in the archive: %d", missing);
+    STATUS("%s", "Writing out complete");
 }
 
-/**
- * Input archive file descriptor open for writing.
- */
-void archive(int archive, char* nodeLZW, int nodeC, char** nodes)
-{
-    STATUS("%s", "Archiving");
+// == EXTRACT MODULE =======================================================
 
-    for (int i = 0; i < nodeC; i++)
-        archiveNode(archive, nodes[i], nodeLZW);
+static int removeWalked(const char* path, const struct stat* data, int type,
+    struct FTW* walk)
+{
+    if (remove(path) && errno != ENOENT) SYS_ERROR("remove");
+    return 0;
+}
 
-    PROGRESS("%s", "Archive complete");
+// removes a node extracted from an earlier segment, with all under it
+static void removeNode(char* nodeName, int nodeNameLen)
+{
+    PROGRESS("Removing deleted node %s", nodeName);
+    if (nodeName[nodeNameLen-1] != '/')
+    {
+        if (remove(nodeName) && errno != ENOENT) SYS_ERROR("remove");
+        return;
+    }
+    nodeName[nodeNameLen-1] = '\0';
+    if (nftw(nodeName, removeWalked, 16, FTW_DEPTH|FTW_PHYS) &&
+        errno != ENOENT) SYS_ERROR("nftw");
 }
 
-void extract(int archive)
+void extract(int archive, char* root)
 {
+    if (extractMode == EXTRACT_TEST)
+    {
+        testArchive(archive);
+        return;
+    }
+    if (extractMode == EXTRACT_DIFF)
+    {
+        diffArchive(archive, root);
+        return;
+    }
+    if (extractMode == EXTRACT_CAT)
+    {
+        catArchive(archive);
+        return;
+    }
     STATUS("%s", "Extracting");
 
-    int nodeNameLen;
-    int lenSize = sizeof(nodeNameLen);
-    while (rdhang(archive, &nodeNameLen, lenSize))
+    // length of the "root/" prefix on every name
+    int rootLen = root ? strlen(root) + 1 : 0;
+    Reference* reference = referenceArchive >= 0 ?
+        openReference(referenceArchive) : NULL;
+    MemberReader reader;
+    startMembers(archive, &reader);
+    Member member;
+    while (readMember(&reader, &member))
     {
-        char nodeName[nodeNameLen + 1];
-        if (!rdhang(archive, nodeName, nodeNameLen))
-            SYS_DIE("Unable to read name");
+        int nodeNameLen = member.nameLen;
+        char nodeName[rootLen + nodeNameLen + 1];
+        if (root) sprintf(nodeName, "%s/", root);
+        memcpy(nodeName + rootLen, member.name, nodeNameLen);
+        nodeNameLen += rootLen;
         nodeName[nodeNameLen] = '\0';
         PROGRESS("Extracting node %s", nodeName);
-        mode_t mode;
-        if (!rdhang(archive, &mode, sizeof(mode)))
-            SYS_DIE("Unable to read mode");
-        struct timeval times[2];
-        int timeSize = sizeof(struct timeval) * 2;
-        if (!rdhang(archive, times, timeSize))
-            SYS_DIE("Unable to read timevals");
-        u_long flags;
-        if (!rdhang(archive, &flags, sizeof(flags)))
-            SYS_DIE("Unable to read flags");
+        mode_t mode = member.mode;
+        struct timespec times[2] = {member.times[0], member.times[1]};
+        uint64_t flags = member.flags;
+        bool sparse = !!(flags & FLAG_SPARSE);
+        bool delta = !!(flags & FLAG_DELTA);
+        bool stream = !!(flags & FLAG_STREAM);
+        flags &= ~(FLAG_SPARSE|FLAG_DELTA|FLAG_STREAM);
+        if (flags & FLAG_DELETED)
+        {
+            removeNode(nodeName, nodeNameLen);
+            free(member.extents);
+            continue;
+        }
         // extract all prefix directories
         bool errorExtractingParents = false;
         for (int i=1; i < nodeNameLen; i++)
@@ -231,7 +2896,7 @@ void extract(int archive)
                 mkdir(nodeName, mode);
                 if (errno != EEXIST && errno != 0)
                 {
-                    if(!quiet) fprintf(stderr, "mkdir(%s)\n", nodeName);
+                    if(!quiet) fprintf(LOG, "mkdir(%s)\n", nodeName);
                     SYS_ERROR("mkdir");
                     errorExtractingParents = true;
                     break;
@@ -239,70 +2904,130 @@ void extract(int archive)
                 nodeName[i] = '/';
             }
         }
-        if (errorExtractingParents) continue;
+        if (errorExtractingParents)
+        {
+            free(member.extents);
+            continue;
+        }
         // done extracting prefix directories. now nodeName should be available
-        if (nodeName[nodeNameLen-1] != '/')
+        if (stream)
+        {
+            // a regular file of a size known at the end
+            int file = heldOpen(nodeName, O_WRONLY|O_CREAT|O_TRUNC, 0666);
+            if (file < 0) SYS_ERROR("open");
+            progressMember(nodeName + rootLen);
+            double decodeStart = monotonicSeconds();
+            bool check = decodeStream(archive, &member, file);
+            FileStats stats = {nodeName + rootLen, member.size,
+                member.storedLen, -1, monotonicSeconds() - decodeStart};
+            statsFile(&stats);
+            if (reportProgress) progressBytes(member.size);
+            if (file >= 0 && heldClose(file)) SYS_ERROR("close");
+            if (!check) DIE("%s", "Cyclic Redundancy Check failed");
+        }
+        else if (nodeName[nodeNameLen-1] != '/')
         {
             // directories should be already taken care of
             // this is a regular file
-            off_t size;
-            if (!rdhang(archive, &size, sizeof(size)))
-                DIE("%s", "Unable to read size");
-
-            checktype checksum;
+            off_t size = member.size;
+            // the data of a sparse file goes between its holes
+            Extent* extents = member.extents;
+            long long extentCount = member.extentCount;
+            long long dataLen = sparse ? extentsLen(extents, extentCount) :
+                size;
+            checktype checksum = member.checksum;
             bool check = false;
-            if (!rdhang(archive, &checksum, sizeof(checksum)))
-                DIE("%s", "Unable to read checksum");
 
-            FILE* file = fopen(nodeName, "w");
-            if (!file) SYS_ERROR("fopen"); // permissions error
+            int file = heldOpen(nodeName, O_RDWR|O_CREAT|O_TRUNC, 0666);
+            // permissions error. the member is still read, to get past it
+            if (file < 0) SYS_ERROR("open");
+            progressMember(nodeName + rootLen);
+            FileStats stats = {nodeName + rootLen, size, -1, -1, 0, 0,
+                statsPrunes()};
+            OutputFile output;
+            openOutput(file, size, extents, extentCount, &output);
+            // checked once it is written, when it isn't checked on the way
+            output.crc = delta || series;
+            int outputChannel = openCallbackChannel(NULL, writeOutput,
+                &output);
 
-            if (series)
+            if (delta)
+            {
+                // what changed is decoded, then laid over the base
+                double decodeStart = monotonicSeconds();
+                char* changes = NULL;
+                long changesLen = 0;
+                int changesChannel = openMemoryWriter(&changes, &changesLen);
+                decode(archive, changesChannel, member.deltaLen);
+                if (fdclose(changesChannel)) SYS_ERROR("close");
+                Latest* base = reference ? findBase(reference, member.name,
+                    member.nameLen) : NULL;
+                if (!base || base->checksum != member.baseChecksum)
+                {
+                    DIE("%s needs the reference archive it was stored "
+                        "against", nodeName);
+                }
+                unsigned char* baseBytes = loadBase(reference, base);
+                applyDelta(baseBytes, base->size, (unsigned char*)changes,
+                    changesLen, outputChannel);
+                unloadBase(base, baseBytes);
+                free(changes);
+                stats.codecSeconds = monotonicSeconds() - decodeStart;
+                double checkStart = monotonicSeconds();
+                check = checkOutput(&output, checksum);
+                stats.crcSeconds = monotonicSeconds() - checkStart;
+            }
+            else if (series)
             {
-                decode(archive, fileno(file), size);
-                if (fclose(file)) SYS_ERROR("fclose");
-                file = fopen(nodeName, "r");
-                check = checkCRC(fileno(file), NULL, checksum);
+                double decodeStart = monotonicSeconds();
+                decode(archive, outputChannel, dataLen);
+                stats.codecSeconds = monotonicSeconds() - decodeStart;
+                // checked before it is written out, unless it can't be
+                double checkStart = monotonicSeconds();
+                check = checkOutput(&output, checksum);
+                stats.crcSeconds = monotonicSeconds() - checkStart;
             }
             else
             {
-                // decode in another process, piping results to CRC check
-                int decodeToCheckPipe[2];
-                if (pipe(decodeToCheckPipe)) SYS_DIE("pipe");
+                double checkStart = monotonicSeconds();
+                // decode in another thread, passing results to CRC check
+                int decodeToCheckRing[2];
+                makeRing(decodeToCheckRing);
 
-                pid_t decodeProcess = fork();
-                if (decodeProcess < 0) SYS_DIE("fork");
-                if (decodeProcess == 0)
-                {
-                    if (close(decodeToCheckPipe[0])) SYS_DIE("close");
-                    // decode into the pipe
-                    decode(archive, decodeToCheckPipe[1], size);
-                    exit(0); // sends EOF, so check until EOF
-                }
-                
-                if (close(decodeToCheckPipe[1])) SYS_DIE("close");
-                check = checkCRC(decodeToCheckPipe[0], file, checksum);
-
-                if (close(decodeToCheckPipe[0])) SYS_ERROR("close");
-                // process is already dead, because checkCRC() finished; reap
-                int status = 0;
-                if (waitpid(decodeProcess, &status, 0) < 0)
-                if (status) DIE("Status of decodeProcess is %d", status);
+                DecodeArgs args = {archive, decodeToCheckRing[1], dataLen};
+                Stage decodeStage;
+                startStage(&decodeStage, "Decode", runDecode, &args);
+
+                check = checkCRC(decodeToCheckRing[0], outputChannel,
+                    checksum);
+                if (fdclose(decodeToCheckRing[0])) SYS_ERROR("close");
+                // includes waiting for the decoder
+                stats.crcSeconds = monotonicSeconds() - checkStart;
+
+                // thread is already done, because checkCRC() hit EOF
+                joinStage(&decodeStage);
+                stats.codecSeconds = decodeStage.wallSeconds;
             }
+            stats.prunes = statsPrunes() - stats.prunes;
+            statsFile(&stats);
+            if (fdclose(outputChannel)) SYS_ERROR("close");
+            closeOutput(&output);
+            free(extents);
 
             if (!check) DIE("%s", "Cyclic Redundancy Check failed");
-
-            if (file && fclose(file)) SYS_ERROR("fclose");
             // check setattrlist(2)
         }
         if (chmod(nodeName, mode)) SYS_ERROR("chmod");
 #if MAC
         if (chflags(nodeName, flags)) SYS_ERROR("chflags");
 #endif
-        if (utimes(nodeName, times)) SYS_ERROR("utimes");
+        if (utimensat(AT_FDCWD, nodeName, times, 0))
+            SYS_ERROR("utimensat");
 
         PROGRESS("Finished extraction of node %s", nodeName);
     }
 
+    endMembers(&reader);
+    if (reference) closeReference(reference);
     STATUS("%s", "Extraction complete");
 }
@@ -2,14 +2,85 @@
  * Archive multiple files and directories into a single files
  * Extract from a file of the same format back
  *
- * Archiving is done recursively, so be wary of archiving very deep directories
+ * Directories are walked before what is in them, keeping each directory
+ * being walked open, so very deep directories can run out of descriptors
+ * Except in series mode, the walk runs ahead in another thread, and the
+ * loader (see loader.h) opens and reads the files before they are archived
+ * Files with holes are stored as their data and where it goes, and extracted
+ * with the same holes
+ * Each node is stored after a header of the same layout on every host,
+ * written in one piece, of variable-length numbers and only the end of its
+ * name which differs from the node before. Archives with no version at
+ * their start, from before these headers, are still extracted
+ * With a compression cache (see cache.h), files unchanged since they were
+ * cached are stored as they were then, without being read
+ * An archive appended to (see appendArchive()) is a series of segments, each
+ * with the nodes new or changed since the one before, and a deletion marker
+ * for each node gone since. Extracting applies them in order
+ * With a reference archive, a large file the reference has is stored as the
+ * changes since its version there (see delta.h), and is rebuilt from it
+ * A file read from a pipe is stored in chunks as it comes, with its size and
+ * checksum after them, and is extracted as a regular file
  */
 
+// an archive with a version, not encrypted, open for reading, which
+// archive() stores large files against and extract() rebuilds them from
+// (--reference), or -1 for none. taken when archiving or extracting starts
+extern int referenceArchive;
+
+// the name of a regular file archived after the nodes, of what archive()
+// reads from standard input until EOF (--stdin), or NULL for none. taken
+// when archiving starts
+extern char* streamName;
+
+// a descriptor to read more nodes from after nodes, each ended by a NUL, as
+// find -print0 writes them, or -1 for none (--files-from). it is read as
+// the walk comes to it, and a directory in it is archived without what is
+// in it, which the list names if it wants. taken when archiving starts
+extern int listFd;
+
 // input file descriptor for writing to archive
 // archives each node into the file in encoded format
+// relative nodes are found in root, or the working directory if NULL,
+// but are named in the archive as given
 // temporary storage of encoded file goes in nodeLZW
-// which must be openable for writing
-void archive(int archive, char* nodeLZW, int nodeC, char** nodes);
+// which must be openable for writing, or NULL to keep it in memory
+void archive(int archive, char* root, char* nodeLZW, int nodeC, char** nodes);
+
+// input file descriptor for reading an archive of this version from
+// previous, and for writing to archive
+// like archive(), but adds a segment to what previous holds, of only the
+// nodes whose type, mode, mtime (to the nanosecond), size or checksum has
+// changed, and marks the nodes under nodes which are gone as deleted. the
+// members in previous are copied through to archive as they are, unless
+// archive is previous, when the new segment is written at its end. previous
+// may be empty
+void appendArchive(int archive, int previous, char* root, char* nodeLZW,
+    int nodeC, char** nodes);
+
+// bytes of the regular files archive() would read, for --status-fd
+// nodes it cannot read count for nothing, as do those in listFd
+long long archiveBytes(char* root, int nodeC, char** nodes);
+
+// what extract() does with an archive (-t, -f and -o). taken when it
+// starts
+#define EXTRACT_FILES (0)
+// decodes and checks every file, writing nothing, and dies if any fail
+#define EXTRACT_TEST (1)
+// lists on standard output how the nodes under root differ from those in
+// the archive, by type, size, checksum, mode and mtime, and dies if any do
+#define EXTRACT_DIFF (2)
+// writes the regular files named in catNames, and those in the directories
+// named there, one after another to catFd, and nothing to disk. dies if a
+// name has no files
+#define EXTRACT_CAT (3)
+extern int extractMode;
+// names as archived, of catNameC
+extern int catNameC;
+extern char** catNames;
+// standard output unless set
+extern int catFd;
 
 // input file descriptor for reading from archive
-void extract(int archive);
+// paths in the archive are relative to root, or the working directory if NULL
+void extract(int archive, char* root);
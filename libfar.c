@@ -0,0 +1,624 @@
+#define _GNU_SOURCE
+#include "libfar.h"
+#include "encrypt.h"
+#include "channel.h"
+#include "stats.h"
+#include "far.h"
+#include "lzw.h"
+#ifdef ENCRYPT
+#include "rsa.h"
+#endif
+#include <stdlib.h>
+#include <stdarg.h>
+#include <setjmp.h>
+#include <pthread.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <dirent.h>
+
+// quiet mode
+__thread bool quiet = false;
+// verbose mode
+__thread bool verbose = false;
+// remove original files (listed files on encrypt, archive on decrypt)
+__thread bool removeOriginal = false;
+// execute parts in sequence, without extra threads
+__thread bool series = false;
+// index the encrypted stream so it can be decrypted from any block
+__thread bool seekable = false;
+// drop the pages of archived files from the page cache
+__thread bool dropCache = false;
+// reports go here instead of stderr
+__thread FILE* logFile = NULL;
+
+void saveOptions(Options* options)
+{
+    options->quiet = quiet;
+    options->verbose = verbose;
+    options->removeOriginal = removeOriginal;
+    options->series = series;
+    options->seekable = seekable;
+    options->dropCache = dropCache;
+    options->logFile = logFile;
+}
+
+void loadOptions(Options* options)
+{
+    quiet = options->quiet;
+    verbose = options->verbose;
+    removeOriginal = options->removeOriginal;
+    series = options->series;
+    seekable = options->seekable;
+    dropCache = options->dropCache;
+    logFile = options->logFile;
+}
+
+int optionFlags(void)
+{
+    return (verbose ? FAR_VERBOSE : 0) | (quiet ? 0 : FAR_STATUS) |
+        (removeOriginal ? FAR_REMOVE_ORIGINAL : 0) |
+        (series ? FAR_SERIES : 0) | (seekable ? FAR_SEEKABLE : 0) |
+        (dropCache ? FAR_DROP_CACHE : 0);
+}
+
+#define ERROR_LEN (256)
+
+struct farContext {
+    Options options;
+    char error[ERROR_LEN];
+    bool failed;
+    pthread_mutex_t lock; // stages of one call may fail at the same time
+};
+
+// == FAILURE MODULE =======================================================
+
+// where fatal() returns to on this thread, inside a library call
+typedef struct {
+    jmp_buf jump;
+    FarContext* context;
+} FailPoint;
+
+static __thread FailPoint* failPoint = NULL;
+
+void* currentContext(void)
+{
+    return failPoint ? failPoint->context : NULL;
+}
+
+bool runInContext(void* context, void (*run)(void*), void* arg)
+{
+    if (!context)
+    {
+        run(arg);
+        return true;
+    }
+    FailPoint point;
+    point.context = context;
+    FailPoint* outer = failPoint;
+    failPoint = &point;
+    if (setjmp(point.jump))
+    {
+        failPoint = outer;
+        return false;
+    }
+    run(arg);
+    failPoint = outer;
+    return true;
+}
+
+void fatal(const char* format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    if (!failPoint)
+    {
+        vfprintf(stderr, format, args);
+        fprintf(stderr, "\n");
+        exit(EXIT_FAILURE);
+    }
+    // the first failure is the one reported
+    FarContext* context = failPoint->context;
+    pthread_mutex_lock(&context->lock);
+    if (!context->failed)
+    {
+        vsnprintf(context->error, ERROR_LEN, format, args);
+        context->failed = true;
+    }
+    pthread_mutex_unlock(&context->lock);
+    va_end(args);
+
+    // stages of this call must end before their arguments go out of scope
+    abortChannels(context);
+    joinChildStages();
+    longjmp(failPoint->jump, 1);
+}
+
+// == HELD MODULE ==========================================================
+
+// a resource held by a library call. one of fd, map, file, directory and
+// path is set
+typedef struct held {
+    int fd;         // closed, or -1
+    void* map;      // unmapped, of mapLen bytes
+    size_t mapLen;
+    FILE* file;     // closed
+    DIR* directory; // closed
+    char* path;     // removed, malloced
+    void* owner;    // the context of the call
+    struct held* next;
+} Held;
+
+// newest first, so they are released in the reverse of the order taken
+static Held* held = NULL;
+static pthread_mutex_t heldLock = PTHREAD_MUTEX_INITIALIZER;
+
+static void hold(Held resource)
+{
+    resource.owner = currentContext();
+    if (!resource.owner) return;
+    Held* entry = malloc(sizeof(Held));
+    if (!entry) DIE("%s", "Out of memory");
+    *entry = resource;
+    pthread_mutex_lock(&heldLock);
+    entry->next = held;
+    held = entry;
+    pthread_mutex_unlock(&heldLock);
+}
+
+// forgets the resource of the call like resource, without releasing it
+static void letGo(Held resource)
+{
+    void* owner = currentContext();
+    if (!owner) return;
+    pthread_mutex_lock(&heldLock);
+    for (Held** link = &held; *link; link = &(*link)->next)
+    {
+        Held* entry = *link;
+        if (entry->owner != owner || entry->fd != resource.fd ||
+            entry->map != resource.map || entry->file != resource.file ||
+            entry->directory != resource.directory ||
+            (entry->path != resource.path && (!entry->path ||
+            !resource.path || strcmp(entry->path, resource.path))))
+            continue;
+        *link = entry->next;
+        free(entry->path);
+        free(entry);
+        break;
+    }
+    pthread_mutex_unlock(&heldLock);
+}
+
+void releaseHeld(void* owner)
+{
+    pthread_mutex_lock(&heldLock);
+    Held** link = &held;
+    while (*link)
+    {
+        Held* entry = *link;
+        if (entry->owner != owner)
+        {
+            link = &entry->next;
+            continue;
+        }
+        *link = entry->next;
+        if (entry->fd >= 0) close(entry->fd);
+        if (entry->map) munmap(entry->map, entry->mapLen);
+        if (entry->file) fclose(entry->file);
+        if (entry->directory) closedir(entry->directory);
+        if (entry->path) remove(entry->path);
+        free(entry->path);
+        free(entry);
+    }
+    pthread_mutex_unlock(&heldLock);
+}
+
+int heldOpen(const char* path, int flags, mode_t mode)
+{
+    int fd = open(path, flags, mode);
+    if (fd >= 0) holdFd(fd);
+    return fd;
+}
+
+void holdFd(int fd)
+{
+    hold((Held){.fd = fd});
+}
+
+int heldClose(int fd)
+{
+    letGo((Held){.fd = fd});
+    return close(fd);
+}
+
+void* heldMmap(size_t len, int prot, int flags, int fd)
+{
+    void* map = mmap(NULL, len, prot, flags, fd, 0);
+    if (map != MAP_FAILED) hold((Held){.fd = -1, .map = map, .mapLen = len});
+    return map;
+}
+
+int heldMunmap(void* map, size_t len)
+{
+    letGo((Held){.fd = -1, .map = map});
+    return munmap(map, len);
+}
+
+FILE* heldTmpfile(void)
+{
+    FILE* file = tmpfile();
+    if (file) hold((Held){.fd = -1, .file = file});
+    return file;
+}
+
+int heldFclose(FILE* file)
+{
+    letGo((Held){.fd = -1, .file = file});
+    return fclose(file);
+}
+
+DIR* heldOpendir(const char* path)
+{
+    DIR* directory = opendir(path);
+    if (directory) hold((Held){.fd = -1, .directory = directory});
+    return directory;
+}
+
+int heldClosedir(DIR* directory)
+{
+    letGo((Held){.fd = -1, .directory = directory});
+    return closedir(directory);
+}
+
+void holdPath(const char* path)
+{
+    if (!currentContext()) return;
+    char* copy = strdup(path);
+    if (!copy) DIE("%s", "Out of memory");
+    hold((Held){.fd = -1, .path = copy});
+}
+
+void letGoPath(const char* path)
+{
+    letGo((Held){.fd = -1, .path = (char*)path});
+}
+
+// == PIPELINE MODULE ======================================================
+
+// arguments of the thread which archives into a ring
+typedef struct {
+    int archive;
+    int previous; // archive appended to, or -1
+    char* root;
+    char* archiveLZW;
+    int nodeC;
+    char** nodes;
+} ArchiveArgs;
+
+static void* runArchive(void* arg)
+{
+    ArchiveArgs* args = arg;
+    if (args->previous < 0)
+    {
+        archive(args->archive, args->root, args->archiveLZW, args->nodeC,
+            args->nodes);
+    }
+    else
+    {
+        appendArchive(args->archive, args->previous, args->root,
+            args->archiveLZW, args->nodeC, args->nodes);
+        if (fdclose(args->previous)) SYS_ERROR("close");
+    }
+    if (fdclose(args->archive)) SYS_ERROR("close");
+    return NULL;
+}
+
+// arguments of the thread which decrypts into a ring
+typedef struct {
+    char* password;
+    int inFile;
+    int outFile;
+} DecryptArgs;
+
+static void* runDecrypt(void* arg)
+{
+// definitely defined, but don't want this part to compile without decryptRSA
+#ifdef ENCRYPT
+    DecryptArgs* args = arg;
+    decryptRSA(args->password, args->inFile, args->outFile);
+    if (fdclose(args->outFile)) SYS_ERROR("close");
+#endif
+    return NULL;
+}
+
+void protectStream(char* password, int out, char* root, char* archiveLZW,
+    int nodeC, char** nodes)
+{
+    int archiveToEncryptRing[2];
+    makeRing(archiveToEncryptRing);
+
+    ArchiveArgs args = {archiveToEncryptRing[1], -1, root, archiveLZW, nodeC,
+        nodes};
+    Stage archiveStage;
+    startStage(&archiveStage, "Archive", runArchive, &args);
+
+    double encryptStart = threadCPUSeconds();
+    StatsMark encryptMark;
+    markStats(&encryptMark);
+#ifdef ENCRYPT
+    encryptRSA(password, archiveToEncryptRing[0], out);
+#endif
+    statsStage("Encrypt", &encryptMark);
+    PROGRESS("Encrypt stage used %gs of CPU",
+        threadCPUSeconds() - encryptStart);
+    if (fdclose(archiveToEncryptRing[0])) SYS_ERROR("close");
+
+    joinStage(&archiveStage);
+}
+
+void appendStream(char* oldPassword, char* password, int in, int out,
+    char* root, char* archiveLZW, int nodeC, char** nodes)
+{
+    int decryptToArchiveRing[2];
+    makeRing(decryptToArchiveRing);
+    int archiveToEncryptRing[2];
+    makeRing(archiveToEncryptRing);
+
+    DecryptArgs decryptArgs = {oldPassword, in, decryptToArchiveRing[1]};
+    Stage decryptStage;
+    startStage(&decryptStage, "Decrypt", runDecrypt, &decryptArgs);
+    ArchiveArgs archiveArgs = {archiveToEncryptRing[1],
+        decryptToArchiveRing[0], root, archiveLZW, nodeC, nodes};
+    Stage archiveStage;
+    startStage(&archiveStage, "Archive", runArchive, &archiveArgs);
+
+    double encryptStart = threadCPUSeconds();
+    StatsMark encryptMark;
+    markStats(&encryptMark);
+#ifdef ENCRYPT
+    encryptRSA(password, archiveToEncryptRing[0], out);
+#endif
+    statsStage("Encrypt", &encryptMark);
+    PROGRESS("Encrypt stage used %gs of CPU",
+        threadCPUSeconds() - encryptStart);
+    if (fdclose(archiveToEncryptRing[0])) SYS_ERROR("close");
+
+    joinStage(&archiveStage);
+    joinStage(&decryptStage);
+}
+
+void unprotectStream(char* password, int in, char* root)
+{
+    int decryptToExtractRing[2];
+    makeRing(decryptToExtractRing);
+
+    DecryptArgs args = {password, in, decryptToExtractRing[1]};
+    Stage decryptStage;
+    startStage(&decryptStage, "Decrypt", runDecrypt, &args);
+
+    double extractStart = threadCPUSeconds();
+    StatsMark extractMark;
+    markStats(&extractMark);
+    extract(decryptToExtractRing[0], root);
+    statsStage("Extract", &extractMark);
+    PROGRESS("Extract stage used %gs of CPU",
+        threadCPUSeconds() - extractStart);
+    if (fdclose(decryptToExtractRing[0])) SYS_ERROR("close");
+
+    joinStage(&decryptStage);
+}
+
+// == LIBRARY MODULE =======================================================
+
+FarContext* farNewContext(void)
+{
+    FarContext* context = calloc(1, sizeof(*context));
+    if (!context) return NULL;
+    pthread_mutex_init(&context->lock, NULL);
+    farSetFlags(context, 0);
+    return context;
+}
+
+void farFreeContext(FarContext* context)
+{
+    pthread_mutex_destroy(&context->lock);
+    free(context);
+}
+
+void farSetFlags(FarContext* context, int flags)
+{
+    context->options.verbose = !!(flags & FAR_VERBOSE);
+    context->options.quiet = !(flags & (FAR_STATUS | FAR_VERBOSE));
+    context->options.removeOriginal = !!(flags & FAR_REMOVE_ORIGINAL);
+    context->options.series = !!(flags & FAR_SERIES);
+    context->options.seekable = !!(flags & FAR_SEEKABLE);
+    context->options.dropCache = !!(flags & FAR_DROP_CACHE);
+}
+
+void farSetLog(FarContext* context, FILE* log)
+{
+    context->options.logFile = log;
+}
+
+const char* farError(FarContext* context)
+{
+    return context->failed ? context->error : NULL;
+}
+
+int farReader(long (*read)(void* state, void* bytes, long len), void* state)
+{
+    return openCallbackChannel(read, NULL, state);
+}
+
+int farWriter(long (*write)(void* state, const void* bytes, long len),
+    void* state)
+{
+    return openCallbackChannel(NULL, write, state);
+}
+
+int farMemoryReader(const void* bytes, long len)
+{
+    return openMemoryReader(bytes, len);
+}
+
+int farMemoryWriter(FarBuffer* buffer)
+{
+    return openMemoryWriter(&buffer->bytes, &buffer->len);
+}
+
+int farCloseStream(int stream)
+{
+    return fdclose(stream);
+}
+
+// arguments of every operation. each uses some of them
+typedef struct {
+    char* password;
+    int in;
+    int out;
+    long long size;
+    int* encoded;
+    int nodeC;
+    char** nodes;
+    char* root;
+} Call;
+
+// runs body(call) with the context's options and catches its failure
+static int runCall(FarContext* context, void (*body)(void*), Call* call)
+{
+    context->failed = false;
+    Options callerOptions;
+    saveOptions(&callerOptions);
+    loadOptions(&context->options);
+
+    bool finished = runInContext(context, body, call);
+    // whatever the failed call left open
+    if (!finished)
+    {
+        closeChannels(context);
+        releaseHeld(context);
+    }
+
+    loadOptions(&callerOptions);
+    return finished ? FAR_OK : FAR_ERROR;
+}
+
+static void encodeBody(void* arg)
+{
+    Call* call = arg;
+    *call->encoded = encode(call->in, call->out);
+}
+
+int farEncode(FarContext* context, int in, int out, int* encoded)
+{
+    Call call = {.in = in, .out = out, .encoded = encoded};
+    return runCall(context, encodeBody, &call);
+}
+
+static void decodeBody(void* arg)
+{
+    Call* call = arg;
+    decode(call->in, call->out, call->size);
+}
+
+int farDecode(FarContext* context, int in, int out, long long size)
+{
+    Call call = {.in = in, .out = out, .size = size};
+    return runCall(context, decodeBody, &call);
+}
+
+static void archiveBody(void* arg)
+{
+    Call* call = arg;
+    // encoded files are kept in memory instead of a temporary file
+    archive(call->out, call->root, NULL, call->nodeC, call->nodes);
+}
+
+int farArchive(FarContext* context, int out, char* root,
+    int nodeC, char** nodes)
+{
+    Call call = {.out = out, .root = root, .nodeC = nodeC, .nodes = nodes};
+    return runCall(context, archiveBody, &call);
+}
+
+static void extractBody(void* arg)
+{
+    Call* call = arg;
+    extract(call->in, call->root);
+}
+
+int farExtract(FarContext* context, int in, char* root)
+{
+    Call call = {.in = in, .root = root};
+    return runCall(context, extractBody, &call);
+}
+
+#ifndef ENCRYPT
+#define NO_ENCRYPTION() DIE("%s", "libfar was built without encryption")
+#endif
+
+static void encryptBody(void* arg)
+{
+#ifdef ENCRYPT
+    Call* call = arg;
+    encryptRSA(call->password, call->in, call->out);
+#else
+    NO_ENCRYPTION();
+#endif
+}
+
+int farEncrypt(FarContext* context, char* password, int in, int out)
+{
+    Call call = {.password = password, .in = in, .out = out};
+    return runCall(context, encryptBody, &call);
+}
+
+static void decryptBody(void* arg)
+{
+#ifdef ENCRYPT
+    Call* call = arg;
+    decryptRSA(call->password, call->in, call->out);
+#else
+    NO_ENCRYPTION();
+#endif
+}
+
+int farDecrypt(FarContext* context, char* password, int in, int out)
+{
+    Call call = {.password = password, .in = in, .out = out};
+    return runCall(context, decryptBody, &call);
+}
+
+static void protectBody(void* arg)
+{
+    Call* call = arg;
+#ifndef ENCRYPT
+    NO_ENCRYPTION();
+#endif
+    protectStream(call->password, call->out, call->root, NULL, call->nodeC,
+        call->nodes);
+}
+
+int farProtect(FarContext* context, char* password, int out, char* root,
+    int nodeC, char** nodes)
+{
+    Call call = {.password = password, .out = out, .root = root,
+        .nodeC = nodeC, .nodes = nodes};
+    return runCall(context, protectBody, &call);
+}
+
+static void unprotectBody(void* arg)
+{
+    Call* call = arg;
+#ifndef ENCRYPT
+    NO_ENCRYPTION();
+#endif
+    unprotectStream(call->password, call->in, call->root);
+}
+
+int farUnprotect(FarContext* context, char* password, int in, char* root)
+{
+    Call call = {.password = password, .in = in, .root = root};
+    return runCall(context, unprotectBody, &call);
+}
@@ -0,0 +1,100 @@
+/**
+ * libfar: archiving, LZW compression and encryption as a library
+ * Build with make libfar.a and link with it and the libraries in LIBS.
+ *
+ * Data goes in and out through streams. A stream is a file descriptor, or
+ * one of the descriptors returned by the farReader, farWriter, farMemoryReader
+ * and farMemoryWriter functions, which are only understood by this library.
+ *
+ * Every function taking a FarContext returns FAR_OK, or FAR_ERROR with the
+ * reason in farError(). A failed call closes the files and streams it
+ * opened, unmaps what it mapped and removes its temporary files, but may
+ * leak the memory it was using. Streams and descriptors passed in are left
+ * to the caller.
+ * A context must only be used by one thread at a time, but contexts on
+ * different threads are independent.
+ *
+ * Archives written here are the same as those of encrypt/decrypt (or
+ * lzwcompress/lzwdecompress for the unencrypted functions).
+ */
+
+#ifndef LIBFAR_H
+#define LIBFAR_H
+
+#include <stdio.h>
+
+#define FAR_OK (0)
+#define FAR_ERROR (-1)
+
+// flags for farSetFlags, same as the encrypt options in encrypt.h
+#define FAR_VERBOSE (1<<0)         // -v. progress reports to stderr
+#define FAR_STATUS (1<<1)          // not -q. status reports to stderr
+#define FAR_REMOVE_ORIGINAL (1<<2) // -r
+#define FAR_SERIES (1<<3)          // -s. no threads
+#define FAR_SEEKABLE (1<<4)        // -x
+#define FAR_DROP_CACHE (1<<5)      // -d
+
+typedef struct farContext FarContext;
+
+// NULL if out of memory. flags start at 0, so nothing is printed
+FarContext* farNewContext(void);
+void farFreeContext(FarContext* context);
+
+void farSetFlags(FarContext* context, int flags);
+
+// reports allowed by the flags go to log, or stderr if NULL (the default)
+void farSetLog(FarContext* context, FILE* log);
+
+// message explaining the last FAR_ERROR, or NULL
+const char* farError(FarContext* context);
+
+// == STREAMS ==============================================================
+
+// read and write have the contract of read(2) and write(2)
+int farReader(long (*read)(void* state, void* bytes, long len), void* state);
+int farWriter(long (*write)(void* state, const void* bytes, long len),
+    void* state);
+
+// reads the len bytes at bytes, which must stay valid until it is closed
+int farMemoryReader(const void* bytes, long len);
+
+// collects what is written in buffer
+// start with {NULL, 0}. the caller frees bytes
+typedef struct {
+    char* bytes;
+    long len;
+} FarBuffer;
+int farMemoryWriter(FarBuffer* buffer);
+
+// closes a stream from above or a file descriptor
+int farCloseStream(int stream);
+
+// == OPERATIONS ===========================================================
+
+// LZW encodes in into out. *encoded says whether it got smaller; if not, the
+// output should not be used
+int farEncode(FarContext* context, int in, int out, int* encoded);
+
+// inverse of farEncode. size is the number of bytes encoded
+int farDecode(FarContext* context, int in, int out, long long size);
+
+// archives and compresses the files and directories at the nodeC paths
+// relative paths are found in the directory root (NULL for the working one)
+// and named in the archive as given
+int farArchive(FarContext* context, int out, char* root,
+    int nodeC, char** nodes);
+
+// extracts an archive into the directory root (NULL for the working one)
+int farExtract(FarContext* context, int in, char* root);
+
+// encrypts or decrypts a stream with a password (NULL for the default)
+// the password is zeroed
+int farEncrypt(FarContext* context, char* password, int in, int out);
+int farDecrypt(FarContext* context, char* password, int in, int out);
+
+// archive then encrypt, and decrypt then extract, as parallel stages
+int farProtect(FarContext* context, char* password, int out, char* root,
+    int nodeC, char** nodes);
+int farUnprotect(FarContext* context, char* password, int in, char* root);
+
+#endif
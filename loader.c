@@ -0,0 +1,563 @@
+#define _GNU_SOURCE
+#include "loader.h"
+#include "encrypt.h"
+#include "channel.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#if !MAC
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+
+// io_uring through its system calls, since liburing may not be installed
+#if !MAC && defined(__NR_io_uring_setup)
+#define URING 1
+#else
+#define URING 0
+#endif
+
+long long readaheadBytes = READAHEAD_BYTES;
+
+enum { QUEUED, LOADING, DONE };
+
+typedef struct {
+    Loaded loaded;
+    int state;
+    long long ahead;   // of the readahead, read or advised for this file
+#if URING
+    int pending;       // of the open and the stat
+    long long done;    // bytes read
+    struct statx data; // written by the kernel
+#endif
+} LoadItem;
+
+#if URING
+// what the loader's thread shares with the kernel
+typedef struct {
+    int fd;
+    unsigned char* sqRing;
+    size_t sqRingSize;
+    unsigned char* cqRing;
+    size_t cqRingSize;
+    struct io_uring_sqe* sqes;
+    size_t sqesSize;
+    unsigned* sqTail;
+    unsigned* sqArray;
+    unsigned sqMask;
+    unsigned sqLocalTail; // entries filled, published on entering
+    unsigned* cqHead;
+    unsigned* cqTail;
+    unsigned cqMask;
+    struct io_uring_cqe* cqes;
+    unsigned toSubmit;
+    int inFlight;         // operations submitted and not completed
+} Uring;
+
+// what a completion was, in the low bits of its user_data
+enum { OPEN_OP, STATX_OP, READ_OP, FADVISE_OP };
+#define OP_MASK (3)
+#endif
+
+struct loader {
+    LoadItem items[LOADER_DEPTH]; // in the order requested, from first
+    int first;
+    int count;                    // requested and not read
+    long long readLimit;
+    long long readahead;          // readaheadBytes, when made
+    long long ahead;              // of it, taken by items
+    // taken for everything above, by the ends and the loading threads
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    bool writerClosed;
+    bool readerClosed;
+    bool aborted;
+    atomic_int ends;              // freed when both are closed
+    Stage stages[LOADER_THREADS];
+    int stageCount;
+#if URING
+    bool useUring;
+    Uring ring;
+#endif
+};
+
+static bool stopping(struct loader* loader)
+{
+    return loader->aborted || loader->readerClosed;
+}
+
+// with the lock. takes up to len bytes of the readahead for item, and
+// returns how many. whole takes all len or nothing
+static long long takeReadahead(struct loader* loader, LoadItem* item,
+    long long len, bool whole)
+{
+    long long room = loader->readahead - loader->ahead;
+    if (len > room) len = whole || room < 0 ? 0 : room;
+    item->ahead = len;
+    loader->ahead += len;
+    return len;
+}
+
+// == THREAD POOL MODULE ===================================================
+
+// opens and reads the file of item with system calls, without the lock
+static void loadItem(struct loader* loader, LoadItem* item)
+{
+    Loaded* loaded = &item->loaded;
+    loaded->fd = heldOpen(loaded->path, O_RDONLY, 0);
+    if (loaded->fd < 0)
+    {
+        loaded->error = errno;
+        return;
+    }
+    struct stat data;
+    if (fstat(loaded->fd, &data)) return;
+    loaded->size = data.st_size;
+    if (!S_ISREG(data.st_mode) || !loaded->size) return;
+    bool whole = loaded->size < loader->readLimit;
+    pthread_mutex_lock(&loader->lock);
+    long long ahead = takeReadahead(loader, item, loaded->size, whole);
+    pthread_mutex_unlock(&loader->lock);
+    if (!ahead) return;
+    if (!whole)
+    {
+#if !MAC
+        // the archiver maps it, and finds the start of it in the page cache
+        posix_fadvise(loaded->fd, 0, ahead, POSIX_FADV_WILLNEED);
+#endif
+        return;
+    }
+    loaded->bytes = malloc(loaded->size);
+    for (long long done = 0; loaded->bytes && done < loaded->size;)
+    {
+        ssize_t readLen = pread(loaded->fd, loaded->bytes + done,
+            loaded->size - done, done);
+        if (readLen < 0 && errno == EINTR) continue;
+        if (readLen <= 0)
+        {
+            // the archiver reads it again, and finds out what went wrong
+            free(loaded->bytes);
+            loaded->bytes = NULL;
+            break;
+        }
+        done += readLen;
+    }
+}
+
+// each thread takes the first file nobody is loading
+static void* runLoadThread(void* arg)
+{
+    struct loader* loader = arg;
+    pthread_mutex_lock(&loader->lock);
+    while (!stopping(loader))
+    {
+        LoadItem* item = NULL;
+        for (int i = 0; i < loader->count && !item; i++)
+        {
+            LoadItem* next = loader->items + (loader->first + i) %
+                LOADER_DEPTH;
+            if (next->state == QUEUED) item = next;
+        }
+        if (!item)
+        {
+            if (loader->writerClosed) break;
+            pthread_cond_wait(&loader->changed, &loader->lock);
+            continue;
+        }
+        item->state = LOADING;
+        pthread_mutex_unlock(&loader->lock);
+        loadItem(loader, item);
+        pthread_mutex_lock(&loader->lock);
+        item->state = DONE;
+        pthread_cond_broadcast(&loader->changed);
+    }
+    pthread_mutex_unlock(&loader->lock);
+    return NULL;
+}
+
+// == IO_URING MODULE ======================================================
+
+#if URING
+static void unmapUring(Uring* ring)
+{
+    if (ring->sqRing != MAP_FAILED) munmap(ring->sqRing, ring->sqRingSize);
+    if (ring->cqRing != MAP_FAILED) munmap(ring->cqRing, ring->cqRingSize);
+    if (ring->sqes != MAP_FAILED) munmap(ring->sqes, ring->sqesSize);
+    if (close(ring->fd)) SYS_ERROR("close io_uring");
+}
+
+// returns false if this kernel can't give io_uring with opens and stats
+static bool setupUring(Uring* ring, unsigned entries)
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (ring->fd < 0) return false;
+    ring->sqRing = ring->cqRing = MAP_FAILED;
+    ring->sqes = MAP_FAILED;
+    // reads at the current position came in the same kernel as the opens,
+    // stats and reads this needs
+    if (!(params.features & IORING_FEAT_RW_CUR_POS))
+    {
+        unmapUring(ring);
+        return false;
+    }
+
+    ring->sqRingSize = params.sq_off.array +
+        params.sq_entries * sizeof(unsigned);
+    ring->cqRingSize = params.cq_off.cqes +
+        params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqRing = mmap(NULL, ring->sqRingSize, PROT_READ|PROT_WRITE,
+        MAP_SHARED|MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    ring->cqRing = mmap(NULL, ring->cqRingSize, PROT_READ|PROT_WRITE,
+        MAP_SHARED|MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+    ring->sqes = mmap(NULL, ring->sqesSize, PROT_READ|PROT_WRITE,
+        MAP_SHARED|MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqRing == MAP_FAILED || ring->cqRing == MAP_FAILED ||
+        ring->sqes == MAP_FAILED)
+    {
+        unmapUring(ring);
+        return false;
+    }
+
+    ring->sqTail = (unsigned*)(ring->sqRing + params.sq_off.tail);
+    ring->sqArray = (unsigned*)(ring->sqRing + params.sq_off.array);
+    ring->sqMask = *(unsigned*)(ring->sqRing + params.sq_off.ring_mask);
+    ring->sqLocalTail = *ring->sqTail;
+    ring->cqHead = (unsigned*)(ring->cqRing + params.cq_off.head);
+    ring->cqTail = (unsigned*)(ring->cqRing + params.cq_off.tail);
+    ring->cqMask = *(unsigned*)(ring->cqRing + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)(ring->cqRing + params.cq_off.cqes);
+    ring->toSubmit = 0;
+    ring->inFlight = 0;
+    return true;
+}
+
+// there is always room: each file has at most two operations in flight
+static struct io_uring_sqe* nextSqe(Uring* ring, LoadItem* item, int op)
+{
+    unsigned index = ring->sqLocalTail++ & ring->sqMask;
+    struct io_uring_sqe* sqe = ring->sqes + index;
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->user_data = (uintptr_t)item | op;
+    ring->sqArray[index] = index;
+    ring->toSubmit++;
+    ring->inFlight++;
+    return sqe;
+}
+
+// submits what was queued and waits for a completion if wait is set
+static void enterUring(Uring* ring, bool wait)
+{
+    atomic_store_explicit((atomic_uint*)ring->sqTail, ring->sqLocalTail,
+        memory_order_release);
+    do
+    {
+        long submitted = syscall(__NR_io_uring_enter, ring->fd,
+            ring->toSubmit, wait ? 1 : 0, wait ? IORING_ENTER_GETEVENTS : 0,
+            NULL, 0);
+        if (submitted < 0 && errno != EINTR && errno != EAGAIN &&
+            errno != EBUSY) SYS_DIE("io_uring_enter");
+        if (submitted > 0) ring->toSubmit -= submitted;
+    } while (ring->toSubmit);
+}
+
+// the open and the stat go together, so the path is looked up at once
+static void startItem(Uring* ring, LoadItem* item)
+{
+    item->state = LOADING;
+    item->pending = 2;
+    struct io_uring_sqe* sqe = nextSqe(ring, item, OPEN_OP);
+    sqe->opcode = IORING_OP_OPENAT;
+    sqe->fd = AT_FDCWD;
+    sqe->addr = (uintptr_t)item->loaded.path;
+    sqe->open_flags = O_RDONLY;
+
+    sqe = nextSqe(ring, item, STATX_OP);
+    sqe->opcode = IORING_OP_STATX;
+    sqe->fd = AT_FDCWD;
+    sqe->addr = (uintptr_t)item->loaded.path;
+    sqe->len = STATX_TYPE|STATX_MODE|STATX_SIZE;
+    sqe->off = (uintptr_t)&item->data;
+    sqe->statx_flags = AT_SYMLINK_NOFOLLOW;
+}
+
+static void adviseItem(Uring* ring, LoadItem* item)
+{
+    struct io_uring_sqe* sqe = nextSqe(ring, item, FADVISE_OP);
+    sqe->opcode = IORING_OP_FADVISE;
+    sqe->fd = item->loaded.fd;
+    sqe->len = item->ahead < UINT_MAX ? item->ahead : UINT_MAX;
+    sqe->fadvise_advice = POSIX_FADV_WILLNEED;
+}
+
+static void readItem(Uring* ring, LoadItem* item)
+{
+    struct io_uring_sqe* sqe = nextSqe(ring, item, READ_OP);
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = item->loaded.fd;
+    sqe->addr = (uintptr_t)(item->loaded.bytes + item->done);
+    sqe->len = item->loaded.size - item->done;
+    sqe->off = item->done;
+}
+
+// with the lock
+static void completeItem(struct loader* loader, LoadItem* item, int op,
+    int result)
+{
+    Loaded* loaded = &item->loaded;
+    if (op == FADVISE_OP)
+    {
+        item->state = DONE;
+        return;
+    }
+    if (op == READ_OP)
+    {
+        if (result > 0) item->done += result;
+        bool retry = result == -EINTR || result == -EAGAIN;
+        if ((retry || (result > 0 && item->done < loaded->size)) &&
+            !stopping(loader))
+        {
+            readItem(&loader->ring, item);
+            return;
+        }
+        if (item->done < loaded->size)
+        {
+            // the archiver reads it again, and finds out what went wrong
+            free(loaded->bytes);
+            loaded->bytes = NULL;
+        }
+        item->state = DONE;
+        return;
+    }
+
+    if (op == OPEN_OP && result < 0) loaded->error = -result;
+    else if (op == OPEN_OP) holdFd(loaded->fd = result);
+    else if (!result && S_ISREG(item->data.stx_mode))
+        loaded->size = item->data.stx_size;
+    if (--item->pending) return;
+
+    item->state = DONE;
+    if (loaded->fd < 0 || loaded->size <= 0 || stopping(loader)) return;
+    bool whole = loaded->size < loader->readLimit;
+    if (!takeReadahead(loader, item, loaded->size, whole)) return;
+    item->state = LOADING;
+    // the archiver maps a larger one, and finds the start of it in the
+    // page cache
+    if (!whole) adviseItem(&loader->ring, item);
+    else if ((loaded->bytes = malloc(loaded->size)))
+    {
+        item->done = 0;
+        readItem(&loader->ring, item);
+    }
+    else item->state = DONE;
+}
+
+// with the lock
+static void reapUring(struct loader* loader)
+{
+    Uring* ring = &loader->ring;
+    unsigned head = *ring->cqHead;
+    unsigned tail = atomic_load_explicit((atomic_uint*)ring->cqTail,
+        memory_order_acquire);
+    for (; head != tail; head++)
+    {
+        struct io_uring_cqe* cqe = ring->cqes + (head & ring->cqMask);
+        LoadItem* item = (LoadItem*)(uintptr_t)(cqe->user_data & ~OP_MASK);
+        ring->inFlight--;
+        completeItem(loader, item, cqe->user_data & OP_MASK, cqe->res);
+    }
+    atomic_store_explicit((atomic_uint*)ring->cqHead, head,
+        memory_order_release);
+}
+
+// one thread keeps every requested file in flight
+static void* runUring(void* arg)
+{
+    struct loader* loader = arg;
+    Uring* ring = &loader->ring;
+    pthread_mutex_lock(&loader->lock);
+    while (true)
+    {
+        for (int i = 0; i < loader->count && !stopping(loader); i++)
+        {
+            LoadItem* item = loader->items + (loader->first + i) %
+                LOADER_DEPTH;
+            if (item->state == QUEUED) startItem(ring, item);
+        }
+        // operations in flight are waited for, even when stopping, since
+        // the kernel writes into the items
+        if (!ring->inFlight)
+        {
+            if (stopping(loader) || loader->writerClosed) break;
+            pthread_cond_wait(&loader->changed, &loader->lock);
+            continue;
+        }
+        pthread_mutex_unlock(&loader->lock);
+        enterUring(ring, true);
+        pthread_mutex_lock(&loader->lock);
+        reapUring(loader);
+        pthread_cond_broadcast(&loader->changed);
+    }
+    pthread_mutex_unlock(&loader->lock);
+    return NULL;
+}
+#endif
+
+// == CHANNEL MODULE =======================================================
+
+static long writeRequest(void* state, const void* bytes, long len)
+{
+    struct loader* loader = state;
+    if (len != sizeof(LoadRequest))
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    const LoadRequest* request = bytes;
+    pthread_mutex_lock(&loader->lock);
+    while (loader->count == LOADER_DEPTH && !stopping(loader))
+        pthread_cond_wait(&loader->changed, &loader->lock);
+    if (stopping(loader))
+    {
+        pthread_mutex_unlock(&loader->lock);
+        errno = EPIPE;
+        return -1;
+    }
+    LoadItem* item = loader->items + (loader->first + loader->count++) %
+        LOADER_DEPTH;
+    memset(item, 0, sizeof(*item));
+    item->loaded = (Loaded){request->path, request->tag, -1, 0, -1, NULL};
+    item->state = request->path ? QUEUED : DONE;
+    pthread_cond_broadcast(&loader->changed);
+    pthread_mutex_unlock(&loader->lock);
+    return len;
+}
+
+static long readLoaded(void* state, void* bytes, long len)
+{
+    struct loader* loader = state;
+    if (len < sizeof(Loaded))
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    pthread_mutex_lock(&loader->lock);
+    while (!loader->aborted && (loader->count ? loader->items[
+        loader->first].state != DONE : !loader->writerClosed))
+    {
+        pthread_cond_wait(&loader->changed, &loader->lock);
+    }
+    if (loader->aborted || !loader->count)
+    {
+        pthread_mutex_unlock(&loader->lock);
+        return 0;
+    }
+    memcpy(bytes, &loader->items[loader->first].loaded, sizeof(Loaded));
+    loader->ahead -= loader->items[loader->first].ahead;
+    loader->first = (loader->first + 1) % LOADER_DEPTH;
+    loader->count--;
+    pthread_cond_broadcast(&loader->changed);
+    pthread_mutex_unlock(&loader->lock);
+    return sizeof(Loaded);
+}
+
+static int releaseLoader(struct loader* loader)
+{
+    if (atomic_fetch_sub(&loader->ends, 1) > 1) return 0;
+    // what was loaded and never read
+    for (int i = 0; i < loader->count; i++)
+    {
+        Loaded* loaded = &loader->items[(loader->first + i) %
+            LOADER_DEPTH].loaded;
+        if (loaded->fd >= 0) heldClose(loaded->fd);
+        free(loaded->bytes);
+    }
+#if URING
+    if (loader->useUring) unmapUring(&loader->ring);
+#endif
+    pthread_mutex_destroy(&loader->lock);
+    pthread_cond_destroy(&loader->changed);
+    free(loader);
+    return 0;
+}
+
+static void wakeLoader(struct loader* loader)
+{
+    pthread_cond_broadcast(&loader->changed);
+    pthread_mutex_unlock(&loader->lock);
+}
+
+static int closeRequests(void* state)
+{
+    struct loader* loader = state;
+    pthread_mutex_lock(&loader->lock);
+    loader->writerClosed = true;
+    wakeLoader(loader);
+    return releaseLoader(loader);
+}
+
+static int closeLoaded(void* state)
+{
+    struct loader* loader = state;
+    pthread_mutex_lock(&loader->lock);
+    loader->readerClosed = true;
+    wakeLoader(loader);
+    // a failed call joins the threads itself, on failing
+    for (int i = 0; i < loader->stageCount; i++)
+    {
+        if (isChildStage(loader->stages + i)) joinStage(loader->stages + i);
+    }
+    return releaseLoader(loader);
+}
+
+static void abortLoader(void* state)
+{
+    struct loader* loader = state;
+    pthread_mutex_lock(&loader->lock);
+    loader->aborted = true;
+    wakeLoader(loader);
+}
+
+void makeLoader(int fds[2], long long readLimit)
+{
+    struct loader* loader = calloc(1, sizeof(*loader));
+    if (!loader) DIE("%s", "Out of memory");
+    loader->readLimit = readLimit;
+    loader->readahead = readaheadBytes;
+    atomic_init(&loader->ends, 2);
+    pthread_mutex_init(&loader->lock, NULL);
+    pthread_cond_init(&loader->changed, NULL);
+    fds[0] = openHookedChannel(readLoaded, NULL, closeLoaded, abortLoader,
+        loader);
+    fds[1] = openHookedChannel(NULL, writeRequest, closeRequests,
+        abortLoader, loader);
+
+#if URING
+    // two entries for each file, for its open and its stat
+    loader->useUring = setupUring(&loader->ring, 2 * LOADER_DEPTH);
+    if (loader->useUring)
+    {
+        PROGRESS("%s", "Loading files with io_uring");
+        startStage(loader->stages, "Load", runUring, loader);
+        loader->stageCount = 1;
+        return;
+    }
+#endif
+    PROGRESS("Loading files with %d threads", LOADER_THREADS);
+    for (; loader->stageCount < LOADER_THREADS; loader->stageCount++)
+    {
+        startStage(loader->stages + loader->stageCount, "Load",
+            runLoadThread, loader);
+    }
+}
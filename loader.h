@@ -0,0 +1,55 @@
+/**
+ * The loader opens and reads the files archive() will come to next, while it
+ * is still encoding the ones before them. It keeps up to LOADER_DEPTH files
+ * in flight, so the archiver finds each one open, with its size and, if it
+ * is small, its bytes, instead of waiting on storage for every file.
+ *
+ * It is a pair of channels (see channel.h): LoadRequests are written to one
+ * end in the order the files are wanted, and a Loaded for each is read from
+ * the other in the same order. Where the kernel has io_uring, one thread
+ * keeps the opens, stats, reads and advice in flight with it. Elsewhere, or
+ * where io_uring is not allowed, LOADER_THREADS threads do them with system
+ * calls. How far ahead it reads is bounded by readaheadBytes.
+ */
+
+#ifndef LOADER_H
+#define LOADER_H
+
+#include "bitcode.h"
+
+// files requested but not yet read from the loader
+#define LOADER_DEPTH (32)
+// threads loading without io_uring
+#define LOADER_THREADS (4)
+// default for readaheadBytes
+#define READAHEAD_BYTES (64 << 20)
+
+// how much of the files waiting to be read from a loader it reads ahead,
+// or has the kernel read ahead, in bytes (--readahead). a file under the
+// read limit is read only if it fits whole. of a larger one, the kernel is
+// told what fits will be needed (POSIX_FADV_WILLNEED). with 0, the files are
+// only opened. taken when a loader is made
+extern long long readaheadBytes;
+
+// written whole, one at a time
+typedef struct {
+    char* path; // file to load, or NULL to pass tag along in order
+    void* tag;  // anything, passed along with the file
+} LoadRequest;
+
+// read whole, one at a time
+typedef struct {
+    char* path;           // of the request
+    void* tag;            // of the request
+    int fd;               // path open for reading, or -1
+    int error;            // errno of the failed open, or 0
+    long long size;       // of the open file, or -1 if unknown
+    unsigned char* bytes; // all size bytes, malloced, or NULL if not read
+} Loaded;
+
+// like makeRing(): fds[0] reads Loadeds and fds[1] writes LoadRequests
+// regular files of fewer than readLimit bytes are read whole
+// the reading end must be closed by the thread which made the loader
+void makeLoader(int fds[2], long long readLimit);
+
+#endif
@@ -7,6 +7,8 @@
 #include "bitcode.h"
 #include "lzw.h"
 #include "encrypt.h"
+#include "stats.h"
+#include "trace.h"
 #include <sys/stat.h>
 
 #define INITIAL_NUM_BITS 9
@@ -60,6 +62,7 @@ char popStack(CharStack stack)
 // codes can be assigned sequentially, after the single characters
 HashTable pruneTable(Array array)
 {
+    TRACE_BEGIN("prune");
     HashTable table = makeTable();
     int mapping[array->count+1]; // mapping[i]=j where old code i is new code j
     mapping[EMPTY] = EMPTY; // EMPTY is still the same
@@ -82,6 +85,8 @@ HashTable pruneTable(Array array)
     }
     PROGRESS("LZW table pruned, %d of %d codes remain",
         table->count, array->count);
+    statsPrune();
+    TRACE_END("prune");
     return table;
 }
 
@@ -116,6 +121,7 @@ int minBitsToRepresent(int code)
 bool encode(int inFile, int outFile)
 {
     PROGRESS("%s", "Begin encode");
+    TRACE_BEGIN("encode");
 
     BitCache cache = {0, 0};
 
@@ -196,6 +202,7 @@ bool encode(int inFile, int outFile)
     unsigned long long bytesWritten = bitsWritten / CHAR_BIT
     + !!(bitsWritten % CHAR_BIT);
     flushBits(outFile, &cache);
+    TRACE_END("encode");
 
     freeTable(table);
 
@@ -219,7 +226,7 @@ bool encode(int inFile, int outFile)
 #define ARRAYPREF(C) (table->elements[(C)-1].PREF)
 #define ARRAYCHAR(C) (table->elements[(C)-1].CHAR)
 
-void decode(int inFile, int outFile, int bytesToWrite)
+static void decodeCodes(int inFile, int outFile, int bytesToWrite)
 {
     BitCache cache = {0, 0};
     int compressed = getBits(COMPRESSED_PREFIX_SIZE, inFile, &cache);
@@ -227,17 +234,10 @@ void decode(int inFile, int outFile, int bytesToWrite)
     if (!compressed)
     {
         PROGRESS("%s", "Archive is not encoded");
-        int c;
-        int bytesWritten = 0;
-
         if (bytesToWrite == 0) return; // make sure to test with empty files
 
-        while ((c = fdgetc(inFile)) != EOF)
-        {
-            fdputc(c, outFile);
-            bytesWritten++;
-            if (bytesToWrite > 0 && bytesWritten >= bytesToWrite) return;
-        }
+        // stored as is, so copied without going through getBits()
+        fdcopy(inFile, outFile, bytesToWrite > 0 ? bytesToWrite : -1);
         return;
     }
     if (compressed != COMPRESSED_PREFIX)
@@ -354,3 +354,9 @@ void decode(int inFile, int outFile, int bytesToWrite)
         bytesWrittenDouble, writeUnits);
 }
 
+void decode(int inFile, int outFile, int bytesToWrite)
+{
+    TRACE_BEGIN("decode");
+    decodeCodes(inFile, outFile, bytesToWrite);
+    TRACE_END("decode");
+}
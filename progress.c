@@ -0,0 +1,165 @@
+#define _GNU_SOURCE
+#include "progress.h"
+#include "encrypt.h"
+#include "stats.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/stat.h>
+
+bool reportProgress = false;
+
+static FILE* status;
+static long long total;
+static atomic_llong done;
+// archive whose position is the progress, or -1
+static int source = -1;
+static double start;
+// the member is set by whichever thread is archiving or extracting
+static pthread_mutex_t memberLock = PTHREAD_MUTEX_INITIALIZER;
+static char* member = NULL;
+static atomic_bool stopping;
+static pthread_t reporter;
+static sigset_t dumpSignal;
+
+// bytesPerSecond is for the interval since the last periodic report
+static double lastTime;
+static long long lastDone;
+static double bytesPerSecond;
+
+static long long progressDone(void)
+{
+    if (source >= 0)
+    {
+        // keeps the last position in case source has been closed
+        off_t position = lseek(source, 0, SEEK_CUR);
+        if (position >= 0) atomic_store(&done, position);
+    }
+    return atomic_load(&done);
+}
+
+static void report(bool periodic, bool finished)
+{
+    double now = monotonicSeconds();
+    long long current = progressDone();
+    if (periodic && now > lastTime)
+    {
+        bytesPerSecond = (current - lastDone) / (now - lastTime);
+        lastTime = now;
+        lastDone = current;
+    }
+    double elapsed = now - start;
+
+    fprintf(status, "{\"done\": %lld, \"total\": ", current);
+    if (total >= 0)
+    {
+        fprintf(status, "%lld, \"percent\": %.1f", total,
+            total ? 100.0 * current / total : 100.0);
+    }
+    else fprintf(status, "null, \"percent\": null");
+    fprintf(status, ", \"bytesPerSecond\": %.1f, \"elapsedSeconds\": %.1f, "
+        "\"etaSeconds\": ", bytesPerSecond, elapsed);
+    if (finished) fprintf(status, "0");
+    else if (total >= 0 && current > 0)
+        fprintf(status, "%.1f", (total - current) * elapsed / current);
+    else fprintf(status, "null");
+    fprintf(status, ", \"member\": ");
+    pthread_mutex_lock(&memberLock);
+    if (member) writeJSONString(status, member);
+    else fprintf(status, "null");
+    pthread_mutex_unlock(&memberLock);
+    if (finished) fprintf(status, ", \"finished\": true");
+    fprintf(status, "}\n");
+    fflush(status);
+}
+
+// SIGUSR1 is blocked everywhere, and taken here between reports
+static void* runReporter(void* arg)
+{
+    struct timespec interval = {PROGRESS_INTERVAL, 0};
+    double next = monotonicSeconds() + PROGRESS_INTERVAL;
+    while (!atomic_load(&stopping))
+    {
+        int caught = sigtimedwait(&dumpSignal, NULL, &interval);
+        if (caught < 0 && errno != EAGAIN && errno != EINTR)
+            SYS_DIE("sigtimedwait");
+        // stopProgress() sends SIGUSR1 too
+        if (atomic_load(&stopping)) break;
+        if (caught == SIGUSR1) report(false, false);
+
+        double now = monotonicSeconds();
+        if (now >= next)
+        {
+            report(true, false);
+            next = now + PROGRESS_INTERVAL;
+        }
+        double left = next - now;
+        interval.tv_sec = left;
+        interval.tv_nsec = (left - interval.tv_sec) * 1e9;
+    }
+    return NULL;
+}
+
+void startProgress(int fd, long long totalBytes)
+{
+    int copy = dup(fd);
+    if (copy < 0 || !(status = fdopen(copy, "w"))) SYS_DIE("status fd");
+    total = totalBytes;
+    start = lastTime = monotonicSeconds();
+    reportProgress = true;
+
+    sigemptyset(&dumpSignal);
+    sigaddset(&dumpSignal, SIGUSR1);
+    int error = pthread_sigmask(SIG_BLOCK, &dumpSignal, NULL);
+    if (!error) error = pthread_create(&reporter, NULL, runReporter, NULL);
+    if (error)
+    {
+        errno = error;
+        SYS_DIE("start progress");
+    }
+}
+
+void progressSource(int fd)
+{
+    if (!reportProgress) return;
+    struct stat data;
+    if (fstat(fd, &data) || !S_ISREG(data.st_mode)) return;
+    if (lseek(fd, 0, SEEK_CUR) < 0) return;
+    source = fd;
+    total = data.st_size;
+}
+
+void progressBytes(long long count)
+{
+    atomic_fetch_add(&done, count);
+}
+
+void progressMember(char* name)
+{
+    if (!reportProgress) return;
+    char* copy = name ? strdup(name) : NULL;
+    pthread_mutex_lock(&memberLock);
+    free(member);
+    member = copy;
+    pthread_mutex_unlock(&memberLock);
+}
+
+void stopProgress(void)
+{
+    if (!reportProgress) return;
+    atomic_store(&stopping, true);
+    pthread_kill(reporter, SIGUSR1);
+    pthread_join(reporter, NULL);
+    // the whole archive was read
+    if (source >= 0) atomic_store(&done, total);
+    source = -1;
+    progressMember(NULL);
+    report(true, true);
+    if (fclose(status)) SYS_ERROR("fclose status");
+    reportProgress = false;
+}
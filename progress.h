@@ -0,0 +1,53 @@
+/**
+ * Live progress for --status-fd: a thread writes a line of JSON to the
+ * status descriptor every PROGRESS_INTERVAL seconds and whenever the process
+ * gets SIGUSR1, then a last line with "finished": true, such as
+ *
+ * {"done": 1048576, "total": 4194304, "percent": 25.0,
+ *  "bytesPerSecond": 524288.0, "elapsedSeconds": 2.0, "etaSeconds": 6.0,
+ *  "member": "dir/file"}
+ *
+ * (on one line). bytesPerSecond is over the last interval, etaSeconds comes
+ * from the average since the start. total and etaSeconds are null when
+ * unknown. Nothing is reported unless reportProgress is set.
+ *
+ * When archiving, total is the size of the files, from scanning them
+ * beforehand, and done counts the bytes of those archived so far. The holes
+ * of sparse files, and files passed over as unchanged or taken from the
+ * cache, count as done once they are reached. When extracting from a seekable
+ * archive, they are the position in the archive and its size. Otherwise
+ * done counts the bytes extracted and total is unknown. In series mode, this
+ * is the progress of the pass which reads the files or the archive.
+ */
+
+#ifndef PROGRESS_H
+#define PROGRESS_H
+
+#include "bitcode.h"
+
+// seconds between reports
+#define PROGRESS_INTERVAL (1)
+// bytes counted before progressBytes() is called
+#define PROGRESS_CHUNK (1 << 16)
+
+extern bool reportProgress;
+
+// sets reportProgress and starts reporting to fd
+// total is in bytes, or -1 if unknown
+// SIGUSR1 is blocked on the calling thread and the threads it starts later
+void startProgress(int fd, long long total);
+
+// measures progress as the position of fd instead, with its size as total,
+// if it is a regular file. does nothing unless reportProgress is set
+void progressSource(int fd);
+
+// bytes done since the last call
+void progressBytes(long long count);
+
+// the file being worked on, copied. NULL for none
+void progressMember(char* member);
+
+// writes the last report and stops the reporting thread
+void stopProgress(void);
+
+#endif
@@ -5,9 +5,12 @@
 #include <gmp.h>
 #include <limits.h>
 #include <string.h>
+#include <errno.h>
 #include <openssl/sha.h>
 #include <sys/stat.h>
 #include "bitcode.h"
+#include "channel.h"
+#include "trace.h"
 #include <sys/types.h>
 #include <sys/uio.h>
 #include <unistd.h>
@@ -29,7 +32,7 @@
 // (not that it matters since the hash value is easily attainable anyway)
 bool arraysAreEqual(unsigned char* one, unsigned char* two, int n)
 {
-    unsigned char diff;
+    unsigned char diff = 0;
     for (int i = 0; i < n; i++)
     {
         diff |= one[i] ^ two[i];
@@ -183,6 +186,7 @@ void checkPassword(char* password, unsigned char* hash, mpz_t n, mpz_t d)
 void checkPassword(char* password, unsigned char* hash, gmp_randstate_t prng)
 #endif
 {
+    TRACE_BEGIN("checkPassword");
     bool useDefault = !password;
     if (useDefault) password = DEFAULT_PASSWORD;
     // password is null-terminated
@@ -220,6 +224,7 @@ void checkPassword(char* password, unsigned char* hash, gmp_randstate_t prng)
 #else
     seedPRNG(passwordHash, prng);
 #endif
+    TRACE_END("checkPassword");
     /*
     fprintf(stderr, "n: ");
     mpz_out_str(stderr, 10, n);
@@ -240,6 +245,7 @@ void hashPassword(char* password, unsigned char* hash, gmp_randstate_t prng)
 #endif
 {
     PROGRESS("%s", "Generating password hash");
+    TRACE_BEGIN("hashPassword");
     bool useDefault = !password;
     if (useDefault) password = DEFAULT_PASSWORD;
     int passwordLength = strlen(password);
@@ -276,6 +282,7 @@ void hashPassword(char* password, unsigned char* hash, gmp_randstate_t prng)
 #else
     seedPRNG(hash + SALT_LEN, prng);
 #endif
+    TRACE_END("hashPassword");
 }
 
 // reads from file one byte at a time until message is > goal. returns the last
@@ -349,17 +356,62 @@ void generateOTP(gmp_randstate_t prng, mpz_t otp, unsigned int numBits)
     //PROGRESS("Generating One-time Pad with %u bits", numBits);
 }
 
+void encipherChunk(gmp_randstate_t prng, int inFile, mpz_t c, int* readLen,
+    bool* reachedEOF)
+{
+    *readLen = 0;
+    mpz_t m;
+    makeMessage(m, inFile, MAX_MESSAGE_BYTES, readLen, reachedEOF);
+    mpz_init(c);
+    mpz_t otp;
+    generateOTP(prng, otp, *readLen * CHAR_BIT);
+    //unsigned int otpLen = mpz_sizeinbase(otp, 2);
+    //unsigned int mLen = mpz_sizeinbase(m, 2);
+    mpz_xor(c, m, otp);
+    mpz_clear(otp);
+    mpz_clear(m);
+}
+
 #endif
 
-// if this is too big it basically becomes non-parallel execution
-// and maybe the PRNG becomes really slow?
-#define MAX_MESSAGE_BYTES (500)
+// seekable streams: see rsa.h for the layout
+// record lengths are never negative, so markers can't be confused with them
+#define SEEKABLE_MARKER (-2)
+#define INDEX_MARKER (-1)
+// chunks per keystream block. each block has one index entry
+#define INDEX_BLOCK_CHUNKS (128)
+#define INDEX_MAGIC "FARINDEX"
+#define INDEX_MAGIC_LEN (8)
+
+typedef struct {
+    long long plainOffset;  // offset into the decrypted stream
+    long long cipherOffset; // offset into the encrypted stream
+} IndexEntry;
+
+#ifndef ACTUALLY_RSA
+
+// reseeds prng for keystream block number block of a seekable stream
+// digest is the DIGEST_LENGTH hash of the salted password
+void seedBlockPRNG(unsigned char* digest, long long block,
+    gmp_randstate_t prng)
+{
+    unsigned char blockSeed[DIGEST_LENGTH + sizeof(block)];
+    memcpy(blockSeed, digest, DIGEST_LENGTH);
+    memcpy(blockSeed + DIGEST_LENGTH, &block, sizeof(block));
+    unsigned char blockHash[DIGEST_LENGTH];
+    SHA512(blockSeed, sizeof(blockSeed), blockHash);
+    gmp_randclear(prng);
+    seedPRNG(blockHash, prng);
+}
+
+#endif
 
 // c = m^e mod n will convert message m into ciphertext c
 void encryptRSA(char* password, int inFile, int outFile)
 {
     //PROGRESS("Encrypting from %s to %s", inputName, outputName);
     STATUS("%s", "Encrypting");
+    TRACE_BEGIN("encrypt");
     
     unsigned char hash[HASH_LEN];
 #ifdef ACTUALLY_RSA
@@ -371,10 +423,25 @@ void encryptRSA(char* password, int inFile, int outFile)
 #else
     gmp_randstate_t prng;
     hashPassword(password, hash, prng);
-    int maxBytes = MAX_MESSAGE_BYTES;
 #endif
-    if (write(outFile, hash, HASH_LEN) < HASH_LEN) SYS_DIE("write");
-    int totalWritten = HASH_LEN;
+    if (fdwrite(outFile, hash, HASH_LEN) < HASH_LEN) SYS_DIE("write");
+    long long totalWritten = HASH_LEN;
+
+    // index of keystream blocks, written after the last chunk
+    IndexEntry* index = NULL;
+    long long indexCount = 0;
+    long long indexCapacity = 0;
+    long long chunk = 0;
+    if (seekable)
+    {
+#ifdef ACTUALLY_RSA
+        DIE("%s", "Seekable streams require one-time pad encryption");
+#endif
+        int marker = SEEKABLE_MARKER;
+        if (fdwrite(outFile, &marker, sizeof(marker))<sizeof(marker))
+            SYS_DIE("write");
+        totalWritten += sizeof(marker);
+    }
 
     /*
     mpz_t n;
@@ -386,46 +453,44 @@ void encryptRSA(char* password, int inFile, int outFile)
     if (E_SIZE > 1) DIE("e is too big: %d > 1", E_SIZE);
 */
     //PROGRESS_PART("Fetch/Encrypt/Write Progress: ");
-    int partialProgress = 0;
+    long long partialProgress = 0;
     bool reachedEOF = false;
     while (!reachedEOF)
     {
+#ifndef ACTUALLY_RSA
+        if (seekable && chunk % INDEX_BLOCK_CHUNKS == 0)
+        {
+            if (indexCount == indexCapacity)
+            {
+                indexCapacity = indexCapacity ? indexCapacity * 2 : 64;
+                index = realloc(index, indexCapacity * sizeof(IndexEntry));
+            }
+            index[indexCount].plainOffset = partialProgress;
+            index[indexCount].cipherOffset = totalWritten;
+            seedBlockPRNG(hash + SALT_LEN, indexCount++, prng);
+        }
+#endif
+        chunk++;
         int readLen = 0;
+        //PROGRESS("%s", "Encrypting message");
+        mpz_t c;
+#ifdef ACTUALLY_RSA
         //PROGRESS("%s", "Fetching message");
         mpz_t m;
         makeMessage(m, inFile, maxBytes, &readLen, &reachedEOF);
-
-        //PROGRESS("%s", "Encrypting message");
         //printDigits("to encrypt", m);
-        mpz_t c;
-#ifdef ACTUALLY_RSA
         modularExponential(c, m, e, n);
+        mpz_clear(m);
 #else
-        unsigned int numBits = readLen * CHAR_BIT;
-        mpz_init(c);
-        mpz_t otp;
-        generateOTP(prng, otp, numBits);
-        //unsigned int otpLen = mpz_sizeinbase(otp, 2);
-        //unsigned int mLen = mpz_sizeinbase(m, 2);
-        mpz_xor(c, m, otp);
-        mpz_clear(otp);
+        encipherChunk(prng, inFile, c, &readLen, &reachedEOF);
 #endif
-/*
-        fprintf(stdout, "message is ");
-        mpz_out_str(stdout, 10, m);
-        fprintf(stdout, "\nciphertext is ");
-        mpz_out_str(stdout, 10, c);
-        fprintf(stdout, "\n");
-        fflush(stdout);
-*/
-        mpz_clear(m);
         int writeLen = mpz_sizeinbase(c, 2) / CHAR_BIT + 1;
         //PROGRESS("%s", "Writing encrypted message");
         //int writeLen = c.n;
-        if (write(outFile, &writeLen, sizeof(writeLen))<sizeof(writeLen))
+        if (fdwrite(outFile, &writeLen, sizeof(writeLen))<sizeof(writeLen))
             SYS_DIE("write");
         totalWritten += sizeof(writeLen);
-        if (write(outFile, &readLen, sizeof(readLen))<sizeof(readLen))
+        if (fdwrite(outFile, &readLen, sizeof(readLen))<sizeof(readLen))
             SYS_DIE("write");
         totalWritten += sizeof(readLen);
         unsigned char dig;
@@ -435,18 +500,40 @@ void encryptRSA(char* password, int inFile, int outFile)
         {
             mpz_tdiv_qr_ui(c, digitBig, c, 1<<CHAR_BIT);
             dig = mpz_get_ui(digitBig);
-            if (write(outFile, &dig, sizeof(dig))<sizeof(dig)) SYS_DIE("write");
+            if (fdwrite(outFile, &dig, sizeof(dig))<sizeof(dig))
+                SYS_DIE("write");
         }
         mpz_clear(digitBig);
         totalWritten += sizeof(dig)*writeLen;
         partialProgress += readLen;
         mpz_clear(c);
     }
+    if (seekable)
+    {
+        // trailer: marker, entries, then where to find them
+        int marker = INDEX_MARKER;
+        if (fdwrite(outFile, &marker, sizeof(marker))<sizeof(marker))
+            SYS_DIE("write");
+        long long indexOffset = totalWritten + sizeof(marker);
+        long long indexSize = sizeof(IndexEntry) * indexCount;
+        if (fdwrite(outFile, index, indexSize) < indexSize) SYS_DIE("write");
+        if (fdwrite(outFile, &indexCount, sizeof(indexCount))
+            < sizeof(indexCount)) SYS_DIE("write");
+        if (fdwrite(outFile, &indexOffset, sizeof(indexOffset))
+            < sizeof(indexOffset)) SYS_DIE("write");
+        if (fdwrite(outFile, INDEX_MAGIC, INDEX_MAGIC_LEN) < INDEX_MAGIC_LEN)
+            SYS_DIE("write");
+        totalWritten = indexOffset + indexSize + sizeof(indexCount)
+            + sizeof(indexOffset) + INDEX_MAGIC_LEN;
+        PROGRESS("Wrote index of %lld blocks", indexCount);
+        free(index);
+    }
 #ifdef ACTUALLY_RSA
     mpz_clear(n);
 #else
     gmp_randclear(prng);
 #endif
+    TRACE_END("encrypt");
     double bytesWrittenDouble = totalWritten;
     double bytesReadDouble = partialProgress;
     char* writeUnits = byteCount(&bytesWrittenDouble);
@@ -455,10 +542,60 @@ void encryptRSA(char* password, int inFile, int outFile)
         bytesWrittenDouble, writeUnits);
 }
 
+// reads a ciphertext of cipherLen bytes into c (uninitialized)
+// least significant byte comes first
+void readCiphertext(mpz_t c, int inFile, int cipherLen)
+{
+    mpz_t base, charInBase;
+    mpz_init_set_ui(c, 0);
+    mpz_init_set_ui(base, 1);
+    mpz_init(charInBase);
+
+    for (int i = 0; i < cipherLen; i++)
+    {
+        int character;
+        if ((character = fdgetc(inFile)) == EOF)
+        {
+            DIE("%s", "corrupt");
+        }
+        mpz_mul_ui(charInBase, base, character);
+
+        mpz_mul_ui(base, base, 1<<CHAR_BIT);
+        // add this character
+        mpz_add(c, c, charInBase);
+    }
+
+    mpz_clear(charInBase);
+    mpz_clear(base);
+}
+
+// writes the plainLen bytes of message m, least significant byte first
+// the first skip bytes are dropped, and at most limit bytes are written
+// (limit < 0 for no limit). returns the number of bytes written
+long long writePlaintext(mpz_t m, int outFile, int plainLen, int skip,
+    long long limit)
+{
+    long long written = 0;
+    mpz_t character;
+    mpz_init(character);
+    for (int i = 0; i < plainLen; i++)
+    {
+        if (limit >= 0 && written >= limit) break;
+        mpz_tdiv_qr_ui(m, character, m, 1<<CHAR_BIT);
+        if (i < skip) continue;
+        unsigned char byte = mpz_get_ui(character);
+        fdputc(byte, outFile);
+        written++;
+    }
+    mpz_clear(character);
+    return written;
+}
+
 // m = c^d mod n will convert ciphertext c into message m
 void decryptRSA(char* password, int inFile, int outFile)
 {
     STATUS("%s", "Decrypting");
+    TRACE_BEGIN("decrypt");
 
     unsigned char hash[HASH_LEN];
     if (!rdhang(inFile, hash, HASH_LEN)) DIE("%s", "EOF at start");
@@ -469,39 +606,43 @@ void decryptRSA(char* password, int inFile, int outFile)
     gmp_randstate_t prng;
     checkPassword(password, hash, prng);
 #endif
-    int partialProgress = HASH_LEN;
-    int bytesWritten = 0;
+    long long partialProgress = HASH_LEN;
+    long long bytesWritten = 0;
+    bool seekableStream = false;
+    long long chunk = 0;
     //int lastPercent = -1;
     int readLen;
     while (rdhang(inFile, &readLen, sizeof(readLen)))
     {
         partialProgress += sizeof(readLen);
+        if (readLen == SEEKABLE_MARKER && partialProgress == HASH_LEN +
+            sizeof(readLen))
+        {
+            seekableStream = true;
+            continue;
+        }
+        if (readLen == INDEX_MARKER)
+        {
+            // the rest is the index, which isn't needed reading in order
+            char discard[BUFSIZ];
+            int discarded;
+            while ((discarded = rdhangPartial(inFile, discard, BUFSIZ)) > 0)
+                partialProgress += discarded;
+            break;
+        }
+        if (readLen < 0) DIE("%s", "corrupt");
+#ifndef ACTUALLY_RSA
+        if (seekableStream && chunk % INDEX_BLOCK_CHUNKS == 0)
+            seedBlockPRNG(hash + SALT_LEN, chunk / INDEX_BLOCK_CHUNKS, prng);
+#endif
+        chunk++;
         //PROGRESS("%s", "Fetching ciphertext");
         int writeLen;
         if (!rdhang(inFile, &writeLen, sizeof(writeLen)))
             DIE("%s","corrupt");
         partialProgress += sizeof(writeLen);
-        mpz_t c, base, charInBase;
-        mpz_init_set_ui(c, 0);
-        mpz_init_set_ui(base, 1);
-        mpz_init(charInBase);
-        
-        for (int i = 0; i < readLen; i++)
-        {
-            int character;
-            if ((character = fdgetc(inFile)) == EOF)
-            {
-                DIE("%s", "corrupt");
-            }
-            mpz_mul_ui(charInBase, base, character);
-
-            mpz_mul_ui(base, base, 1<<CHAR_BIT);
-            // add this character
-            mpz_add(c, c, charInBase);
-        }
-        
-        mpz_clear(charInBase);
-        mpz_clear(base);
+        mpz_t c;
+        readCiphertext(c, inFile, readLen);
         partialProgress += readLen;
         //PROGRESS("%s", "Decrypting cyphertext");
         mpz_t m;
@@ -515,29 +656,12 @@ void decryptRSA(char* password, int inFile, int outFile)
         mpz_xor(m, c, otp);
         mpz_clear(otp);
 #endif
-/*
-        fprintf(stdout, "message is ");
-        mpz_out_str(stdout, 10, m);
-        fprintf(stdout, "\nciphertext is ");
-        mpz_out_str(stdout, 10, c);
-        fprintf(stdout, "\n");
-        fflush(stdout);
-*/
         mpz_clear(c);
 
         //printDigits("decrypted", m);
         //PROGRESS("%s", "Writing decrypted message");
-        mpz_t character;
-        mpz_init(character);
-        for (int i = 0; i < writeLen; i++)
-        {
-            mpz_tdiv_qr_ui(m, character, m, 1<<CHAR_BIT);
-            unsigned char byte = mpz_get_ui(character);
-            fdputc(byte, outFile);
-        }
-        mpz_clear(character);
+        bytesWritten += writePlaintext(m, outFile, writeLen, 0, -1);
         mpz_clear(m);
-        bytesWritten += writeLen;
     }
 #ifdef ACTUALLY_RSA
     mpz_clear(n);
@@ -545,6 +669,7 @@ void decryptRSA(char* password, int inFile, int outFile)
 #else
     gmp_randclear(prng);
 #endif
+    TRACE_END("decrypt");
     double bytesWrittenDouble = bytesWritten;
     double bytesReadDouble = partialProgress;
     char* writeUnits = byteCount(&bytesWrittenDouble);
@@ -553,3 +678,166 @@ void decryptRSA(char* password, int inFile, int outFile)
         bytesWrittenDouble, writeUnits);
 }
 
+#ifndef ACTUALLY_RSA
+
+typedef struct {
+    int inFile;
+    unsigned char hash[HASH_LEN];
+    gmp_randstate_t prng;
+    IndexEntry* index;
+    long long indexCount;
+    long long length;   // of the plaintext
+    long long position; // in the plaintext
+    long long block;    // decrypted into bytes, or -1
+    char* bytes;
+    long bytesLen;
+} RSAReader;
+
+// decrypts block number block of reader's stream into its bytes
+static void decryptBlock(RSAReader* reader, long long block)
+{
+    PROGRESS("Decrypting block %lld", block);
+    int inFile = reader->inFile;
+    if (lseek(inFile, reader->index[block].cipherOffset, SEEK_SET) < 0)
+        SYS_DIE("lseek");
+    seedBlockPRNG(reader->hash + SALT_LEN, block, reader->prng);
+    reader->bytesLen = 0;
+    int out = openMemoryWriter(&reader->bytes, &reader->bytesLen);
+    int readLen;
+    for (int chunk = 0; chunk < INDEX_BLOCK_CHUNKS &&
+        rdhang(inFile, &readLen, sizeof(readLen)); chunk++)
+    {
+        if (readLen == INDEX_MARKER) break;
+        if (readLen < 0) DIE("%s", "corrupt");
+        int writeLen;
+        if (!rdhang(inFile, &writeLen, sizeof(writeLen)))
+            DIE("%s","corrupt");
+        mpz_t c;
+        readCiphertext(c, inFile, readLen);
+        mpz_t m;
+        mpz_init(m);
+        mpz_t otp;
+        generateOTP(reader->prng, otp, writeLen * CHAR_BIT);
+        mpz_xor(m, c, otp);
+        mpz_clear(otp);
+        mpz_clear(c);
+        writePlaintext(m, out, writeLen, 0, -1);
+        mpz_clear(m);
+    }
+    if (fdclose(out)) SYS_ERROR("close");
+    reader->block = block;
+}
+
+static long readRSA(void* state, void* bytes, long len)
+{
+    RSAReader* reader = state;
+    if (reader->position >= reader->length) return 0;
+    // last block which starts at or before position
+    long long low = 0;
+    long long high = reader->indexCount - 1;
+    while (low < high)
+    {
+        long long mid = (low + high + 1) / 2;
+        if (reader->index[mid].plainOffset <= reader->position) low = mid;
+        else high = mid - 1;
+    }
+    if (reader->block != low) decryptBlock(reader, low);
+    long long offset = reader->position - reader->index[low].plainOffset;
+    if (offset >= reader->bytesLen) DIE("%s", "corrupt index");
+    if (len > reader->bytesLen - offset) len = reader->bytesLen - offset;
+    memcpy(bytes, reader->bytes + offset, len);
+    reader->position += len;
+    return len;
+}
+
+static long long seekRSA(void* state, long long offset, int whence)
+{
+    RSAReader* reader = state;
+    if (whence == SEEK_CUR) offset += reader->position;
+    else if (whence == SEEK_END) offset += reader->length;
+    else if (whence != SEEK_SET) offset = -1;
+    if (offset < 0)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    reader->position = offset;
+    return offset;
+}
+
+static int closeRSA(void* state)
+{
+    RSAReader* reader = state;
+    gmp_randclear(reader->prng);
+    free(reader->index);
+    free(reader->bytes);
+    free(reader);
+    return 0;
+}
+
+#endif
+
+// the index is found from the footer, and the length of the plaintext from
+// the lengths of the chunks in the last block, so only the blocks read from
+// are decrypted
+int openRSAReader(char* password, int inFile)
+{
+#ifdef ACTUALLY_RSA
+    return -1;
+#else
+    // a seekable stream says so after the hash, and where its index is at the
+    // end. anything else is read from the start by decryptRSA()
+    RSAReader* reader = calloc(1, sizeof(RSAReader));
+    if (!reader) DIE("%s", "Out of memory");
+    int marker = 0;
+    long long indexOffset = 0;
+    char magic[INDEX_MAGIC_LEN];
+    int footerSize = sizeof(reader->indexCount) + sizeof(indexOffset)
+        + INDEX_MAGIC_LEN;
+    bool indexed = lseek(inFile, 0, SEEK_SET) == 0 &&
+        rdhangPartial(inFile, reader->hash, HASH_LEN) == HASH_LEN &&
+        rdhangPartial(inFile, &marker, sizeof(marker)) == sizeof(marker) &&
+        marker == SEEKABLE_MARKER &&
+        lseek(inFile, -footerSize, SEEK_END) >= 0 &&
+        rdhang(inFile, &reader->indexCount, sizeof(reader->indexCount)) &&
+        rdhang(inFile, &indexOffset, sizeof(indexOffset)) &&
+        rdhang(inFile, magic, INDEX_MAGIC_LEN) &&
+        !memcmp(magic, INDEX_MAGIC, INDEX_MAGIC_LEN) &&
+        reader->indexCount > 0;
+    if (!indexed)
+    {
+        free(reader);
+        if (lseek(inFile, 0, SEEK_SET) < 0 && errno != ESPIPE)
+            SYS_DIE("lseek");
+        return -1;
+    }
+    STATUS("%s", "Decrypting from the index");
+
+    long long indexCount = reader->indexCount;
+    reader->inFile = inFile;
+    reader->block = -1;
+    reader->index = calloc(indexCount, sizeof(IndexEntry));
+    if (!reader->index) DIE("%s", "Out of memory");
+    if (lseek(inFile, indexOffset, SEEK_SET) < 0) SYS_DIE("lseek");
+    if (!rdhang(inFile, reader->index, indexCount * sizeof(IndexEntry)))
+        DIE("%s", "corrupt index");
+
+    // the lengths of chunks aren't encrypted
+    IndexEntry* last = reader->index + indexCount - 1;
+    reader->length = last->plainOffset;
+    if (lseek(inFile, last->cipherOffset, SEEK_SET) < 0) SYS_DIE("lseek");
+    int readLen;
+    while (rdhang(inFile, &readLen, sizeof(readLen)) &&
+        readLen != INDEX_MARKER)
+    {
+        int writeLen;
+        if (readLen < 0 || !rdhang(inFile, &writeLen, sizeof(writeLen)))
+            DIE("%s", "corrupt");
+        reader->length += writeLen;
+        if (lseek(inFile, readLen, SEEK_CUR) < 0) SYS_DIE("lseek");
+    }
+
+    checkPassword(password, reader->hash, reader->prng);
+    return openSeekableChannel(readRSA, seekRSA, closeRSA, reader);
+#endif
+}
@@ -6,6 +6,14 @@
 #ifndef RSA
 #define RSA
 
+#include "bitcode.h"
+#include <gmp.h>
+
+// plaintext bytes in a chunk of encryptRSA()
+// if this is too big it basically becomes non-parallel execution
+// and maybe the PRNG becomes really slow?
+#define MAX_MESSAGE_BYTES (500)
+
 // password will be zeroed ASAP. password NULL is DEFAULT_PASSWORD (not zeroed)
 
 // reads from file descriptor inFile, writes to file descriptor outFile
@@ -13,6 +21,34 @@
 void encryptRSA(char* password, int inFile, int outFile);
 
 // removes inputName file, overwrites outputName file
+// reads seekable streams as well, ignoring their index
 void decryptRSA(char* password, int inFile, int outFile);
 
+// Seekable streams (encryptRSA when seekable is set) have the layout
+//     hash, SEEKABLE_MARKER, chunks..., INDEX_MARKER, index entries,
+//     entry count, offset of the first entry, "FARINDEX"
+// The keystream is reseeded every INDEX_BLOCK_CHUNKS chunks from the password
+// hash and the block number, and each block has an index entry mapping its
+// plaintext offset to the offset of its first chunk.
+
+// the cipher of encryptRSA() on its own, for timing it (see bench/bench.c)
+// without hashing a password or writing ciphertext. only with the one-time
+// pad, which rsa.c uses unless ACTUALLY_RSA is defined
+
+// seeds prng (uninitialized) from the SHA512_DIGEST_LENGTH bytes at hash
+void seedPRNG(unsigned char* hash, gmp_randstate_t prng);
+
+// reads the next chunk of up to MAX_MESSAGE_BYTES from inFile and sets c
+// (uninitialized) to its ciphertext under the keystream of prng. sets
+// *readLen to the bytes read, and *reachedEOF once inFile is done
+void encipherChunk(gmp_randstate_t prng, int inFile, mpz_t c, int* readLen,
+    bool* reachedEOF);
+
+// opens a channel (see channel.h) reading the plaintext of a seekable
+// stream, which fdseek() can move around in. a block is only decrypted once
+// something in it is read. inFile must stay open and able to lseek until the
+// channel is closed. returns -1, with the password untouched and inFile back
+// at its start, if inFile isn't a seekable stream with an index
+int openRSAReader(char* password, int inFile);
+
 #endif
\ No newline at end of file
@@ -0,0 +1,186 @@
+#define _GNU_SOURCE
+#include "stats.h"
+#include "encrypt.h"
+#include "channel.h"
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+bool collectStats = false;
+
+__thread IOCounts ioCounts;
+
+// every run of a stage with the same name, such as the Encode of each file
+typedef struct {
+    char* name;
+    int runs;
+    double wallSeconds;
+    double cpuSeconds;
+    IOCounts io;
+} StageStats;
+
+// stages and files finish on different threads
+static pthread_mutex_t statsLock = PTHREAD_MUTEX_INITIALIZER;
+static StageStats* stages = NULL;
+static int stageCount = 0;
+static int stageCapacity = 0;
+static FileStats* files = NULL;
+static int fileCount = 0;
+static int fileCapacity = 0;
+static atomic_long prunes;
+static double runStart;
+
+double monotonicSeconds(void)
+{
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+void startStats(void)
+{
+    collectStats = true;
+    runStart = monotonicSeconds();
+}
+
+void markStats(StatsMark* mark)
+{
+    if (!collectStats) return;
+    mark->wallSeconds = monotonicSeconds();
+    mark->cpuSeconds = threadCPUSeconds();
+    mark->io = ioCounts;
+}
+
+void statsStage(char* name, StatsMark* since)
+{
+    if (!collectStats) return;
+    double wall = monotonicSeconds() - since->wallSeconds;
+    double cpu = threadCPUSeconds() - since->cpuSeconds;
+
+    pthread_mutex_lock(&statsLock);
+    int i = 0;
+    while (i < stageCount && strcmp(stages[i].name, name)) i++;
+    if (i == stageCount)
+    {
+        if (stageCount == stageCapacity)
+        {
+            stageCapacity = stageCapacity ? stageCapacity * 2 : 16;
+            stages = realloc(stages, stageCapacity * sizeof(StageStats));
+        }
+        memset(stages + i, 0, sizeof(StageStats));
+        stages[i].name = name;
+        stageCount++;
+    }
+    StageStats* stage = stages + i;
+    stage->runs++;
+    stage->wallSeconds += wall;
+    stage->cpuSeconds += cpu;
+    stage->io.bytesRead += ioCounts.bytesRead - since->io.bytesRead;
+    stage->io.bytesWritten += ioCounts.bytesWritten - since->io.bytesWritten;
+    stage->io.readSyscalls += ioCounts.readSyscalls - since->io.readSyscalls;
+    stage->io.writeSyscalls +=
+        ioCounts.writeSyscalls - since->io.writeSyscalls;
+    pthread_mutex_unlock(&statsLock);
+}
+
+void statsFile(FileStats* file)
+{
+    if (!collectStats) return;
+    pthread_mutex_lock(&statsLock);
+    if (fileCount == fileCapacity)
+    {
+        fileCapacity = fileCapacity ? fileCapacity * 2 : 64;
+        files = realloc(files, fileCapacity * sizeof(FileStats));
+    }
+    files[fileCount] = *file;
+    files[fileCount++].path = strdup(file->path);
+    pthread_mutex_unlock(&statsLock);
+}
+
+void statsPrune(void)
+{
+    atomic_fetch_add(&prunes, 1);
+}
+
+long statsPrunes(void)
+{
+    return atomic_load(&prunes);
+}
+
+void writeJSONString(FILE* out, char* string)
+{
+    fputc('"', out);
+    for (unsigned char* c = (unsigned char*)string; *c; c++)
+    {
+        if (*c == '"' || *c == '\\') fprintf(out, "\\%c", *c);
+        else if (*c < 0x20) fprintf(out, "\\u%04x", *c);
+        else fputc(*c, out);
+    }
+    fputc('"', out);
+}
+
+void writeStats(char* path, char* operation)
+{
+    if (!collectStats) return;
+    FILE* out = fopen(path, "w");
+    if (!out) SYS_DIE("fopen stats");
+
+    struct timespec cpu;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu);
+    pthread_mutex_lock(&statsLock);
+    fprintf(out, "{\n \"operation\": \"%s\",\n", operation);
+    fprintf(out, " \"series\": %s,\n", series ? "true" : "false");
+    fprintf(out, " \"wallSeconds\": %.6f,\n",
+        monotonicSeconds() - runStart);
+    fprintf(out, " \"cpuSeconds\": %.6f,\n",
+        cpu.tv_sec + cpu.tv_nsec / 1e9);
+    fprintf(out, " \"prunes\": %ld,\n", statsPrunes());
+
+    fprintf(out, " \"stages\": [");
+    for (int i = 0; i < stageCount; i++)
+    {
+        StageStats* stage = stages + i;
+        fprintf(out, "%s\n  {\"name\": ", i ? "," : "");
+        writeJSONString(out, stage->name);
+        fprintf(out, ", \"runs\": %d, \"wallSeconds\": %.6f, "
+            "\"cpuSeconds\": %.6f, \"bytesRead\": %lld, "
+            "\"bytesWritten\": %lld, \"readSyscalls\": %lld, "
+            "\"writeSyscalls\": %lld}", stage->runs, stage->wallSeconds,
+            stage->cpuSeconds, stage->io.bytesRead, stage->io.bytesWritten,
+            stage->io.readSyscalls, stage->io.writeSyscalls);
+    }
+    fprintf(out, "\n ],\n");
+
+    bool extracting = !strcmp(operation, "decrypt") ||
+        !strcmp(operation, "lzwdecompress");
+    fprintf(out, " \"files\": [");
+    for (int i = 0; i < fileCount; i++)
+    {
+        FileStats* file = files + i;
+        fprintf(out, "%s\n  {\"path\": ", i ? "," : "");
+        writeJSONString(out, file->path);
+        fprintf(out, ", \"size\": %lld", file->size);
+        if (file->storedSize >= 0)
+        {
+            fprintf(out, ", \"storedSize\": %lld, \"ratio\": %.6f",
+                file->storedSize, file->size ?
+                (double)file->storedSize / file->size : 0);
+        }
+        if (file->encoded >= 0)
+        {
+            fprintf(out, ", \"stored\": \"%s\"",
+                file->encoded ? "encoded" : "raw");
+        }
+        if (file->cached) fprintf(out, ", \"cached\": true");
+        fprintf(out, ", \"%s\": %.6f, \"%s\": %.6f, \"prunes\": %ld}",
+            extracting ? "decodeSeconds" : "encodeSeconds", file->codecSeconds,
+            extracting ? "crcCheckSeconds" : "crcSeconds", file->crcSeconds,
+            file->prunes);
+    }
+    fprintf(out, "\n ]\n}\n");
+    pthread_mutex_unlock(&statsLock);
+
+    if (fclose(out)) SYS_ERROR("fclose stats");
+}
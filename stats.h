@@ -0,0 +1,75 @@
+/**
+ * Run statistics for --stats: what each stage and each file cost, written as
+ * JSON when the run ends.
+ *
+ * Stages record their wall and CPU time and the bytes and system calls that
+ * went through fdread() and fdwrite() on their thread. Archived files record
+ * their size, how they were stored and how long encoding and the CRC took.
+ * Extracted files record decoding and CRC checking instead.
+ * Nothing is collected unless collectStats is set.
+ */
+
+#ifndef STATS_H
+#define STATS_H
+
+#include "bitcode.h"
+
+extern bool collectStats;
+
+// sets collectStats and starts timing the run
+void startStats(void);
+
+// counted by fdread() and fdwrite() for the calling thread
+// syscalls are the calls that reached the kernel instead of a channel
+typedef struct {
+    long long bytesRead;
+    long long bytesWritten;
+    long long readSyscalls;
+    long long writeSyscalls;
+} IOCounts;
+
+extern __thread IOCounts ioCounts;
+
+// where the calling thread was at some point
+typedef struct {
+    double wallSeconds;
+    double cpuSeconds;
+    IOCounts io;
+} StatsMark;
+
+void markStats(StatsMark* mark);
+
+// records a stage which ran on this thread since mark
+// stages with the same name are added together
+void statsStage(char* name, StatsMark* since);
+
+// a file archived or extracted
+typedef struct {
+    char* path;         // copied
+    long long size;
+    long long storedSize; // in the archive, -1 if unknown
+    int encoded;        // 1 if stored encoded, 0 if stored as is, -1 unknown
+    double codecSeconds; // encoding, or decoding on extract
+    double crcSeconds;   // computing, or checking on extract
+    long prunes;         // of the dictionary
+    bool cached;         // copied from the compression cache (see cache.h)
+} FileStats;
+
+void statsFile(FileStats* file);
+
+// counts a pruning of an LZW dictionary
+void statsPrune(void);
+// prunes counted so far
+long statsPrunes(void);
+
+// monotonic seconds, for timing
+double monotonicSeconds(void);
+
+// writes string as a JSON string. paths may contain anything but NUL
+void writeJSONString(FILE* out, char* string);
+
+// writes everything recorded to path as JSON
+// operation is what the run did, such as "encrypt"
+void writeStats(char* path, char* operation);
+
+#endif
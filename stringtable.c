@@ -1,6 +1,95 @@
 
 #include "stringtable.h"
 #include <stdlib.h>
+#include <pthread.h>
+
+// Nodes of freed tables are kept for the next tables, instead of going back
+// to malloc, in batches of at most NODE_BATCH. A thread takes nodes from a
+// batch of its own and gives them back to another, and trades only whole
+// batches with the spares shared by all threads, so nothing walks a list of
+// nodes to hand it over, and a thread never holds more than two batches.
+// Short-lived stage threads and long-lived workers running job after job
+// both reuse the same dictionary memory.
+#define NODE_BATCH (4096)
+
+// one full LZW dictionary (see MAX_BITS in lzw.c). more is freed
+#define SHARED_BATCHES ((1<<20) / NODE_BATCH)
+
+typedef struct {
+    Node first;
+    int count;
+} Batch;
+
+static __thread Batch takenNodes;    // from the shared spares
+static __thread Batch releasedNodes; // by this thread, handed out first
+static Batch sharedBatches[SHARED_BATCHES];
+static int sharedBatchCount = 0;
+static pthread_mutex_t sharedBatchesLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t threadExitKey;
+static pthread_once_t threadExitOnce = PTHREAD_ONCE_INIT;
+
+static void shareBatch(Batch* batch)
+{
+    if (!batch->count) return;
+    Node dropped = NULL;
+    pthread_mutex_lock(&sharedBatchesLock);
+    if (sharedBatchCount < SHARED_BATCHES)
+        sharedBatches[sharedBatchCount++] = *batch;
+    else dropped = batch->first;
+    pthread_mutex_unlock(&sharedBatchesLock);
+    for (int i = 0; dropped && i < batch->count; i++)
+    {
+        Node next = dropped->next;
+        free(dropped);
+        dropped = next;
+    }
+    *batch = (Batch){NULL, 0};
+}
+
+// runs as the thread exits, when its batches can still be reached
+static void shareThreadNodes(void* unused)
+{
+    shareBatch(&takenNodes);
+    shareBatch(&releasedNodes);
+}
+
+static void makeThreadExitKey(void)
+{
+    pthread_key_create(&threadExitKey, shareThreadNodes);
+}
+
+// the thread holds nodes, which must be shared when it exits
+static void watchThreadExit(void)
+{
+    pthread_once(&threadExitOnce, makeThreadExitKey);
+    pthread_setspecific(threadExitKey, &takenNodes);
+}
+
+static Node allocNode(void)
+{
+    // the last released are likeliest to be in cache
+    Batch* batch = releasedNodes.count ? &releasedNodes : &takenNodes;
+    if (!batch->count)
+    {
+        pthread_mutex_lock(&sharedBatchesLock);
+        if (sharedBatchCount) takenNodes = sharedBatches[--sharedBatchCount];
+        pthread_mutex_unlock(&sharedBatchesLock);
+        if (!takenNodes.count) return malloc(sizeof(struct node));
+        watchThreadExit();
+    }
+    Node node = batch->first;
+    batch->first = node->next;
+    batch->count--;
+    return node;
+}
+
+static void releaseNode(Node node)
+{
+    if (!releasedNodes.count) watchThreadExit();
+    node->next = releasedNodes.first;
+    releasedNodes.first = node;
+    if (++releasedNodes.count == NODE_BATCH) shareBatch(&releasedNodes);
+}
 
 int hash(int PREF, unsigned char CHAR)
 {
@@ -24,7 +113,7 @@ void freeTable(HashTable table)
         while (node)
         {
             Node next = node->next;
-            free(node);
+            releaseNode(node);
             node = next;
         }
     }
@@ -46,7 +135,7 @@ void growTable(HashTable table)
         {
             insertIntoTable(table, node->elt);
             Node next = node->next;
-            free(node);
+            releaseNode(node);
             node = next;
         }
     }
@@ -62,7 +151,7 @@ void insertIntoTable(HashTable table, Element elt)
         table->count++;
     }
     int bucket = hash(elt.PREF, elt.CHAR) % table->capacity;
-    Node newNode = calloc(sizeof(*newNode), 1);
+    Node newNode = allocNode();
     newNode->elt = elt;
     newNode->next = table->nodes[bucket];
     table->nodes[bucket] = newNode;
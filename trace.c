@@ -0,0 +1,139 @@
+#ifdef TRACE
+
+#define _GNU_SOURCE
+#include "trace.h"
+#include "encrypt.h"
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+typedef struct {
+    const char* name;
+    char phase;
+    long long nanoseconds;
+} TraceEvent;
+
+// a thread's events. kept after the thread ends, until the trace is written
+// a stage starts a thread per file, so when a thread ends its buffer is
+// passed on to the next thread with the same name, which appears in the
+// timeline as one thread
+typedef struct traceBuffer {
+    int id;
+    const char* threadName;
+    bool idle;          // its thread has ended
+    TraceEvent* events;
+    long count;
+    long capacity;
+    struct traceBuffer* next;
+} TraceBuffer;
+
+static __thread TraceBuffer* threadBuffer = NULL;
+// taken when a thread starts or ends tracing, and to write the trace
+static pthread_mutex_t buffersLock = PTHREAD_MUTEX_INITIALIZER;
+static TraceBuffer* buffers = NULL;
+static int bufferCount = 0;
+// its destructor marks the buffer of an ending thread idle
+static pthread_key_t bufferKey;
+static pthread_once_t bufferKeyOnce = PTHREAD_ONCE_INIT;
+
+static void releaseBuffer(void* buffer)
+{
+    pthread_mutex_lock(&buffersLock);
+    ((TraceBuffer*)buffer)->idle = true;
+    pthread_mutex_unlock(&buffersLock);
+}
+
+static void makeBufferKey(void)
+{
+    if (pthread_key_create(&bufferKey, releaseBuffer)) DIE("%s", "trace key");
+}
+
+static bool sameName(const char* one, const char* two)
+{
+    return one == two || (one && two && !strcmp(one, two));
+}
+
+// gives the calling thread an idle buffer with its name, or a new one
+static TraceBuffer* takeBuffer(const char* threadName)
+{
+    pthread_once(&bufferKeyOnce, makeBufferKey);
+    pthread_mutex_lock(&buffersLock);
+    TraceBuffer* buffer = buffers;
+    while (buffer && !(buffer->idle && sameName(buffer->threadName,
+        threadName))) buffer = buffer->next;
+    if (buffer) buffer->idle = false;
+    else
+    {
+        buffer = calloc(1, sizeof(TraceBuffer));
+        if (!buffer) DIE("%s", "Out of memory");
+        buffer->id = ++bufferCount;
+        buffer->threadName = threadName;
+        buffer->next = buffers;
+        buffers = buffer;
+    }
+    pthread_mutex_unlock(&buffersLock);
+    pthread_setspecific(bufferKey, buffer);
+    return threadBuffer = buffer;
+}
+
+void traceEvent(const char* name, char phase)
+{
+    TraceBuffer* buffer = threadBuffer ? threadBuffer : takeBuffer(NULL);
+    if (buffer->count == buffer->capacity)
+    {
+        buffer->capacity = buffer->capacity ? buffer->capacity * 2 : 256;
+        buffer->events = realloc(buffer->events,
+            buffer->capacity * sizeof(TraceEvent));
+        if (!buffer->events) DIE("%s", "Out of memory");
+    }
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    TraceEvent* event = buffer->events + buffer->count++;
+    event->name = name;
+    event->phase = phase;
+    event->nanoseconds = time.tv_sec * 1000000000LL + time.tv_nsec;
+}
+
+void traceThread(const char* name)
+{
+    if (!threadBuffer) takeBuffer(name);
+    else if (!threadBuffer->count) threadBuffer->threadName = name;
+}
+
+void writeTrace(char* path)
+{
+    FILE* out = fopen(path, "w");
+    if (!out) SYS_DIE("fopen trace");
+    int pid = getpid();
+
+    pthread_mutex_lock(&buffersLock);
+    fprintf(out, "{\"traceEvents\": [");
+    bool first = true;
+    for (TraceBuffer* buffer = buffers; buffer; buffer = buffer->next)
+    {
+        if (buffer->threadName)
+        {
+            fprintf(out, "%s\n{\"name\": \"thread_name\", \"ph\": \"M\", "
+                "\"pid\": %d, \"tid\": %d, \"args\": {\"name\": \"%s\"}}",
+                first ? "" : ",", pid, buffer->id, buffer->threadName);
+            first = false;
+        }
+        for (long i = 0; i < buffer->count; i++)
+        {
+            TraceEvent* event = buffer->events + i;
+            fprintf(out, "%s\n{\"name\": \"%s\", \"ph\": \"%c\", "
+                "\"ts\": %.3f, \"pid\": %d, \"tid\": %d}", first ? "" : ",",
+                event->name, event->phase, event->nanoseconds / 1000.0, pid,
+                buffer->id);
+            first = false;
+        }
+    }
+    fprintf(out, "\n]}\n");
+    pthread_mutex_unlock(&buffersLock);
+
+    if (fclose(out)) SYS_ERROR("fclose trace");
+}
+
+#endif
@@ -0,0 +1,36 @@
+/**
+ * Trace spans around the phases of a run: traversal, CRC, encoding, pruning,
+ * copying, encryption and waiting on rings. Built with make TRACE=1, each
+ * thread records its spans in its own buffer, and --trace=File writes them as
+ * Chrome trace events (load the file in chrome://tracing or Perfetto).
+ *
+ * Without TRACE the macros are empty, so tracing costs nothing.
+ * A span must begin and end on the same thread, with the same name.
+ */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#ifdef TRACE
+
+#define TRACE_BEGIN(name) traceEvent(name, 'B')
+#define TRACE_END(name) traceEvent(name, 'E')
+// names the calling thread in the timeline
+#define TRACE_THREAD(name) traceThread(name)
+
+// name must be a string literal or otherwise outlive the run
+void traceEvent(const char* name, char phase);
+void traceThread(const char* name);
+
+// writes every thread's spans to path as Chrome trace event JSON
+void writeTrace(char* path);
+
+#else
+
+#define TRACE_BEGIN(name) ((void)0)
+#define TRACE_END(name) ((void)0)
+#define TRACE_THREAD(name) ((void)0)
+
+#endif
+
+#endif